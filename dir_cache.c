@@ -0,0 +1,642 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include "dir_cache.h"
+
+/* the changes of the entries we are interested in */
+#define DIR_WATCH_MASK	(IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB |    \
+			 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |     \
+			 IN_MOVE_SELF | IN_ONLYDIR)
+
+#define DIR_EVENT_BUFSZ	(64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+static unsigned int hash_name(const char *name)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+void dir_body_put(struct dir_body *body)
+{
+	if (body && __atomic_sub_fetch(&body->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(body->data);
+		free(body);
+	}
+}
+
+static int *row_slot(struct dir_listing *listing, const char *name)
+{
+	return &listing->buckets[hash_name(name) & (listing->nbuckets - 1)];
+}
+
+static int row_find(struct dir_listing *listing, const char *name)
+{
+	int i = *row_slot(listing, name);
+
+	while (i != -1 && strcmp(listing->rows[i].name, name))
+		i = listing->rows[i].hnext;
+	return i;
+}
+
+/*
+ * Double the hash table, and link all of the rows again.
+ */
+static int row_rehash(struct dir_listing *listing)
+{
+	int i, *slot;
+	int nbuckets = listing->nbuckets ? listing->nbuckets * 2 : 64;
+	int *buckets = malloc(nbuckets * sizeof(*buckets));
+
+	if (!buckets) {
+		perror("allocate memory for listing buckets error");
+		return -1;
+	}
+
+	free(listing->buckets);
+	listing->buckets = buckets;
+	listing->nbuckets = nbuckets;
+	for (i = 0; i < nbuckets; i++)
+		buckets[i] = -1;
+
+	for (i = 0; i < listing->nrows; i++) {
+		slot = row_slot(listing, listing->rows[i].name);
+		listing->rows[i].hnext = *slot;
+		*slot = i;
+	}
+	return 0;
+}
+
+/*
+ * Add a stale row of 'name', return its index, -1 on error.
+ */
+static int row_add(struct dir_listing *listing, const char *name)
+{
+	int *slot;
+	struct dir_row *row;
+
+	if (listing->nrows == listing->maxrows) {
+		int maxrows = listing->maxrows ? listing->maxrows * 2 : 64;
+
+		if (!(row = realloc(listing->rows, maxrows * sizeof(*row)))) {
+			perror("allocate memory for listing rows error");
+			return -1;
+		}
+		listing->rows = row;
+		listing->maxrows = maxrows;
+	}
+
+	if (listing->nrows >= listing->nbuckets && row_rehash(listing) == -1)
+		return -1;
+
+	row = &listing->rows[listing->nrows];
+	if (!(row->name = strdup(name))) {
+		perror("allocate memory for listing row error");
+		return -1;
+	}
+	row->html = NULL;
+	row->len = 0;
+	row->gen = ++listing->gen;
+
+	slot = row_slot(listing, name);
+	row->hnext = *slot;
+	*slot = listing->nrows;
+
+	listing->nstale++;
+	return listing->nrows++;
+}
+
+static void row_unlink(struct dir_listing *listing, int idx)
+{
+	int *pp = row_slot(listing, listing->rows[idx].name);
+
+	while (*pp != idx)
+		pp = &listing->rows[*pp].hnext;
+	*pp = listing->rows[idx].hnext;
+}
+
+/*
+ * Remove the row, the last row is moved to its place.
+ */
+static void row_del(struct dir_listing *listing, int idx)
+{
+	int last = listing->nrows - 1;
+	int *pp;
+	struct dir_row *row = &listing->rows[idx];
+
+	row_unlink(listing, idx);
+	if (!row->html)
+		listing->nstale--;
+	free(row->name);
+	free(row->html);
+
+	if (idx != last) {
+		pp = row_slot(listing, listing->rows[last].name);
+		while (*pp != last)
+			pp = &listing->rows[*pp].hnext;
+		*pp = idx;
+		*row = listing->rows[last];
+	}
+	listing->nrows--;
+	listing->changed = 1;
+}
+
+static void row_mark_stale(struct dir_listing *listing, int idx)
+{
+	struct dir_row *row = &listing->rows[idx];
+
+	if (row->html) {
+		free(row->html);
+		row->html = NULL;
+		listing->nstale++;
+	}
+	/* the one being rendered is out of date too. */
+	row->gen = ++listing->gen;
+	listing->changed = 1;
+}
+
+/*
+ * Mark the row of 'name' stale, add it if it's new.
+ */
+static void row_touch(struct dir_listing *listing, const char *name)
+{
+	int idx = row_find(listing, name);
+
+	if (idx == -1)
+		row_add(listing, name);
+	else
+		row_mark_stale(listing, idx);
+	listing->changed = 1;
+}
+
+static void lru_del(struct dir_cache *cache, struct dir_listing *listing)
+{
+	if (listing->prev)
+		listing->prev->next = listing->next;
+	else
+		cache->head = listing->next;
+	if (listing->next)
+		listing->next->prev = listing->prev;
+	else
+		cache->tail = listing->prev;
+	listing->prev = listing->next = NULL;
+}
+
+static void lru_add(struct dir_cache *cache, struct dir_listing *listing)
+{
+	listing->prev = NULL;
+	listing->next = cache->head;
+	if (cache->head)
+		cache->head->prev = listing;
+	else
+		cache->tail = listing;
+	cache->head = listing;
+}
+
+static void dir_listing_free(struct dir_listing *listing)
+{
+	int i;
+
+	for (i = 0; i < listing->nrows; i++) {
+		free(listing->rows[i].name);
+		free(listing->rows[i].html);
+	}
+	free(listing->rows);
+	free(listing->buckets);
+	free(listing->pathname);
+	dir_body_put(listing->body);
+	free(listing);
+}
+
+static void dir_listing_put(struct dir_listing *listing)
+{
+	if (--listing->refcnt == 0)
+		dir_listing_free(listing);
+}
+
+/*
+ * Remove it from the cache. the request building it still holds it, and
+ * frees it when it's done.
+ */
+static void dir_listing_drop(struct dir_cache *cache,
+			     struct dir_listing *listing)
+{
+	lru_del(cache, listing);
+	cache->ndirs--;
+	if (listing->wd != -1)
+		inotify_rm_watch(cache->ifd, listing->wd);
+	listing->wd = -1;
+	listing->dropped = 1;
+	dir_listing_put(listing);
+}
+
+static struct dir_listing *dir_listing_find_wd(struct dir_cache *cache, int wd)
+{
+	struct dir_listing *listing;
+
+	for (listing = cache->head; listing; listing = listing->next) {
+		if (listing->wd == wd)
+			break;
+	}
+	return listing;
+}
+
+static void dir_event_apply(struct dir_cache *cache,
+			    const struct inotify_event *ev)
+{
+	int idx;
+	struct dir_listing *listing;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		/* some events are lost, nothing can be trusted. */
+		while (cache->head)
+			dir_listing_drop(cache, cache->head);
+		return;
+	}
+
+	if (!(listing = dir_listing_find_wd(cache, ev->wd)))
+		return;
+
+	if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+		if (ev->mask & IN_IGNORED)
+			listing->wd = -1;	/* already removed */
+		dir_listing_drop(cache, listing);
+		return;
+	}
+
+	if (!ev->len)
+		return;
+
+	/*
+	 * the directory is being read, the name may be added by it after the
+	 * event. render decides whether it's still there.
+	 */
+	if ((ev->mask & (IN_DELETE | IN_MOVED_FROM)) && !listing->loading) {
+		if ((idx = row_find(listing, ev->name)) != -1)
+			row_del(listing, idx);
+	} else {
+		row_touch(listing, ev->name);
+	}
+
+	/* the modification time of the directory itself has changed too. */
+	if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+		row_touch(listing, ".");
+}
+
+/*
+ * Apply all of the pending inotify events. the cache must be locked.
+ */
+static void dir_cache_sync(struct dir_cache *cache)
+{
+	char buf[DIR_EVENT_BUFSZ]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	char *ptr;
+	ssize_t nread;
+	const struct inotify_event *ev;
+
+	while ((nread = read(cache->ifd, buf, sizeof(buf))) > 0) {
+		for (ptr = buf; ptr < buf + nread;
+		     ptr += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)ptr;
+			dir_event_apply(cache, ev);
+		}
+	}
+}
+
+static struct dir_listing *dir_listing_alloc(const char *pathname)
+{
+	struct dir_listing *listing = calloc(1, sizeof(*listing));
+
+	if (!listing) {
+		perror("allocate memory for listing error");
+		return NULL;
+	}
+	listing->wd = -1;
+	listing->refcnt = 1;
+
+	if (!(listing->pathname = strdup(pathname)) ||
+	    row_rehash(listing) == -1) {
+		dir_listing_free(listing);
+		return NULL;
+	}
+	return listing;
+}
+
+/*
+ * Create the listing of 'pathname' and start watching it, with the cache
+ * locked. it has no row until dir_listing_load().
+ */
+static struct dir_listing *dir_listing_new(struct dir_cache *cache,
+					   const char *pathname)
+{
+	struct dir_listing *old;
+	struct dir_listing *listing = dir_listing_alloc(pathname);
+
+	if (!listing)
+		return NULL;
+
+	/* watch it before reading, so the changes during reading are seen. */
+	if ((listing->wd = inotify_add_watch(cache->ifd, pathname,
+					     DIR_WATCH_MASK)) == -1) {
+		dir_listing_free(listing);
+		return NULL;
+	}
+
+	/*
+	 * the same directory reached by another pathname shares the watch,
+	 * take it over from the old listing.
+	 */
+	if ((old = dir_listing_find_wd(cache, listing->wd))) {
+		old->wd = -1;
+		dir_listing_drop(cache, old);
+	}
+
+	listing->loading = 1;
+	listing->changed = 1;
+	return listing;
+}
+
+/*
+ * Read the directory into the rows, the cache is unlocked meanwhile. the
+ * names are collected in a private listing first, since the events keep
+ * adding rows to the shared one.
+ */
+static int dir_listing_load(struct dir_cache *cache,
+			    struct dir_listing *listing)
+{
+	int i, err = 0;
+	DIR *dir;
+	struct dirent *ent;
+	struct dir_listing *names;
+
+	pthread_mutex_unlock(&cache->lock);
+	if ((names = dir_listing_alloc(listing->pathname)) &&
+	    (dir = opendir(listing->pathname))) {
+		while ((ent = readdir(dir))) {
+			if (row_find(names, ent->d_name) == -1 &&
+			    row_add(names, ent->d_name) == -1) {
+				err = errno;
+				break;
+			}
+		}
+		closedir(dir);
+	} else {
+		err = errno;
+	}
+	pthread_mutex_lock(&cache->lock);
+
+	for (i = 0; !err && i < names->nrows; i++) {
+		if (row_find(listing, names->rows[i].name) == -1 &&
+		    row_add(listing, names->rows[i].name) == -1)
+			err = errno;
+	}
+	if (names)
+		dir_listing_free(names);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	listing->loading = 0;
+	return 0;
+}
+
+/* a stale row rendered with the cache unlocked */
+struct dir_render {
+	char *name;
+	unsigned long gen;	/* of the row when it's taken */
+	char *html;
+	int len;
+};
+
+/*
+ * Render the stale rows, the cache is unlocked meanwhile. a row which has
+ * been changed again since is left stale, and rendered by the next round.
+ */
+static int dir_listing_render(struct dir_cache *cache,
+			      struct dir_listing *listing)
+{
+	int i, n = 0, idx, err = 0;
+	char buf[DIR_ROW_BUFSZ];
+	struct dir_row *row;
+	struct dir_render *todo;
+
+	if (!(todo = calloc(listing->nstale, sizeof(*todo)))) {
+		perror("allocate memory for listing rows error");
+		return -1;
+	}
+	for (i = 0; i < listing->nrows && n < listing->nstale; i++) {
+		row = &listing->rows[i];
+		if (row->html)
+			continue;
+		if (!(todo[n].name = strdup(row->name))) {
+			perror("allocate memory for listing row error");
+			err = errno;
+			goto out;
+		}
+		todo[n++].gen = row->gen;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+	for (i = 0; i < n; i++) {
+		todo[i].len = cache->render(listing->pathname, todo[i].name,
+					    buf, sizeof(buf));
+		if (todo[i].len < 0)
+			continue;
+		if (!(todo[i].html = malloc(todo[i].len))) {
+			perror("allocate memory for listing row error");
+			err = errno;
+			break;
+		}
+		memcpy(todo[i].html, buf, todo[i].len);
+	}
+	pthread_mutex_lock(&cache->lock);
+
+	for (i = 0; !err && i < n; i++) {
+		if ((idx = row_find(listing, todo[i].name)) == -1)
+			continue;
+		row = &listing->rows[idx];
+		if (row->html || row->gen != todo[i].gen)
+			continue;
+		if (todo[i].len < 0) {
+			row_del(listing, idx);
+			continue;
+		}
+		row->html = todo[i].html;
+		row->len = todo[i].len;
+		todo[i].html = NULL;
+		listing->nstale--;
+	}
+out:
+	for (i = 0; i < n; i++) {
+		free(todo[i].name);
+		free(todo[i].html);
+	}
+	free(todo);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Read the directory if it's new, render the stale rows, and concatenate all
+ * of them to a new body if the listing has been changed. it's called with the
+ * cache locked and returns so, the lock is dropped while doing the I/O.
+ */
+static int dir_listing_build(struct dir_cache *cache,
+			     struct dir_listing *listing)
+{
+	int i;
+	size_t total = 0;
+	struct dir_body *body;
+
+	if (listing->loading && dir_listing_load(cache, listing) == -1)
+		return -1;
+
+	while (listing->nstale) {
+		if (dir_listing_render(cache, listing) == -1)
+			return -1;
+	}
+
+	if (!listing->changed)
+		return 0;
+
+	for (i = 0; i < listing->nrows; i++)
+		total += listing->rows[i].len;
+
+	if (!(body = calloc(1, sizeof(*body))) ||
+	    !(body->data = malloc(total ? total : 1))) {
+		perror("allocate memory for listing body error");
+		free(body);
+		return -1;
+	}
+
+	for (i = 0; i < listing->nrows; i++) {
+		memcpy(body->data + body->len, listing->rows[i].html,
+		       listing->rows[i].len);
+		body->len += listing->rows[i].len;
+	}
+	body->refcnt = 1;
+
+	dir_body_put(listing->body);
+	listing->body = body;
+	listing->changed = 0;
+	return 0;
+}
+
+/*
+ * Return the rendered rows of the directory 'pathname' with a reference, NULL
+ * on error, and errno tells why. the cache is locked only to look it up and
+ * to apply the events, the other directories are served while it's built.
+ */
+struct dir_body *dir_cache_get(struct dir_cache *cache, const char *pathname)
+{
+	int err = 0;
+	struct dir_listing *listing;
+	struct dir_body *body = NULL;
+
+	pthread_mutex_lock(&cache->lock);
+again:
+	dir_cache_sync(cache);
+
+	for (listing = cache->head; listing; listing = listing->next) {
+		if (!strcmp(listing->pathname, pathname))
+			break;
+	}
+
+	if (listing) {
+		lru_del(cache, listing);
+		lru_add(cache, listing);
+	} else {
+		if (!(listing = dir_listing_new(cache, pathname))) {
+			err = errno;
+			goto out;
+		}
+
+		if (cache->ndirs == cache->max_dirs)
+			dir_listing_drop(cache, cache->tail);
+		lru_add(cache, listing);
+		cache->ndirs++;
+	}
+
+	if (listing->building) {
+		pthread_cond_wait(&cache->built, &cache->lock);
+		goto again;
+	}
+
+	if (listing->loading || listing->nstale || listing->changed) {
+		listing->building = 1;
+		listing->refcnt++;
+		if (dir_listing_build(cache, listing) == -1)
+			err = errno;
+		listing->building = 0;
+		pthread_cond_broadcast(&cache->built);
+
+		/* the directory couldn't be read, don't keep it. */
+		if (err && listing->loading && !listing->dropped)
+			dir_listing_drop(cache, listing);
+		if (!err) {
+			body = listing->body;
+			__atomic_add_fetch(&body->refcnt, 1, __ATOMIC_RELAXED);
+		}
+		dir_listing_put(listing);
+		goto out;
+	}
+
+	body = listing->body;
+	__atomic_add_fetch(&body->refcnt, 1, __ATOMIC_RELAXED);
+out:
+	pthread_mutex_unlock(&cache->lock);
+	errno = err;
+	return body;
+}
+
+/*
+ * Create the cache, NULL is returned if the inotify isn't available, since
+ * we couldn't know when the listing becomes stale.
+ */
+struct dir_cache *dir_cache_new(int max_dirs, dir_render_fn render)
+{
+	struct dir_cache *cache = calloc(1, sizeof(*cache));
+
+	if (!cache) {
+		perror("allocate memory for directory cache error");
+		return NULL;
+	}
+
+	if ((cache->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		perror("inotify_init1 error, directory cache is disabled");
+		free(cache);
+		return NULL;
+	}
+
+	cache->max_dirs = max_dirs;
+	cache->render = render;
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->built, NULL);
+	return cache;
+}
+
+void dir_cache_delete(struct dir_cache *cache)
+{
+	if (!cache)
+		return;
+
+	while (cache->head)
+		dir_listing_drop(cache, cache->head);
+	close(cache->ifd);
+	pthread_mutex_destroy(&cache->lock);
+	pthread_cond_destroy(&cache->built);
+	free(cache);
+}
@@ -0,0 +1,78 @@
+#include <pthread.h>
+#include <sys/types.h>
+
+/* default maximum number of directories whose listing is cached */
+#define DIR_CACHE_DIRS		64
+/* buffer size of one rendered row */
+#define DIR_ROW_BUFSZ		1024
+
+/*
+ * Render the row of 'name' under the directory 'dirpath' into 'buf'. return
+ * the length of the row, or -1 if the entry should not be listed.
+ */
+typedef int (*dir_render_fn)(const char *dirpath, const char *name,
+			     char *buf, size_t size);
+
+/*
+ * The rendered rows of a directory, concatenated. read-only, a request holds
+ * a reference while sending it, even if the listing has been changed since.
+ */
+struct dir_body {
+	char *data;
+	size_t len;
+	int refcnt;
+};
+
+struct dir_row {
+	char *name;
+	char *html;		/* rendered row, NULL if it's stale */
+	size_t len;
+	int hnext;		/* next row in the same bucket, -1 if none */
+	unsigned long gen;	/* of the listing, when it became stale */
+};
+
+/*
+ * The listing of one directory. The directory is watched by inotify, the
+ * events mark the rows of the changed entries stale, and only they will be
+ * rendered again on the next request.
+ *
+ * All of it is protected by the lock of cache, but it's released while the
+ * directory is read and the rows are rendered, by one request at a time
+ * ('building' set). the others of the same directory wait for it.
+ */
+struct dir_listing {
+	char *pathname;
+	int wd;			/* inotify watch descriptor */
+	struct dir_row *rows;
+	int nrows;
+	int maxrows;
+	int *buckets;		/* name -> index of rows */
+	int nbuckets;		/* power of 2 */
+	int nstale;		/* rows need to be rendered */
+	int changed;		/* 1 if 'body' is out of date */
+	int loading;		/* 1 until the directory has been read */
+	int building;		/* 1 while a request renders it unlocked */
+	int dropped;		/* 1 if it's not in the cache any more */
+	int refcnt;		/* the cache and the request building it */
+	unsigned long gen;	/* bumped by each row turned stale */
+	struct dir_body *body;
+	struct dir_listing *prev;	/* LRU list, the head is the newest */
+	struct dir_listing *next;
+};
+
+struct dir_cache {
+	pthread_mutex_t lock;
+	pthread_cond_t built;	/* a listing is not 'building' any more */
+	int ifd;		/* inotify instance */
+	int max_dirs;
+	int ndirs;
+	dir_render_fn render;
+	struct dir_listing *head;
+	struct dir_listing *tail;
+};
+
+
+struct dir_cache *dir_cache_new(int max_dirs, dir_render_fn render);
+struct dir_body *dir_cache_get(struct dir_cache *cache, const char *pathname);
+void dir_body_put(struct dir_body *body);
+void dir_cache_delete(struct dir_cache *cache);
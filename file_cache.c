@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "file_cache.h"
+
+/* FNV-1a hash of the pathname. */
+static unsigned int hash_pathname(const char *pathname)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*pathname) {
+		hash ^= (unsigned char)*pathname++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Fill the entry by one open() and fstat() if it's a regular file, so the
+ * metadata describes the very file of the descriptor even if the pathname
+ * is replaced meanwhile. the other ones, or the file we can't open, get a
+ * stat(). The descriptor is kept in the entry if 'keep_fd' is true.
+ */
+static void file_entry_load(struct file_entry *entry, int keep_fd)
+{
+	int fd;
+	struct stat st;
+
+	entry->fd = -1;
+
+	/* nonblocking, a FIFO would wait for its writer otherwise. */
+	fd = open(entry->pathname, O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	if (fd != -1 && (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1 && stat(entry->pathname, &st) == -1) {
+		entry->error = errno;
+		return;
+	}
+
+	entry->mode = st.st_mode;
+	entry->size = st.st_size;
+	entry->mtime = st.st_mtim.tv_sec;
+	entry->mtime_nsec = st.st_mtim.tv_nsec;
+	entry->dev = st.st_dev;
+	entry->ino = st.st_ino;
+
+	/* opened, as the way it will be read, so we have the permission. */
+	if (fd == -1)
+		return;
+
+	entry->readable = 1;
+	if (keep_fd)
+		entry->fd = fd;
+	else
+		close(fd);
+}
+
+static struct file_entry *file_entry_new(const char *pathname,
+					 unsigned int hash)
+{
+	struct file_entry *entry = calloc(1, sizeof(*entry));
+
+	if (!entry) {
+		perror("allocate memory for file entry error");
+		return NULL;
+	}
+
+	if (!(entry->pathname = strdup(pathname))) {
+		perror("allocate memory for pathname of file entry error");
+		free(entry);
+		return NULL;
+	}
+
+	entry->hash = hash;
+	entry->refcnt = 1;
+	return entry;
+}
+
+static void file_entry_free(struct file_cache *cache, struct file_entry *entry)
+{
+	if (entry->fd != -1) {
+		close(entry->fd);
+		if (cache)
+			__atomic_sub_fetch(&cache->nfds, 1, __ATOMIC_RELAXED);
+	}
+	free(entry->pathname);
+	free(entry);
+}
+
+/*
+ * Drop a reference, the last one frees the entry.
+ */
+void file_cache_put(struct file_cache *cache, struct file_entry *entry)
+{
+	if (entry && __atomic_sub_fetch(&entry->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		file_entry_free(cache, entry);
+}
+
+/*
+ * Reserve a descriptor slot of the cache, return 1 on success.
+ */
+static int file_cache_reserve_fd(struct file_cache *cache)
+{
+	if (__atomic_add_fetch(&cache->nfds, 1, __ATOMIC_RELAXED) <=
+	    cache->max_fds)
+		return 1;
+	__atomic_sub_fetch(&cache->nfds, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* the counter of linked entries 'entry' belongs to. */
+static int *file_cache_count(struct file_cache *cache,
+			     struct file_entry *entry)
+{
+	return entry->error ? &cache->nnegative : &cache->nentries;
+}
+
+/* unlink *pp, with the bucket locked. the users still hold it if any. */
+static void file_cache_unlink(struct file_cache *cache,
+			      struct file_entry **pp)
+{
+	struct file_entry *entry = *pp;
+
+	*pp = entry->next;
+	__atomic_sub_fetch(file_cache_count(cache, entry), 1,
+			   __ATOMIC_RELAXED);
+	file_cache_put(cache, entry);
+}
+
+/*
+ * Unlink the expired entries of all buckets, at most once a second as they
+ * expire by seconds. so the descriptor of a file nobody asks for again is
+ * closed, and the full cache gets its room back. it's called without any
+ * bucket locked.
+ */
+static void file_cache_sweep(struct file_cache *cache, time_t now)
+{
+	unsigned int i;
+	time_t swept = __atomic_load_n(&cache->swept, __ATOMIC_RELAXED);
+	struct file_bucket *bucket;
+	struct file_entry *entry, **pp;
+
+	if (swept >= now ||
+	    !__atomic_compare_exchange_n(&cache->swept, &swept, now, 0,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+
+	for (i = 0; i <= cache->mask; i++) {
+		bucket = &cache->buckets[i];
+		if (!__atomic_load_n(&bucket->head, __ATOMIC_RELAXED))
+			continue;
+		pthread_mutex_lock(&bucket->lock);
+		for (pp = &bucket->head; (entry = *pp);) {
+			if (entry->expire <= now)
+				file_cache_unlink(cache, pp);
+			else
+				pp = &entry->next;
+		}
+		pthread_mutex_unlock(&bucket->lock);
+	}
+}
+
+/*
+ * Look up the pathname, and return the entry with a reference. The stale
+ * entry is replaced by a new one. if 'cache' is NULL, or it's full, a private
+ * entry which is not linked to the cache is returned. NULL is returned only
+ * if out of memory. the missing pathnames have a smaller room of their own,
+ * a scan of them never takes the room of the files.
+ */
+struct file_entry *file_cache_get(struct file_cache *cache,
+				  const char *pathname)
+{
+	int keep_fd, *count, max;
+	time_t now;
+	unsigned int hash = hash_pathname(pathname);
+	struct file_bucket *bucket;
+	struct file_entry *entry, **pp;
+
+	if (!cache) {
+		if ((entry = file_entry_new(pathname, hash)))
+			file_entry_load(entry, 0);
+		return entry;
+	}
+
+	now = time(NULL);
+	file_cache_sweep(cache, now);
+	bucket = &cache->buckets[hash & cache->mask];
+	pthread_mutex_lock(&bucket->lock);
+
+	for (pp = &bucket->head; (entry = *pp); pp = &entry->next) {
+		if (entry->hash != hash || strcmp(entry->pathname, pathname))
+			continue;
+
+		if (entry->expire > now) {
+			__atomic_add_fetch(&entry->refcnt, 1, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&bucket->lock);
+			return entry;
+		}
+
+		file_cache_unlink(cache, pp);	/* stale */
+		break;
+	}
+
+	/*
+	 * load it with the bucket locked, so the concurrent requests of the
+	 * same pathname won't stat() it again.
+	 */
+	if (!(entry = file_entry_new(pathname, hash)))
+		goto out;
+
+	keep_fd = __atomic_load_n(&cache->nentries, __ATOMIC_RELAXED) <
+		  cache->max_entries && file_cache_reserve_fd(cache);
+	file_entry_load(entry, keep_fd);
+	if (keep_fd && entry->fd == -1)
+		__atomic_sub_fetch(&cache->nfds, 1, __ATOMIC_RELAXED);
+
+	count = file_cache_count(cache, entry);
+	max = entry->error ? cache->max_negative : cache->max_entries;
+	if (__atomic_add_fetch(count, 1, __ATOMIC_RELAXED) > max) {
+		__atomic_sub_fetch(count, 1, __ATOMIC_RELAXED);
+		goto out;	/* full, the fd is closed by the last put */
+	}
+
+	entry->expire = now + cache->ttl;
+	entry->refcnt++;		/* the reference of the cache */
+	entry->next = bucket->head;
+	bucket->head = entry;
+out:
+	pthread_mutex_unlock(&bucket->lock);
+	return entry;
+}
+
+struct file_cache *file_cache_new(int ttl, int max_entries, int max_fds)
+{
+	unsigned int i;
+	struct file_cache *cache = calloc(1, sizeof(*cache));
+
+	if (!cache) {
+		perror("allocate memory for file cache error");
+		return NULL;
+	}
+
+	cache->ttl = ttl;
+	cache->max_entries = max_entries;
+	cache->max_negative = max_entries / FILE_CACHE_NEGATIVE;
+	cache->max_fds = max_fds;
+	cache->mask = FILE_CACHE_BUCKETS - 1;
+	if (!(cache->buckets = calloc(FILE_CACHE_BUCKETS,
+				      sizeof(*cache->buckets)))) {
+		perror("allocate memory for file cache buckets error");
+		free(cache);
+		return NULL;
+	}
+
+	for (i = 0; i <= cache->mask; i++)
+		pthread_mutex_init(&cache->buckets[i].lock, NULL);
+
+	return cache;
+}
+
+/*
+ * Release all of the entries. All of the references got by file_cache_get()
+ * must have been dropped.
+ */
+void file_cache_delete(struct file_cache *cache)
+{
+	unsigned int i;
+	struct file_entry *entry;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i <= cache->mask; i++) {
+		while ((entry = cache->buckets[i].head)) {
+			cache->buckets[i].head = entry->next;
+			file_cache_put(cache, entry);
+		}
+		pthread_mutex_destroy(&cache->buckets[i].lock);
+	}
+	free(cache->buckets);
+	free(cache);
+}
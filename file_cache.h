@@ -0,0 +1,60 @@
+#include <pthread.h>
+#include <sys/types.h>
+
+/* default number of hash buckets, must be power of 2 */
+#define FILE_CACHE_BUCKETS	1024
+/* default maximum number of entries */
+#define FILE_CACHE_ENTRIES	4096
+/* default maximum number of descriptors kept open by the entries */
+#define FILE_CACHE_FDS		256
+/* the entries of missing pathnames get 1/n of max_entries on their own */
+#define FILE_CACHE_NEGATIVE	4
+
+/*
+ * Everything we need to know about a pathname to answer a request. An entry
+ * is got by file_cache_get() with a reference, and must be released by
+ * file_cache_put() when it's not used any more, it's read-only between them.
+ */
+struct file_entry {
+	int error;		/* errno of stat(), 0 if it exists */
+	mode_t mode;
+	off_t size;
+	time_t mtime;
+	long mtime_nsec;	/* a rewrite in the same second changes it */
+	dev_t dev;
+	ino_t ino;
+	int readable;		/* 1 if we have permission to read it */
+	int fd;			/* opened regular file, -1 if not kept */
+
+	/* private */
+	char *pathname;
+	unsigned int hash;
+	time_t expire;		/* the entry is stale after it */
+	int refcnt;
+	struct file_entry *next;
+};
+
+struct file_bucket {
+	pthread_mutex_t lock;
+	struct file_entry *head;
+};
+
+struct file_cache {
+	int ttl;		/* seconds an entry is trusted */
+	int max_entries;
+	int max_negative;	/* of the entries whose stat() failed */
+	int max_fds;
+	int nentries;		/* number of entries linked, stat() succeeded */
+	int nnegative;		/* number of entries linked, stat() failed */
+	int nfds;		/* number of descriptors held */
+	time_t swept;		/* when the expired entries were unlinked */
+	unsigned int mask;	/* number of buckets - 1 */
+	struct file_bucket *buckets;
+};
+
+
+struct file_cache *file_cache_new(int ttl, int max_entries, int max_fds);
+struct file_entry *file_cache_get(struct file_cache *cache,
+				  const char *pathname);
+void file_cache_put(struct file_cache *cache, struct file_entry *entry);
+void file_cache_delete(struct file_cache *cache);
@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "hot_cache.h"
+
+static unsigned int hash_pathname(const char *pathname)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*pathname) {
+		hash ^= (unsigned char)*pathname++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static struct hot_shard *hot_shard_of(struct hot_cache *cache,
+				      unsigned int hash)
+{
+	return &cache->shards[hash & (HOT_CACHE_SHARDS - 1)];
+}
+
+static struct hot_object **hot_bucket_of(struct hot_shard *shard,
+					 unsigned int hash)
+{
+	/* the low bits have been used to select the shard. */
+	return &shard->buckets[(hash >> 4) & (HOT_CACHE_BUCKETS - 1)];
+}
+
+static void hot_object_free(struct hot_object *obj)
+{
+	free(obj->data);
+	free(obj->pathname);
+	free(obj);
+}
+
+void hot_cache_put(struct hot_object *obj)
+{
+	if (obj && __atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		hot_object_free(obj);
+}
+
+static void lru_del(struct hot_shard *shard, struct hot_object *obj)
+{
+	if (obj->prev)
+		obj->prev->next = obj->next;
+	else
+		shard->lru_head = obj->next;
+	if (obj->next)
+		obj->next->prev = obj->prev;
+	else
+		shard->lru_tail = obj->prev;
+	obj->prev = obj->next = NULL;
+}
+
+static void lru_add(struct hot_shard *shard, struct hot_object *obj)
+{
+	obj->prev = NULL;
+	obj->next = shard->lru_head;
+	if (shard->lru_head)
+		shard->lru_head->prev = obj;
+	else
+		shard->lru_tail = obj;
+	shard->lru_head = obj;
+}
+
+/*
+ * Unlink the object from the shard, and drop the reference of the cache.
+ * the shard must be locked.
+ */
+static void hot_object_unlink(struct hot_shard *shard, struct hot_object *obj)
+{
+	struct hot_object **pp = hot_bucket_of(shard, obj->hash);
+
+	while (*pp != obj)
+		pp = &(*pp)->hnext;
+	*pp = obj->hnext;
+
+	lru_del(shard, obj);
+	shard->bytes -= obj->len;
+	hot_cache_put(obj);
+}
+
+/*
+ * Find the object of 'pathname', which was built from the same file as 'key'.
+ * return it with a reference, or NULL if not found. The object is out of date
+ * is removed.
+ */
+struct hot_object *hot_cache_get(struct hot_cache *cache, const char *pathname,
+				 const struct hot_key *key)
+{
+	unsigned int hash = hash_pathname(pathname);
+	struct hot_shard *shard = hot_shard_of(cache, hash);
+	struct hot_object *obj;
+
+	pthread_mutex_lock(&shard->lock);
+	for (obj = *hot_bucket_of(shard, hash); obj; obj = obj->hnext) {
+		if (obj->hash == hash && !strcmp(obj->pathname, pathname))
+			break;
+	}
+
+	if (obj && memcmp(&obj->key, key, sizeof(*key))) {
+		hot_object_unlink(shard, obj);
+		obj = NULL;
+	}
+
+	if (obj) {
+		lru_del(shard, obj);
+		lru_add(shard, obj);
+		__atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	return obj;
+}
+
+static int read_fully(int fd, char *buf, size_t count)
+{
+	ssize_t nread;
+	size_t offset = 0;
+
+	while (offset < count) {
+		nread = pread(fd, buf + offset, count - offset, offset);
+		if (nread == -1 && errno == EINTR)
+			continue;
+		if (nread <= 0)
+			return -1;
+		offset += nread;
+	}
+	return 0;
+}
+
+/*
+ * Allocate the object of 'pathname' with the 'header' copied, and the room
+ * of 'body_len' bytes left after it.
+ */
+static struct hot_object *hot_object_new(const char *pathname,
+					 const struct hot_key *key,
+					 const char *header, size_t header_len,
+					 size_t body_len)
+{
+	struct hot_object *obj;
+
+	if (!(obj = calloc(1, sizeof(*obj)))) {
+		perror("allocate memory for hot object error");
+		return NULL;
+	}
+
+	obj->len = header_len + body_len;
+	if (!(obj->pathname = strdup(pathname)) ||
+	    !(obj->data = malloc(obj->len))) {
+		perror("allocate memory for hot object data error");
+		hot_object_free(obj);
+		return NULL;
+	}
+
+	memcpy(obj->data, header, header_len);
+	obj->header_len = header_len;
+	obj->hash = hash_pathname(pathname);
+	obj->key = *key;
+	obj->refcnt = 2;	/* the caller's and the cache's */
+	return obj;
+}
+
+/*
+ * Add the object to the cache, it replaces the old one of the same pathname.
+ * the least recently used objects are evicted if there is no enough room.
+ */
+static void hot_cache_insert(struct hot_cache *cache, struct hot_object *obj)
+{
+	struct hot_shard *shard = hot_shard_of(cache, obj->hash);
+	struct hot_object *old, **bucket;
+
+	pthread_mutex_lock(&shard->lock);
+	bucket = hot_bucket_of(shard, obj->hash);
+	for (old = *bucket; old; old = old->hnext) {
+		if (old->hash == obj->hash &&
+		    !strcmp(old->pathname, obj->pathname)) {
+			hot_object_unlink(shard, old);
+			break;
+		}
+	}
+
+	while (shard->lru_tail && shard->bytes + obj->len > cache->max_bytes)
+		hot_object_unlink(shard, shard->lru_tail);
+
+	obj->hnext = *bucket;
+	*bucket = obj;
+	lru_add(shard, obj);
+	shard->bytes += obj->len;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Build the object from the 'header' and the file 'fd' of 'key->size' bytes,
+ * and add it to the cache. return the object with a reference, NULL on error.
+ */
+struct hot_object *hot_cache_add(struct hot_cache *cache, const char *pathname,
+				 const struct hot_key *key, const char *header,
+				 size_t header_len, int fd)
+{
+	struct hot_object *obj;
+
+	if ((size_t)key->size > cache->max_object ||
+	    !(obj = hot_object_new(pathname, key, header, header_len,
+				   key->size)))
+		return NULL;
+
+	if (read_fully(fd, obj->data + header_len, key->size) == -1) {
+		fprintf(stderr, "read error when cache file %s\n", pathname);
+		hot_object_free(obj);
+		return NULL;
+	}
+
+	hot_cache_insert(cache, obj);
+	return obj;
+}
+
+/*
+ * Same as hot_cache_add(), but the body is given in memory rather than read
+ * from the file, it's used for the variants such as the compressed one.
+ */
+struct hot_object *hot_cache_add_data(struct hot_cache *cache,
+				      const char *pathname,
+				      const struct hot_key *key,
+				      const char *header, size_t header_len,
+				      const char *body, size_t body_len)
+{
+	struct hot_object *obj;
+
+	if (body_len > cache->max_object ||
+	    !(obj = hot_object_new(pathname, key, header, header_len,
+				   body_len)))
+		return NULL;
+
+	memcpy(obj->data + header_len, body, body_len);
+	hot_cache_insert(cache, obj);
+	return obj;
+}
+
+struct hot_cache *hot_cache_new(size_t max_bytes, size_t max_object)
+{
+	int i;
+	struct hot_cache *cache = calloc(1, sizeof(*cache));
+
+	if (!cache) {
+		perror("allocate memory for hot cache error");
+		return NULL;
+	}
+
+	cache->max_bytes = max_bytes / HOT_CACHE_SHARDS;
+	cache->max_object = max_object < cache->max_bytes ?
+			    max_object : cache->max_bytes;
+	for (i = 0; i < HOT_CACHE_SHARDS; i++)
+		pthread_mutex_init(&cache->shards[i].lock, NULL);
+
+	return cache;
+}
+
+/*
+ * Free all of the objects. All of the references got by hot_cache_get() and
+ * hot_cache_add() must have been dropped.
+ */
+void hot_cache_delete(struct hot_cache *cache)
+{
+	int i;
+	struct hot_shard *shard;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < HOT_CACHE_SHARDS; i++) {
+		shard = &cache->shards[i];
+		while (shard->lru_tail)
+			hot_object_unlink(shard, shard->lru_tail);
+		pthread_mutex_destroy(&shard->lock);
+	}
+	free(cache);
+}
@@ -0,0 +1,71 @@
+#include <pthread.h>
+#include <sys/types.h>
+
+/* default bytes of all of the objects */
+#define HOT_CACHE_BYTES		(64 << 20)
+/* default maximum size of the file can be cached */
+#define HOT_OBJECT_MAX		(64 << 10)
+/* number of shards, each has its own lock and LRU list, power of 2 */
+#define HOT_CACHE_SHARDS	16
+/* hash buckets per shard, power of 2 */
+#define HOT_CACHE_BUCKETS	256
+
+/*
+ * The file which the object was built from. the object is used only if all
+ * of them are still the same.
+ */
+struct hot_key {
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	long mtime_nsec;
+	off_t size;
+};
+
+/*
+ * The response of a small file kept in memory: the fixed fields of header
+ * followed by the whole body. read-only once it has been built.
+ */
+struct hot_object {
+	char *data;		/* header fields, then the body */
+	size_t header_len;	/* length of the header fields in 'data' */
+	size_t len;		/* length of 'data' */
+
+	/* private */
+	char *pathname;
+	unsigned int hash;
+	struct hot_key key;
+	int refcnt;
+	struct hot_object *hnext;	/* hash chain */
+	struct hot_object *prev;	/* LRU list, the head is the newest */
+	struct hot_object *next;
+};
+
+struct hot_shard {
+	pthread_mutex_t lock;
+	size_t bytes;		/* bytes of the objects in this shard */
+	struct hot_object *buckets[HOT_CACHE_BUCKETS];
+	struct hot_object *lru_head;
+	struct hot_object *lru_tail;
+};
+
+struct hot_cache {
+	size_t max_bytes;	/* of each shard */
+	size_t max_object;
+	struct hot_shard shards[HOT_CACHE_SHARDS];
+};
+
+
+struct hot_cache *hot_cache_new(size_t max_bytes, size_t max_object);
+struct hot_object *hot_cache_get(struct hot_cache *cache, const char *pathname,
+				 const struct hot_key *key);
+struct hot_object *hot_cache_add(struct hot_cache *cache, const char *pathname,
+				 const struct hot_key *key, const char *header,
+				 size_t header_len, int fd);
+struct hot_object *hot_cache_add_data(struct hot_cache *cache,
+				      const char *pathname,
+				      const struct hot_key *key,
+				      const char *header, size_t header_len,
+				      const char *body, size_t body_len);
+void hot_cache_put(struct hot_object *obj);
+void hot_cache_delete(struct hot_cache *cache);
@@ -0,0 +1,301 @@
+#include <string.h>
+#include <strings.h>
+#include "http_parser.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD	1
+#endif
+
+/*
+ * States of the parser, it stops at any byte and resumes from there when
+ * more data arrived. the bytes which have been scanned are never looked at
+ * again, except the value of header field to trim the blanks.
+ */
+enum {
+	S_START,	/* skipping the empty lines before the request line */
+	S_METHOD,
+	S_PATH,
+	S_VERSION,
+	S_LINE_LF,	/* CR ends a line, LF is expected */
+	S_FIELD,	/* a header field or the empty line starts */
+	S_NAME,
+	S_VALUE,
+	S_END_LF,	/* CR of the empty line, LF is expected */
+	S_DONE,
+};
+
+/*
+ * The scanners return the first byte in [p, end) which is one of the 4 bytes
+ * in 'set', or 'end' if there is none. use the same byte more than once if
+ * less than 4 are wanted.
+ */
+typedef const char *(*scan_fn)(const char *p, const char *end,
+			       const char *set);
+
+static const char *scan_scalar(const char *p, const char *end,
+			       const char *set)
+{
+	for (; p < end; p++) {
+		if (*p == set[0] || *p == set[1] ||
+		    *p == set[2] || *p == set[3])
+			break;
+	}
+	return p;
+}
+
+#if defined(HAVE_X86_SIMD)
+__attribute__((target("sse2")))
+static const char *scan_sse2(const char *p, const char *end, const char *set)
+{
+	__m128i s0 = _mm_set1_epi8(set[0]);
+	__m128i s1 = _mm_set1_epi8(set[1]);
+	__m128i s2 = _mm_set1_epi8(set[2]);
+	__m128i s3 = _mm_set1_epi8(set[3]);
+	__m128i v, m;
+	int mask;
+
+	for (; end - p >= 16; p += 16) {
+		v = _mm_loadu_si128((const __m128i *)p);
+		m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, s0),
+					      _mm_cmpeq_epi8(v, s1)),
+				 _mm_or_si128(_mm_cmpeq_epi8(v, s2),
+					      _mm_cmpeq_epi8(v, s3)));
+		if ((mask = _mm_movemask_epi8(m)))
+			return p + __builtin_ctz(mask);
+	}
+	return scan_scalar(p, end, set);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *p, const char *end, const char *set)
+{
+	__m256i s0 = _mm256_set1_epi8(set[0]);
+	__m256i s1 = _mm256_set1_epi8(set[1]);
+	__m256i s2 = _mm256_set1_epi8(set[2]);
+	__m256i s3 = _mm256_set1_epi8(set[3]);
+	__m256i v, m;
+	__m128i v16, m16;
+	unsigned int mask;
+
+	for (; end - p >= 32; p += 32) {
+		v = _mm256_loadu_si256((const __m256i *)p);
+		m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, s0),
+						    _mm256_cmpeq_epi8(v, s1)),
+				    _mm256_or_si256(_mm256_cmpeq_epi8(v, s2),
+						    _mm256_cmpeq_epi8(v, s3)));
+		if ((mask = _mm256_movemask_epi8(m)))
+			return p + __builtin_ctz(mask);
+	}
+
+	/*
+	 * the tail is done here rather than by scan_sse2(), mixing the legacy
+	 * SSE code with the dirty upper halves of ymm registers is expensive.
+	 */
+	if (end - p >= 16) {
+		v16 = _mm_loadu_si128((const __m128i *)p);
+		m16 = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v16,
+					_mm256_castsi256_si128(s0)),
+				     _mm_cmpeq_epi8(v16,
+					_mm256_castsi256_si128(s1))),
+			_mm_or_si128(_mm_cmpeq_epi8(v16,
+					_mm256_castsi256_si128(s2)),
+				     _mm_cmpeq_epi8(v16,
+					_mm256_castsi256_si128(s3))));
+		if ((mask = _mm_movemask_epi8(m16)))
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+	return scan_scalar(p, end, set);
+}
+#endif
+
+static const char *scan_auto(const char *p, const char *end, const char *set);
+
+static scan_fn scan = scan_auto;
+
+/*
+ * Select the scanner, 'level' is one of HTTP_SIMD_*, or -1 for the best one
+ * the CPU supports. return the level which is actually used.
+ */
+int http_parser_simd(int level)
+{
+	int best = HTTP_SIMD_NONE;
+	scan_fn fn = scan_scalar;
+
+#if defined(HAVE_X86_SIMD)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		best = HTTP_SIMD_AVX2;
+	else if (__builtin_cpu_supports("sse2"))
+		best = HTTP_SIMD_SSE2;
+#endif
+	if (level < 0 || level > best)
+		level = best;
+
+#if defined(HAVE_X86_SIMD)
+	if (level == HTTP_SIMD_AVX2)
+		fn = scan_avx2;
+	else if (level == HTTP_SIMD_SSE2)
+		fn = scan_sse2;
+#endif
+	__atomic_store_n(&scan, fn, __ATOMIC_RELAXED);
+	return level;
+}
+
+static const char *scan_auto(const char *p, const char *end, const char *set)
+{
+	http_parser_simd(-1);
+	return scan(p, end, set);
+}
+
+void http_parser_init(struct http_request *req)
+{
+	memset(req, 0, sizeof(*req));
+	req->state = S_START;
+}
+
+static struct http_span make_span(size_t start, size_t end)
+{
+	struct http_span span = { .off = start, .len = end - start };
+	return span;
+}
+
+/*
+ * Parse the request line and the header fields in 'buf', which holds 'len'
+ * bytes from the start of the request. it may be called again with more data
+ * appended, the bytes which have been parsed must be kept unchanged.
+ */
+int http_parse(struct http_request *req, const char *buf, size_t len)
+{
+	const char *p = buf + req->pos;
+	const char *end = buf + len;
+	const char *q;
+	struct http_header *h;
+	size_t start, stop;
+
+	while (p < end) {
+		switch (req->state) {
+		case S_START:
+			if (*p == '\r' || *p == '\n') {
+				p++;
+				break;
+			}
+			req->mark = p - buf;
+			req->state = S_METHOD;
+			/* fall through */
+		case S_METHOD:
+			if ((q = scan(p, end, " \r\n\n")) == end)
+				goto again;
+			if (*q != ' ' || q - buf == req->mark)
+				return HTTP_PARSE_ERROR;
+			req->method = make_span(req->mark, q - buf);
+			p = q + 1;
+			req->mark = p - buf;
+			req->state = S_PATH;
+			break;
+		case S_PATH:
+			if ((q = scan(p, end, " \r\n\n")) == end)
+				goto again;
+			if (*q != ' ' || q - buf == req->mark)
+				return HTTP_PARSE_ERROR;
+			req->path = make_span(req->mark, q - buf);
+			p = q + 1;
+			req->mark = p - buf;
+			req->state = S_VERSION;
+			break;
+		case S_VERSION:
+			if ((q = scan(p, end, "\r\n\n\n")) == end)
+				goto again;
+			if (q - buf == req->mark)
+				return HTTP_PARSE_ERROR;
+			req->version = make_span(req->mark, q - buf);
+			req->state = *q == '\r' ? S_LINE_LF : S_FIELD;
+			p = q + 1;
+			break;
+		case S_LINE_LF:
+			if (*p++ != '\n')
+				return HTTP_PARSE_ERROR;
+			req->state = S_FIELD;
+			break;
+		case S_FIELD:
+			if (*p == '\r') {
+				req->state = S_END_LF;
+				p++;
+				break;
+			}
+			if (*p == '\n')
+				goto done;
+			/* the obsolete line folding is not accepted. */
+			if (*p == ' ' || *p == '\t' ||
+			    req->nheaders == HTTP_MAX_HEADERS)
+				return HTTP_PARSE_ERROR;
+			req->mark = p - buf;
+			req->state = S_NAME;
+			/* fall through */
+		case S_NAME:
+			if ((q = scan(p, end, ":\r\n\n")) == end)
+				goto again;
+			if (*q != ':' || q - buf == req->mark)
+				return HTTP_PARSE_ERROR;
+			h = &req->headers[req->nheaders];
+			h->name = make_span(req->mark, q - buf);
+			p = q + 1;
+			req->mark = p - buf;
+			req->state = S_VALUE;
+			break;
+		case S_VALUE:
+			if ((q = scan(p, end, "\r\n\n\n")) == end)
+				goto again;
+			start = req->mark;
+			stop = q - buf;
+			while (start < stop &&
+			       (buf[start] == ' ' || buf[start] == '\t'))
+				start++;
+			while (stop > start &&
+			       (buf[stop - 1] == ' ' || buf[stop - 1] == '\t'))
+				stop--;
+			h = &req->headers[req->nheaders++];
+			h->value = make_span(start, stop);
+			req->state = *q == '\r' ? S_LINE_LF : S_FIELD;
+			p = q + 1;
+			break;
+		case S_END_LF:
+			if (*p != '\n')
+				return HTTP_PARSE_ERROR;
+			goto done;
+		case S_DONE:
+			return HTTP_PARSE_DONE;
+		}
+	}
+
+again:
+	req->pos = len;
+	return HTTP_PARSE_AGAIN;
+done:
+	req->len = p + 1 - buf;
+	req->pos = req->len;
+	req->state = S_DONE;
+	return HTTP_PARSE_DONE;
+}
+
+/*
+ * Find the header field 'name' case-insensitively. return the span of its
+ * value, NULL if the request doesn't have it.
+ */
+const struct http_span *http_header_find(const struct http_request *req,
+					 const char *buf, const char *name)
+{
+	int i;
+	size_t len = strlen(name);
+	const struct http_header *h;
+
+	for (i = 0; i < req->nheaders; i++) {
+		h = &req->headers[i];
+		if (h->name.len == len &&
+		    !strncasecmp(HTTP_SPAN_PTR(buf, h->name), name, len))
+			return &h->value;
+	}
+	return NULL;
+}
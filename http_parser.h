@@ -0,0 +1,58 @@
+#include <stddef.h>
+
+/* maximum header fields of one request */
+#define HTTP_MAX_HEADERS	32
+
+/* return values of http_parse() */
+#define HTTP_PARSE_ERROR	-1	/* malformed request */
+#define HTTP_PARSE_AGAIN	0	/* need more data */
+#define HTTP_PARSE_DONE		1	/* the whole header has been parsed */
+
+/* the scanner used to find the delimiters, see http_parser_simd() */
+#define HTTP_SIMD_NONE		0
+#define HTTP_SIMD_SSE2		1
+#define HTTP_SIMD_AVX2		2
+
+/*
+ * A piece of the request, 'off' counts from the first byte of the request.
+ * offsets are used instead of pointers, so the buffer can be moved or grown
+ * between two calls of http_parse().
+ */
+struct http_span {
+	unsigned int off;
+	unsigned int len;
+};
+
+struct http_header {
+	struct http_span name;
+	struct http_span value;		/* without the surrounding blanks */
+};
+
+/*
+ * The parsed request, and the state to resume the parsing when more data
+ * arrived. all of the spans refer to the buffer passed to http_parse().
+ */
+struct http_request {
+	struct http_span method;
+	struct http_span path;
+	struct http_span version;
+	int nheaders;
+	struct http_header headers[HTTP_MAX_HEADERS];
+	size_t len;		/* length of the header once it's done */
+
+	/* private */
+	int state;
+	size_t pos;		/* next byte to be scanned */
+	size_t mark;		/* start of the current token */
+};
+
+#define HTTP_SPAN_PTR(buf, span)	((buf) + (span).off)
+#define HTTP_SPAN_EQ(buf, span, lit)					\
+	((span).len == sizeof(lit) - 1 &&				\
+	 !memcmp(HTTP_SPAN_PTR(buf, span), lit, sizeof(lit) - 1))
+
+void http_parser_init(struct http_request *req);
+int http_parse(struct http_request *req, const char *buf, size_t len);
+const struct http_span *http_header_find(const struct http_request *req,
+					 const char *buf, const char *name);
+int http_parser_simd(int level);
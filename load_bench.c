@@ -0,0 +1,570 @@
+/*
+ * Load generator of the server over the loopback. it builds a fixture tree,
+ * starts ./server on it, and runs each scenario at several concurrency
+ * levels, a client is a thread with one keep-alive connection, it sends the
+ * next request once the response is read. the results are printed as JSON on
+ * stdout, so the runs could be diffed.
+ *
+ *	make bench
+ *	./load_bench [-d seconds] [-p port] [-t pool-size] [-- server options]
+ *
+ * the server options default to "-e".
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define DURATION	2		/* default seconds of each run */
+#define PORT		8099		/* default port of the server */
+#define POOL_SIZE	8		/* default threads of the server */
+#define SERVER_MAX	1000000000	/* connections the server accepts */
+#define READ_BUFSZ	65536
+#define REQUEST_BUFSZ	(PATH_MAX + 128)
+#define TINY_FILES	64		/* tiny files rotated by the requests */
+#define TINY_SIZE	128
+#define DIR_ENTRIES	50000
+#define LEVELS_MAX	4
+
+struct scenario {
+	const char *name;
+	const char *path;	/* in the fixture tree, %d is the tiny file */
+	int status;		/* expected status code */
+	int levels[LEVELS_MAX];	/* concurrency of each run, 0 ends */
+};
+
+/* the 1GB file is only fetched by a few clients, it takes a while. */
+static const struct scenario scenarios[] = {
+	{ "tiny",	"tiny/%d.bin",	200,	{ 1, 16, 64 } },
+	{ "1mb",	"1mb.bin",	200,	{ 1, 16, 64 } },
+	{ "1gb",	"1gb.bin",	200,	{ 1, 4 } },
+	{ "dir50k",	"dir/",		200,	{ 1, 16 } },
+	{ "404",	"missing",	404,	{ 1, 16, 64 } },
+};
+
+/* buffered reader of the responses */
+struct reader {
+	int sk;
+	size_t pos;
+	size_t len;
+	char buf[READ_BUFSZ];
+};
+
+struct client {
+	pthread_t thread;
+	int id;
+	const struct scenario *sc;
+	double deadline;
+	long requests;
+	long errors;
+	unsigned long long bytes;	/* received, header and body */
+	double *lat;			/* of each request, in second */
+	size_t nlat;
+	size_t size;
+	struct reader r;
+};
+
+static char root[] = "/tmp/load_bench.XXXXXX";
+static int port = PORT;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_file(const char *path, const char *data, size_t len)
+{
+	int fd;
+	ssize_t n;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+		perror(path);
+		return -1;
+	}
+	while (len > 0) {
+		if ((n = write(fd, data, len)) == -1) {
+			perror(path);
+			close(fd);
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return close(fd);
+}
+
+/*
+ * The fixture tree: tiny files, a 1MB file, a 1GB file (sparse, it doesn't
+ * take the disk), and a directory of 50k entries.
+ */
+static int fixture_build(void)
+{
+	int i, fd;
+	char path[PATH_MAX];
+	char *data;
+
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/tiny", root);
+	if (mkdir(path, 0755) == -1) {
+		perror(path);
+		return -1;
+	}
+	if (!(data = malloc(1 << 20))) {
+		perror("allocate memory for fixture");
+		return -1;
+	}
+	for (i = 0; i < 1 << 20; i++)
+		data[i] = 'a' + i % 26;
+
+	for (i = 0; i < TINY_FILES; i++) {
+		snprintf(path, sizeof(path), "%s/tiny/%d.bin", root, i);
+		if (write_file(path, data, TINY_SIZE) == -1)
+			goto fail;
+	}
+	snprintf(path, sizeof(path), "%s/1mb.bin", root);
+	if (write_file(path, data, 1 << 20) == -1)
+		goto fail;
+	free(data);
+
+	snprintf(path, sizeof(path), "%s/1gb.bin", root);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+	    ftruncate(fd, 1L << 30) == -1) {
+		perror(path);
+		return -1;
+	}
+	close(fd);
+
+	snprintf(path, sizeof(path), "%s/dir", root);
+	if (mkdir(path, 0755) == -1) {
+		perror(path);
+		return -1;
+	}
+	for (i = 0; i < DIR_ENTRIES; i++) {
+		snprintf(path, sizeof(path), "%s/dir/entry-%05d", root, i);
+		if ((fd = open(path, O_WRONLY | O_CREAT, 0644)) == -1) {
+			perror(path);
+			return -1;
+		}
+		close(fd);
+	}
+	return 0;
+fail:
+	free(data);
+	return -1;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type,
+			struct FTW *ftw)
+{
+	if (remove(path) == -1)
+		perror(path);
+	return 0;
+}
+
+static void fixture_remove(void)
+{
+	nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static int connect_server(void)
+{
+	int sk, on = 1;
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+
+	if ((sk = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+	if (connect(sk, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(sk);
+		return -1;
+	}
+	setsockopt(sk, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	return sk;
+}
+
+/*
+ * Start ./server in the background, and wait until it accepts connections.
+ * return its pid, -1 on error.
+ */
+static pid_t server_start(char **opts, int nopts, int pool_size)
+{
+	int i, sk;
+	pid_t pid;
+	char pool[16], max[16], portstr[16];
+	char *argv[nopts + 5];
+
+	argv[0] = "./server";
+	for (i = 0; i < nopts; i++)
+		argv[i + 1] = opts[i];
+	snprintf(portstr, sizeof(portstr), "%d", port);
+	snprintf(pool, sizeof(pool), "%d", pool_size);
+	snprintf(max, sizeof(max), "%d", SERVER_MAX);
+	argv[nopts + 1] = portstr;
+	argv[nopts + 2] = pool;
+	argv[nopts + 3] = max;
+	argv[nopts + 4] = NULL;
+
+	if ((pid = fork()) == -1) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		/* stdout is for the results only. */
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		execv(argv[0], argv);
+		perror("execute ./server");
+		_exit(127);
+	}
+
+	for (i = 0; i < 500; i++) {
+		if ((sk = connect_server()) != -1) {
+			close(sk);
+			return pid;
+		}
+		if (waitpid(pid, NULL, WNOHANG) == pid) {
+			fprintf(stderr, "server exited.\n");
+			return -1;
+		}
+		usleep(10000);
+	}
+	fprintf(stderr, "server doesn't accept connections.\n");
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+static ssize_t reader_fill(struct reader *r)
+{
+	ssize_t n;
+
+	if (r->pos == r->len) {
+		r->pos = r->len = 0;
+	} else if (r->len == sizeof(r->buf)) {
+		memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+		r->len -= r->pos;
+		r->pos = 0;
+	}
+	while ((n = read(r->sk, r->buf + r->len,
+			 sizeof(r->buf) - r->len)) == -1 && errno == EINTR)
+		;
+	if (n > 0)
+		r->len += n;
+	return n;
+}
+
+/* the next line without CRLF, NULL if the connection is closed. */
+static char *reader_line(struct reader *r)
+{
+	char *line, *lf;
+
+	while (!(lf = memchr(r->buf + r->pos, '\n', r->len - r->pos))) {
+		if (r->pos == 0 && r->len == sizeof(r->buf))
+			return NULL;		/* too long */
+		if (reader_fill(r) <= 0)
+			return NULL;
+	}
+	line = r->buf + r->pos;
+	r->pos = lf + 1 - r->buf;
+	if (lf > line && lf[-1] == '\r')
+		lf--;
+	*lf = 0;
+	return line;
+}
+
+static int reader_skip(struct reader *r, unsigned long long n)
+{
+	size_t chunk;
+
+	while (n > 0) {
+		if (r->pos == r->len && reader_fill(r) <= 0)
+			return -1;
+		chunk = r->len - r->pos < n ? r->len - r->pos : n;
+		r->pos += chunk;
+		n -= chunk;
+	}
+	return 0;
+}
+
+/*
+ * Read one response, the body is discarded. return the status code, -1 if
+ * the connection is broken. '*close' is set if the server will close it.
+ */
+static int read_response(struct client *c, int *close)
+{
+	int status;
+	char *line;
+	unsigned long long length = 0, chunk;
+	int chunked = 0;
+	unsigned long long received;
+
+	if (!(line = reader_line(&c->r)) ||
+	    sscanf(line, "HTTP/1.%*d %d", &status) != 1)
+		return -1;
+	received = strlen(line) + 2;
+	*close = 0;
+	while ((line = reader_line(&c->r)) && *line) {
+		received += strlen(line) + 2;
+		if (!strncasecmp(line, "Content-Length:", 15))
+			length = strtoull(line + 15, NULL, 10);
+		else if (!strncasecmp(line, "Transfer-Encoding:", 18))
+			chunked = !!strcasestr(line, "chunked");
+		else if (!strncasecmp(line, "Connection:", 11))
+			*close = !!strcasestr(line, "close");
+	}
+	if (!line)
+		return -1;
+
+	received += 2;
+	if (!chunked) {
+		if (reader_skip(&c->r, length) == -1)
+			return -1;
+		c->bytes += received + length;
+		return status;
+	}
+
+	do {
+		if (!(line = reader_line(&c->r)))
+			return -1;
+		chunk = strtoull(line, NULL, 16);
+		if (reader_skip(&c->r, chunk) == -1 || !reader_line(&c->r))
+			return -1;
+		received += chunk;
+	} while (chunk > 0);
+	c->bytes += received;
+	return status;
+}
+
+static void record(struct client *c, double latency)
+{
+	double *lat;
+
+	if (c->nlat == c->size) {
+		c->size = c->size ? c->size * 2 : 1024;
+		if (!(lat = realloc(c->lat, c->size * sizeof(*lat)))) {
+			perror("allocate memory for latencies");
+			exit(EXIT_FAILURE);
+		}
+		c->lat = lat;
+	}
+	c->lat[c->nlat++] = latency;
+}
+
+static void *client_run(void *arg)
+{
+	struct client *c = arg;
+	char path[PATH_MAX], req[REQUEST_BUFSZ];
+	int len, status, close_sk;
+	long n = c->id;
+	double start;
+
+	c->r.sk = -1;
+	while (now() < c->deadline) {
+		if (c->r.sk == -1) {
+			if ((c->r.sk = connect_server()) == -1) {
+				c->errors++;
+				usleep(1000);
+				continue;
+			}
+			c->r.pos = c->r.len = 0;
+		}
+
+		snprintf(path, sizeof(path), c->sc->path, (int)(n++ % TINY_FILES));
+		len = snprintf(req, sizeof(req), "GET %s/%s HTTP/1.1\r\n"
+			       "Host: 127.0.0.1\r\n\r\n", root, path);
+
+		start = now();
+		if (write(c->r.sk, req, len) != len ||
+		    (status = read_response(c, &close_sk)) == -1) {
+			c->errors++;
+			close(c->r.sk);
+			c->r.sk = -1;
+			continue;
+		}
+		record(c, now() - start);
+		c->requests++;
+		if (status != c->sc->status)
+			c->errors++;
+		if (close_sk) {
+			close(c->r.sk);
+			c->r.sk = -1;
+		}
+	}
+	if (c->r.sk != -1)
+		close(c->r.sk);
+	return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *lat, size_t n, double q)
+{
+	size_t i = q * n;
+
+	if (n == 0)
+		return 0;
+	return lat[i < n ? i : n - 1];
+}
+
+/* run 'sc' with 'nclients' for 'duration' seconds, and print the result. */
+static int run(const struct scenario *sc, int nclients, int duration,
+	       int first)
+{
+	int i;
+	long requests = 0, errors = 0;
+	unsigned long long bytes = 0;
+	size_t n = 0;
+	double start, elapsed, *lat;
+	struct client *clients;
+
+	if (!(clients = calloc(nclients, sizeof(*clients)))) {
+		perror("allocate memory for clients");
+		return -1;
+	}
+
+	start = now();
+	for (i = 0; i < nclients; i++) {
+		clients[i].id = i;
+		clients[i].sc = sc;
+		clients[i].deadline = start + duration;
+		if (pthread_create(&clients[i].thread, NULL, client_run,
+				   &clients[i])) {
+			fprintf(stderr, "create client thread failed.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < nclients; i++) {
+		pthread_join(clients[i].thread, NULL);
+		requests += clients[i].requests;
+		errors += clients[i].errors;
+		bytes += clients[i].bytes;
+		n += clients[i].nlat;
+	}
+	elapsed = now() - start;
+
+	if (!(lat = malloc((n ? n : 1) * sizeof(*lat)))) {
+		perror("allocate memory for latencies");
+		exit(EXIT_FAILURE);
+	}
+	for (n = 0, i = 0; i < nclients; i++) {
+		memcpy(lat + n, clients[i].lat,
+		       clients[i].nlat * sizeof(*lat));
+		n += clients[i].nlat;
+		free(clients[i].lat);
+	}
+	qsort(lat, n, sizeof(*lat), compare_double);
+
+	printf("%s\n    {\"scenario\": \"%s\", \"concurrency\": %d, "
+	       "\"requests\": %ld, \"errors\": %ld, \"rps\": %.1f, "
+	       "\"mb_per_sec\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+	       "\"p999_us\": %.1f}", first ? "" : ",", sc->name, nclients,
+	       requests, errors, requests / elapsed,
+	       bytes / elapsed / (1 << 20), percentile(lat, n, 0.5) * 1e6,
+	       percentile(lat, n, 0.99) * 1e6,
+	       percentile(lat, n, 0.999) * 1e6);
+	fflush(stdout);
+	fprintf(stderr, "%s x %d: %.0f req/s, %ld errors\n", sc->name,
+		nclients, requests / elapsed, errors);
+
+	free(lat);
+	free(clients);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: load_bench [-d seconds] [-p port] "
+		"[-t pool-size] [-- server options]\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	static char *default_opts[] = { "-e" };
+	int i, j, opt, first = 1;
+	int duration = DURATION, pool_size = POOL_SIZE;
+	char **opts = default_opts;
+	int nopts = 1;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "d:p:t:")) != -1) {
+		switch (opt) {
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 't':
+			pool_size = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (duration < 1 || pool_size < 1)
+		usage();
+	if (optind < argc) {
+		opts = argv + optind;
+		nopts = argc - optind;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	fprintf(stderr, "building the fixture tree...\n");
+	if (fixture_build() == -1) {
+		fixture_remove();
+		return EXIT_FAILURE;
+	}
+	if ((pid = server_start(opts, nopts, pool_size)) == -1) {
+		fixture_remove();
+		return EXIT_FAILURE;
+	}
+
+	printf("{\n  \"server\": \"");
+	for (i = 0; i < nopts; i++)
+		printf("%s%s", i ? " " : "", opts[i]);
+	printf("\",\n  \"pool_size\": %d,\n  \"duration\": %d,\n"
+	       "  \"results\": [", pool_size, duration);
+	for (i = 0; i < (int)(sizeof(scenarios) / sizeof(scenarios[0])); i++) {
+		for (j = 0; j < LEVELS_MAX && scenarios[i].levels[j]; j++) {
+			run(&scenarios[i], scenarios[i].levels[j], duration,
+			    first);
+			first = 0;
+		}
+	}
+	printf("\n  ]\n}\n");
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	fixture_remove();
+	return 0;
+}
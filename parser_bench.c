@@ -0,0 +1,90 @@
+/*
+ * Throughput of the request parser, with each of the scanners the CPU
+ * supports. the request is parsed in one piece, and again split into small
+ * segments to see the cost of resuming.
+ *
+ *	make parser_bench && ./parser_bench [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "http_parser.h"
+
+#define ITERATIONS	1000000
+#define SEGMENT		64	/* bytes of each piece in the split run */
+
+static const char request[] =
+	"GET /static/js/app.min.js?v=20161018 HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+		"(KHTML, like Gecko) Chrome/54.0.2840.71 Safari/537.36\r\n"
+	"Accept: */*\r\n"
+	"Referer: http://www.example.com/index.html\r\n"
+	"Accept-Encoding: gzip, deflate, sdch, br\r\n"
+	"Accept-Language: en-US,en;q=0.8,zh-CN;q=0.6\r\n"
+	"Cookie: session=8c1f0a6e2b6d4c0b9e3f; theme=dark; "
+		"_ga=GA1.2.1234567890.1476748800\r\n"
+	"If-None-Match: \"5805a0c4-1f3a\"\r\n"
+	"If-Modified-Since: Tue, 18 Oct 2016 04:01:08 GMT\r\n"
+	"\r\n";
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int parse_once(const char *buf, size_t len, size_t segment)
+{
+	struct http_request req;
+	size_t n;
+	int ret = HTTP_PARSE_AGAIN;
+
+	http_parser_init(&req);
+	for (n = segment; ret == HTTP_PARSE_AGAIN; n += segment)
+		ret = http_parse(&req, buf, n < len ? n : len);
+
+	if (ret != HTTP_PARSE_DONE || req.len != len || req.nheaders != 10)
+		return -1;
+	return 0;
+}
+
+static void run(const char *name, long iterations, size_t segment)
+{
+	long i;
+	size_t len = sizeof(request) - 1;
+	double start, elapsed;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		if (parse_once(request, len, segment) == -1) {
+			fprintf(stderr, "%s: parse error\n", name);
+			exit(1);
+		}
+	}
+	elapsed = now() - start;
+
+	printf("%-6s %-8s %10.0f req/s %8.1f MB/s\n", name,
+	       segment >= len ? "whole" : "split", iterations / elapsed,
+	       iterations * len / elapsed / (1 << 20));
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *names[] = { "scalar", "sse2", "avx2" };
+	long iterations = argc > 1 ? atol(argv[1]) : ITERATIONS;
+	int level, best = http_parser_simd(-1);
+
+	printf("request of %zu bytes, %ld iterations\n",
+	       sizeof(request) - 1, iterations);
+	for (level = HTTP_SIMD_NONE; level <= best; level++) {
+		http_parser_simd(level);
+		run(names[level], iterations, sizeof(request));
+		run(names[level], iterations, SEGMENT);
+	}
+	return 0;
+}
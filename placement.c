@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "placement.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/mempolicy.h>)
+#include <linux/mempolicy.h>
+#define HAVE_MEMPOLICY	1
+#endif
+#endif
+
+/* the headers are newer than the libc, or the other way around. */
+#if defined(HAVE_MEMPOLICY) && !defined(SYS_mbind)
+#undef HAVE_MEMPOLICY
+#endif
+
+#define SYSFS_CPU	"/sys/devices/system/cpu/cpu%d"
+
+/* the integer in a file of sysfs, 'def' if it's not there. */
+static int sysfs_int(const char *path, int def)
+{
+	int v;
+	FILE *fp;
+
+	if (!(fp = fopen(path, "re")))
+		return def;
+	if (fscanf(fp, "%d", &v) != 1)
+		v = def;
+	fclose(fp);
+	return v;
+}
+
+/* the position of 'cpu' in a list like "0-1,8-9", -1 if it's not there. */
+static int cpulist_index(const char *path, int cpu)
+{
+	int a, b, n = 0;
+	char buf[256], *p;
+	FILE *fp;
+
+	if (!(fp = fopen(path, "re")))
+		return -1;
+	p = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+	if (!p)
+		return -1;
+
+	while (isdigit((unsigned char)*p)) {
+		a = b = strtol(p, &p, 10);
+		if (*p == '-')
+			b = strtol(p + 1, &p, 10);
+		if (cpu >= a && cpu <= b)
+			return n + cpu - a;
+		n += b - a + 1;
+		if (*p++ != ',')
+			break;
+	}
+	return -1;
+}
+
+/* the node is a "nodeN" link in the directory of cpu. */
+static int cpu_node(const char *dirpath)
+{
+	int node = 0;
+	DIR *dir;
+	struct dirent *d;
+
+	if (!(dir = opendir(dirpath)))
+		return 0;
+	while ((d = readdir(dir))) {
+		if (!strncmp(d->d_name, "node", 4) &&
+		    isdigit((unsigned char)d->d_name[4])) {
+			node = atoi(d->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+/*
+ * Read where 'cpu' is. The machine without the topology in sysfs is taken
+ * as one node of single threaded cores. return -1 if there is no such cpu.
+ */
+int placement_probe_cpu(int cpu, struct cpu_place *place)
+{
+	char dir[64], path[128];
+
+	snprintf(dir, sizeof(dir), SYSFS_CPU, cpu);
+	if (cpu < 0 || cpu >= CPU_SETSIZE || access(dir, F_OK) == -1)
+		return -1;
+
+	place->cpu = cpu;
+	place->node = cpu_node(dir);
+	snprintf(path, sizeof(path), "%s/topology/physical_package_id", dir);
+	place->package = sysfs_int(path, 0);
+	snprintf(path, sizeof(path), "%s/topology/core_id", dir);
+	place->core = sysfs_int(path, cpu);
+	snprintf(path, sizeof(path), "%s/topology/thread_siblings_list", dir);
+	if ((place->thread = cpulist_index(path, cpu)) == -1)
+		place->thread = 0;
+	place->rank = 0;
+	return 0;
+}
+
+/* the cpus we are allowed to run on. return the number of them. */
+int placement_probe(struct cpu_place *places, int max)
+{
+	int cpu, n = 0;
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+		perror("sched_getaffinity");
+		return 0;
+	}
+	for (cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+		if (CPU_ISSET(cpu, &set) &&
+		    placement_probe_cpu(cpu, &places[n]) == 0)
+			n++;
+	}
+	return n;
+}
+
+static int compact_cmp(const void *a, const void *b)
+{
+	const struct cpu_place *x = a, *y = b;
+
+	if (x->node != y->node)
+		return x->node - y->node;
+	if (x->package != y->package)
+		return x->package - y->package;
+	if (x->core != y->core)
+		return x->core - y->core;
+	if (x->thread != y->thread)
+		return x->thread - y->thread;
+	return x->cpu - y->cpu;
+}
+
+static int scatter_cmp(const void *a, const void *b)
+{
+	const struct cpu_place *x = a, *y = b;
+
+	if (x->thread != y->thread)
+		return x->thread - y->thread;
+	if (x->rank != y->rank)
+		return x->rank - y->rank;
+	if (x->node != y->node)
+		return x->node - y->node;
+	return x->cpu - y->cpu;
+}
+
+/*
+ * Node by node, core by core, the hardware threads of a core next to each
+ * other. the threads share the caches as much as possible.
+ */
+void placement_compact(struct cpu_place *places, int n)
+{
+	qsort(places, n, sizeof(*places), compact_cmp);
+}
+
+/*
+ * The first core of every node, then the second one of them, and so on,
+ * the sibling hardware threads come after all of the cores. the threads
+ * get the most of memory bandwidth and caches.
+ */
+void placement_scatter(struct cpu_place *places, int n)
+{
+	int i, rank = 0;
+
+	placement_compact(places, n);
+	for (i = 0; i < n; i++) {
+		if (i > 0 && places[i].node != places[i - 1].node)
+			rank = 0;
+		else if (i > 0 && (places[i].package != places[i - 1].package ||
+				   places[i].core != places[i - 1].core))
+			rank++;
+		places[i].rank = rank;
+	}
+	qsort(places, n, sizeof(*places), scatter_cmp);
+}
+
+/*
+ * Memory of 'size' bytes, zeroed, whose pages prefer the node 'node', no
+ * matter which cpu touches them first. -1 for any node. it's only a hint,
+ * the kernel falls back to the other nodes, and the pages are simply local
+ * to the first toucher if the kernel doesn't allow the policy.
+ */
+void *node_alloc(size_t size, int node)
+{
+	void *ptr;
+#if defined(HAVE_MEMPOLICY)
+	unsigned long mask;
+#endif
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+#if defined(HAVE_MEMPOLICY)
+	if (node >= 0 && node < (int)sizeof(mask) * 8) {
+		mask = 1UL << node;
+		syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask,
+			sizeof(mask) * 8 + 1, 0);
+	}
+#endif
+	return ptr;
+}
+
+void node_free(void *ptr, size_t size)
+{
+	if (ptr)
+		munmap(ptr, size);
+}
@@ -0,0 +1,18 @@
+#include <stddef.h>
+
+/* a cpu, and where it sits in the machine, read from sysfs */
+struct cpu_place {
+	int cpu;
+	int node;	/* NUMA node, 0 if the kernel doesn't tell */
+	int package;	/* physical socket */
+	int core;	/* core id in the package */
+	int thread;	/* n-th hardware thread of the core */
+	int rank;	/* n-th core of the node, set by placement_scatter() */
+};
+
+int placement_probe(struct cpu_place *places, int max);
+int placement_probe_cpu(int cpu, struct cpu_place *place);
+void placement_compact(struct cpu_place *places, int n);
+void placement_scatter(struct cpu_place *places, int n);
+void *node_alloc(size_t size, int node);
+void node_free(void *ptr, size_t size);
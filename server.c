@@ -1,4 +1,6 @@
 #define USE_URL_DECODING 1
+#define USE_SENDFILE 1
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -6,40 +8,84 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>		/* TCP_CORK, TCP_NODELAY */
 #include <arpa/inet.h>		/* htons() or htonl() etc. */
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>		/* for macros of {PATH | NAME}_MAX */
 #include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <stddef.h>
+#include <zlib.h>
 
 #include "thread_pool.h"
+#include "slab.h"
+#include "file_cache.h"
+#include "hot_cache.h"
+#include "dir_cache.h"
+#include "http_parser.h"
+#include "stats.h"
+#include "uring.h"
+#include "timer_wheel.h"
 
 
-#define HTTP_VERSION	"HTTP/1.0"
+#define HTTP_VERSION	"HTTP/1.1"
 #define SERV_VERSION	"webserver/1.0"
 
-#define BACKLOG		20
+#define BACKLOG		1024		/* capped by net.core.somaxconn */
+#define LISTEN_FDS_START 3		/* the first inherited listen socket */
 #define BUFSZ		4096
+#define REQUEST_MAX	65536		/* longest header of a request */
+#define SPLICE_CHUNK	65536		/* bytes moved by one splice() */
+#define INLINE_BODY_MAX	BUFSZ		/* sent with the header by writev() */
+#define MAX_EVENTS	256		/* events fetched by one epoll_wait() */
+#define ACCEPT_BATCH	64		/* connections taken from the backlog
+					   and dispatched together */
+#define REACTOR_TICK	1000		/* epoll_wait() timeout in millisecond */
+#define URING_ENTRIES	256		/* submissions of the io_uring */
+#define URING_CQ_ENTRIES 4096		/* completions, a recv per connection */
+#define TIMER_TICK	100		/* resolution of the deadlines in ms */
+
+#define KEEPALIVE_MAX		100	/* default requests per connection */
+#define KEEPALIVE_TIMEOUT	5	/* default idle limit in second */
+#define HEADER_TIMEOUT		10	/* default seconds to receive a header */
+#define SEND_TIMEOUT		30	/* default seconds a write may stall */
+#define RETRY_AFTER		"1"	/* seconds the refused client waits */
+#define FILE_CACHE_TTL		2	/* default seconds metadata is trusted */
+#define GZIP_CACHE_BYTES	(16 << 20) /* default memory of gzip variants */
+#define GZIP_SOURCE_MAX		(1 << 20) /* larger files aren't compressed */
+#define GZIP_MIN_LENGTH		256	/* smaller ones are not worth it */
+#define GZIP_LEVEL		6
+
+/* content-codings accepted by the client */
+#define ENC_GZIP	1
+#define ENC_BR		2
 
-#define METHOD_BUFSZ	32
-#define VERSION_BUFSZ	32
 #define PATHNAME_BUFSZ	(PATH_MAX + NAME_MAX)
+#define STATUS_PATH	"/server-status"	/* reserved, the counters of server */
 
 #define FILESIZE_BUFSZ	128		/* buffer size of file size string */
 #define DATE_BUFSZ	128		/* buffer size of date string */
 #define HEADER_BUFSZ	512		/* HTTP response header */
-#define HTMLHEADER_BUFSZ 1024		/* html header surround the entities */
-#define ENTITY_BUFSZ	512		/* one entity size */
-#define CONTENTS_BUFSZ	65535		/* all of the entities buffer size */
-#define RESPONSE_BUFSZ	(HEADER_BUFSZ + CONTENTS_BUFSZ)
+#define HTMLTAIL_BUFSZ	256		/* html tail after the entities */
+#define LIST_CHUNK_BUFSZ 16384		/* one chunk of the streamed listing */
+#define TEMPLATE_BUFSZ	1024		/* one prebuilt fixed response */
+#define DATE_LEN	29		/* "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define ETAG_BUFSZ	48		/* quoted mtime and size in hex */
+#define RANGES_MAX	16		/* ranges honored in one request */
+#define PART_HEADER_BUFSZ 192		/* header of one part of multirange */
 
 #define RFC1123FMT	"%a, %d %b %Y %H:%M:%S GMT"
 
-#define SKIP_BLANK(start, end)						\
-	do {								\
-		while (isblank(*start) && start < end) start++;		\
-	} while (0)
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
 
 
 
@@ -85,18 +131,27 @@
 		"</BODY>"						\
 	"</HTML>"
 
+#define HTTP_UNAVAILABLE						\
+	"<HTML>"							\
+		"<HEAD><TITLE>503 Service Unavailable</TITLE></HEAD>"	\
+		"<BODY><H4>503 Service Unavailable</H4>"		\
+			"The server is overloaded, try again later."	\
+		"</BODY>"						\
+	"</HTML>"
+
 #define HTTP_DIR_ITEMS							\
 	"<tr><td><A HREF=\"%s\">%s</A></td><td>%s</td><td>%s</td></tr>"
 
-#define HTTP_DIR_CONTENTS						\
+#define HTTP_DIR_HEAD							\
 	"<HTML>"							\
 		"<HEAD><TITLE>Index of %s</TITLE></HEAD>"		\
 		"<BODY>""<H4>Index of %s</H4>"				\
 		"<table CELLSPACING=8>"					\
 		"<tr>"							\
 		"<th>Name</th><th>Last Modified</th><th>Size</th>"	\
-		"</tr>"							\
-		"%s"							\
+		"</tr>"
+
+#define HTTP_DIR_TAIL							\
 		"</table><HR>"						\
 		"<ADDRESS>%s</ADDRESS>"					\
 		"</BODY>"						\
@@ -104,10 +159,187 @@
 
 
 
+/*
+ * Runtime options of the server, filled by main() from the command line.
+ */
+struct server_conf {
+	int reactor;		/* 1 if serve the connections by epoll reactor */
+	int uring;		/* 1 if the reactor runs on io_uring */
+	int keepalive_max;	/* max requests per connection, 0 disable it */
+	int keepalive_timeout;	/* seconds a idle connection can be kept */
+	int header_timeout;	/* seconds from the first byte of a request to
+				 * its end, 0 forever */
+	int send_timeout;	/* seconds a response may send nothing, 0
+				 * forever */
+	int transfer_timeout;	/* seconds a response may take, 0 forever */
+	int queue;		/* job queue backend of the pool, TP_QUEUE_* */
+	int max_threads;	/* the pool grows up to it, 0 fixed */
+	size_t stack_size;	/* of the pool threads, 0 default */
+	int max_queue;		/* jobs queued in a pool at most, 0 unbounded */
+	int queue_timeout;	/* ms a job may wait in the queue, 0 forever */
+	int nacceptors;		/* SO_REUSEPORT groups, one per core, 0 off */
+	int placement;		/* of the pool threads, TP_PLACE_* */
+	int *cpus;		/* for TP_PLACE_CPUS */
+	int ncpus;
+	int cache_ttl;		/* seconds of file metadata cached, 0 off */
+	size_t hot_bytes;	/* memory for the small files, 0 off */
+	size_t gzip_bytes;	/* memory for the compressed variants, 0 off */
+	int dir_cache_dirs;	/* directories listing cached, 0 off */
+};
+
+/* a range of file, 'end' is exclusive */
+struct byte_range {
+	off_t start;
+	off_t end;
+};
+
+/*
+ * The representation of file to be sent: the file itself, its precompressed
+ * sibling, or the variant compressed by us.
+ */
+struct variant {
+	const char *pathname;		/* file to be read */
+	const struct file_entry *entry;	/* metadata of it */
+	const char *mime;		/* type of the original file */
+	const char *encoding;		/* Content-Encoding, NULL for identity */
+	int gzipped;			/* compressed by us, in the gzip cache */
+};
+
+/*
+ * Per-connection state. The bytes received but not parsed yet are kept in
+ * 'buf', so the pipelined requests can be served back-to-back.
+ *
+ * In reactor mode, the connection is owned by exactly one party at a time:
+ * either it sits in the epoll set waiting for the request (EPOLLONESHOT) and
+ * linked in the idle list, or a thread of the pool is serving it.
+ */
+struct connection {
+	int sk;
+	int keepalive;		/* 1 if keep the connection after response */
+	int nrequests;		/* requests served on this connection */
+	struct http_request req;	/* parser state of the pending request */
+	const char *reqbuf;	/* bytes of the request being served */
+	char *buf;		/* 'ibuf', or a larger one for the long header */
+	size_t size;		/* size of 'buf' */
+	size_t len;		/* bytes in 'buf' */
+	time_t expire;		/* when the idle connection will be closed */
+	unsigned long parse_ns;	/* spent on parsing the pending request */
+	struct timer timer;	/* the deadlines below, see connection_due() */
+	unsigned long deadline;	/* ms of the wheel, for the header or the
+				 * whole response, 0 none */
+	unsigned long stall;	/* ms the response may send nothing, 0 none */
+	unsigned long progress;	/* ms of the wheel, when it last sent */
+	struct reactor *reactor;	/* which the connection belongs to */
+	struct connection *prev;
+	struct connection *next;
+	char ibuf[BUFSZ];
+};
+
+struct reactor {
+	int epfd;			/* epoll instance */
+	int nconns;			/* number of the alive connections */
+	struct slab *conn_slab;		/* struct connection come from */
+	pthread_mutex_t idle_lock;	/* lock on the idle list */
+	struct connection *idle_head;	/* the earliest to expire */
+	struct connection *idle_tail;
+	struct uring *ring;		/* io_uring engine, NULL for epoll */
+};
+
+/*
+ * A group serves the connections from one listen socket: its thread accepts
+ * (and runs the reactor in reactor mode), and its pool process the requests.
+ * With '-c', there is a group per core, each listens on its own SO_REUSEPORT
+ * socket, and all of the threads of the group are bound to that core.
+ */
+struct acceptor {
+	int sk;				/* listen socket */
+	int cpu;			/* bound to, -1 if not bound */
+	pthread_t thread;
+	struct thread_pool *pool;
+	struct reactor reactor;
+	int ret;			/* return value of the accept loop */
+};
+
+struct server {
+	int max_request;		/* connections to accept in total */
+	int accepted;			/* connections accepted by all groups */
+	int nconns;			/* connections being served */
+	int inherited;			/* listen sockets from the old server */
+	int upgrade;			/* SIGUSR2 came, hand off the sockets */
+	int draining;			/* handed off, serve what we have */
+	int handoff_fd;			/* the new server tells it's ready */
+	pid_t handoff_pid;		/* of the new server being started */
+	int ready_fd;			/* tell the old server we're ready */
+	unsigned long timeouts;		/* connections shut down by deadline */
+	int nacceptors;
+	struct acceptor *acceptors;
+};
+
+static struct server_conf conf = {
+	.keepalive_max = KEEPALIVE_MAX,
+	.keepalive_timeout = KEEPALIVE_TIMEOUT,
+	.header_timeout = HEADER_TIMEOUT,
+	.send_timeout = SEND_TIMEOUT,
+	.cache_ttl = FILE_CACHE_TTL,
+	.hot_bytes = HOT_CACHE_BYTES,
+	.gzip_bytes = GZIP_CACHE_BYTES,
+	.dir_cache_dirs = DIR_CACHE_DIRS,
+};
+static struct server server = {
+	.handoff_fd = -1,
+	.ready_fd = -1,
+};
+/* only one thread starts the new server and waits for it */
+static pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the command line, the new server is started by it */
+static char **server_argv;
+
+/* pathname -> metadata and opened descriptor, NULL if disabled */
+static struct file_cache *file_cache;
+/* pathname -> response of the small file, NULL if disabled */
+static struct hot_cache *hot_cache;
+/* pathname -> gzip compressed response of text file, NULL if disabled */
+static struct hot_cache *gzip_cache;
+/* directory -> rendered rows of listing, NULL if disabled */
+static struct dir_cache *dir_cache;
+/* deadlines of the connections, NULL if none of them is enabled */
+static struct timer_wheel *timers;
+
+/* response being sent by this thread, if it has a stall deadline */
+static __thread struct connection *sending;
+
+/*
+ * Called when a write made progress. the stall deadline is pushed by the
+ * stamp only, the timer finds it out when it fires.
+ */
+static void write_progress(void)
+{
+	if (sending)
+		__atomic_store_n(&sending->progress, timer_wheel_now(timers),
+				 __ATOMIC_RELAXED);
+}
+
+/*
+ * Block until the descriptor become writable. This is only used when the
+ * socket is in nonblocking mode (reactor mode), and write() returned EAGAIN.
+ */
+static int wait_writable(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+	while (poll(&pfd, 1, -1) == -1) {
+		if (errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
 /*
  * Prevent the partial sent when sending  large file or contents of a directory.
+ * 'flags' is passed to send(), MSG_MORE tells the kernel the rest of response
+ * follows, so the data is held until a full segment could be sent.
  */
-static ssize_t nwrite(int fd, const void *buf, size_t count)
+static ssize_t nsend(int fd, const void *buf, size_t count, int flags)
 {
 	int nwrt;
 	const char *ptr = buf;
@@ -115,22 +347,78 @@ static ssize_t nwrite(int fd, const void *buf, size_t count)
 
 	errno = 0;
 	while (nleft > 0) {
-		if ((nwrt = write(fd, ptr, nleft)) > 0) {
+		if ((nwrt = send(fd, ptr, nleft, flags)) > 0) {
 			nleft -= nwrt;
 			ptr += nwrt;
+			write_progress();
 		} else if (nwrt == 0) {
 			fprintf(stderr, "connection has been closed.\n");
 			return 0;
 		} else {
 			if (errno == EINTR)
 				continue;
-			perror("write");
+			if (errno == EAGAIN && wait_writable(fd) == 0)
+				continue;
+			perror("send");
 			return -1;
 		}
 	}
+	stats_mark_once(STATS_HEADER);
+	stats_sent(count);
 	return count;
 }
 
+static ssize_t nwrite(int fd, const void *buf, size_t count)
+{
+	return nsend(fd, buf, count, 0);
+}
+
+/*
+ * Hold the partial segments in the kernel while the response is assembled by
+ * several calls, they are flushed when it's turned off.
+ */
+static void tcp_cork(int sk, int on)
+{
+	if (setsockopt(sk, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == -1)
+		perror("setsockopt TCP_CORK");
+}
+
+/*
+ * Same as nwrite(), but gather the data from 'iovcnt' buffers by writev(). The
+ * 'iov' will be modified when partial sent.
+ */
+static ssize_t nwritev(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t nwrt;
+	size_t total = 0;
+
+	while (iovcnt > 0) {
+		if ((nwrt = writev(fd, iov, iovcnt)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && wait_writable(fd) == 0)
+				continue;
+			perror("writev");
+			return -1;
+		}
+
+		total += nwrt;
+		write_progress();
+		while (iovcnt > 0 && (size_t)nwrt >= iov->iov_len) {
+			nwrt -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + nwrt;
+			iov->iov_len -= nwrt;
+		}
+	}
+	stats_mark_once(STATS_HEADER);
+	stats_sent(total);
+	return total;
+}
+
 #if defined(USE_URL_DECODING)
 /*
  * Used to encoding the Path, normally, the browser will encoding some special
@@ -165,61 +453,187 @@ static char *pathname_decoding(char *pathname)
 #endif
 
 /*
- * Store current time to the buffer 'str', which returned format is accoding to
- * the RFC 1123. used in response header.
+ * The Date field shared by all responses. it's formatted at most once per
+ * second by the first thread who notices the clock moved, everybody else
+ * just copies DATE_LEN bytes. there are two slots so the readers never see
+ * the one being rewritten.
+ */
+static struct {
+	pthread_mutex_t lock;
+	int cur;
+	time_t sec[2];
+	char str[2][DATE_LEN + 1];
+} date_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.sec = { -1, -1 },
+};
+
+/*
+ * Format 't' like RFC1123FMT into the DATE_LEN bytes of 'out', without the
+ * locale and the format string of strftime().
  */
-static char *get_current_date(char *str, int len)
+static void format_http_date(time_t t, char *out)
 {
-	time_t t = time(NULL);
-	struct tm res;
+	static const char days[] = "SunMonTueWedThuFriSat";
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	memcpy(out, days + tm.tm_wday * 3, 3);
+	out[3] = ',';
+	out[4] = ' ';
+	out[5] = '0' + tm.tm_mday / 10;
+	out[6] = '0' + tm.tm_mday % 10;
+	out[7] = ' ';
+	memcpy(out + 8, months + tm.tm_mon * 3, 3);
+	out[11] = ' ';
+	out[12] = '0' + (tm.tm_year + 1900) / 1000 % 10;
+	out[13] = '0' + (tm.tm_year + 1900) / 100 % 10;
+	out[14] = '0' + (tm.tm_year + 1900) / 10 % 10;
+	out[15] = '0' + (tm.tm_year + 1900) % 10;
+	out[16] = ' ';
+	out[17] = '0' + tm.tm_hour / 10;
+	out[18] = '0' + tm.tm_hour % 10;
+	out[19] = ':';
+	out[20] = '0' + tm.tm_min / 10;
+	out[21] = '0' + tm.tm_min % 10;
+	out[22] = ':';
+	out[23] = '0' + tm.tm_sec / 10;
+	out[24] = '0' + tm.tm_sec % 10;
+	memcpy(out + 25, " GMT", 4);
+}
 
-	strftime(str, len , RFC1123FMT, gmtime_r(&t, &res));
-	return str;
+/*
+ * Copy the current date in the format of RFC 1123 to 'out', which must have
+ * room for DATE_LEN bytes. no terminating null byte is written.
+ */
+static void current_date(char *out)
+{
+	time_t now = time(NULL);
+	int cur = __atomic_load_n(&date_cache.cur, __ATOMIC_ACQUIRE);
+
+	if (__atomic_load_n(&date_cache.sec[cur], __ATOMIC_RELAXED) != now &&
+	    !pthread_mutex_trylock(&date_cache.lock)) {
+		cur = !date_cache.cur;
+		format_http_date(now, date_cache.str[cur]);
+		__atomic_store_n(&date_cache.sec[cur], now, __ATOMIC_RELAXED);
+		__atomic_store_n(&date_cache.cur, cur, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&date_cache.lock);
+	}
+	memcpy(out, date_cache.str[cur], DATE_LEN);
 }
 
-static char *get_filename(char *pathname)
+/*
+ * The append-based serializer of the response headers. the helpers never
+ * write beyond 'end', the output is silently truncated if it's too small.
+ */
+struct hbuf {
+	char *ptr;
+	char *end;
+};
+
+#define HB_INIT(buf)	{ (buf), (buf) + sizeof(buf) }
+#define HB_LEN(b, buf)	((size_t)((b)->ptr - (buf)))
+#define HB_LIT(b, s)	hb_put(b, s, sizeof(s) - 1)
+
+static inline void hb_put(struct hbuf *b, const char *s, size_t len)
 {
-	char *ptr = strrchr(pathname, '/');
-	return (ptr ? ptr + 1 : pathname);
+	if (len > (size_t)(b->end - b->ptr))
+		len = b->end - b->ptr;
+	memcpy(b->ptr, s, len);
+	b->ptr += len;
 }
 
-static char *get_date(time_t t, char *str, int len)
-{	struct tm res;
+static inline void hb_str(struct hbuf *b, const char *s)
+{
+	hb_put(b, s, strlen(s));
+}
 
-	strftime(str, len , RFC1123FMT, gmtime_r(&t, &res));
-	return str;
+static void hb_num(struct hbuf *b, unsigned long n)
+{
+	char tmp[24];
+	char *p = tmp + sizeof(tmp);
+
+	do {
+		*--p = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	hb_put(b, p, tmp + sizeof(tmp) - p);
 }
 
-static int pathname_is_exist(const char *pathname)
+static void hb_hex(struct hbuf *b, unsigned long n)
 {
-	struct stat st;
+	static const char digits[] = "0123456789abcdef";
+	char tmp[16];
+	char *p = tmp + sizeof(tmp);
+
+	do {
+		*--p = digits[n & 15];
+		n >>= 4;
+	} while (n);
+	hb_put(b, p, tmp + sizeof(tmp) - p);
+}
 
-	if (stat(pathname, &st) == -1 && errno == ENOENT)
-		return 0;
-	return 1;
+static void hb_date(struct hbuf *b, time_t t)
+{
+	if (b->end - b->ptr >= DATE_LEN) {
+		format_http_date(t, b->ptr);
+		b->ptr += DATE_LEN;
+	}
 }
 
-static int pathname_is_directory(const char *pathname)
+/*
+ * The status line, the Server and the Date field. 'status' is something like
+ * "200 OK".
+ */
+static void hb_status_line(struct hbuf *b, const char *status)
 {
-	struct stat st;
+	HB_LIT(b, HTTP_VERSION " ");
+	hb_str(b, status);
+	HB_LIT(b, "\r\nServer: " SERV_VERSION "\r\nDate: ");
+	if (b->end - b->ptr >= DATE_LEN) {
+		current_date(b->ptr);
+		b->ptr += DATE_LEN;
+	}
+	HB_LIT(b, "\r\n");
+}
 
-	if (stat(pathname, &st) == -1)
-		perror("stat error when checking the type of pathname");
+/* same as hb_status_line(), and the response is counted. */
+static void hb_status(struct hbuf *b, const char *status)
+{
+	stats_status(atoi(status));
+	hb_status_line(b, status);
+}
 
-	if ((st.st_mode & S_IFMT) == S_IFDIR)
-		return 1;
-	return 0;
+static void hb_content(struct hbuf *b, const char *mime, unsigned long len)
+{
+	HB_LIT(b, "Content-Type: ");
+	hb_str(b, mime);
+	HB_LIT(b, "\r\nContent-Length: ");
+	hb_num(b, len);
+	HB_LIT(b, "\r\n");
+}
+
+static char *get_date(time_t t, char *str, int len)
+{	struct tm res;
 
+	strftime(str, len , RFC1123FMT, gmtime_r(&t, &res));
+	return str;
 }
+
 /*
  * Notes: we exit and terminate the program simply, when error occur. Normally,
  * in the large project, this is not a good idea.
  */
 
-static int create_listen_sk(short port)
+/*
+ * Create the listen socket. if 'cpu' is not -1, the socket joins a SO_REUSEPORT
+ * group, and asks the kernel to pass it the connections arrived on 'cpu'.
+ */
+static int create_listen_sk(short port, int cpu)
 {
 	int onoff = 1;
-	int sk = socket(AF_INET, SOCK_STREAM, 0);
+	int sk = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	struct sockaddr_in addr = { 0 };
 
 	if (sk == -1) {
@@ -231,6 +645,18 @@ static int create_listen_sk(short port)
 	if (setsockopt(sk, SOL_SOCKET, SO_REUSEADDR, &onoff, sizeof(onoff)) < 0)
 		perror("unable to set SO_REUSEADDR flags on socket");
 
+	if (cpu != -1) {
+		if (setsockopt(sk, SOL_SOCKET, SO_REUSEPORT, &onoff,
+			       sizeof(onoff)) < 0) {
+			perror("unable to set SO_REUSEPORT flags on socket");
+			goto out;
+		}
+
+		if (setsockopt(sk, SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+			       sizeof(cpu)) < 0)
+			perror("unable to set SO_INCOMING_CPU on socket");
+	}
+
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -252,112 +678,240 @@ out:
 	return -1;
 }
 
-static void response_bad_request(int sk)
+/*
+ * The listen sockets inherited from the old server, or from systemd, are
+ * the descriptors from 3 on, LISTEN_FDS tells how many of them. return the
+ * number, 0 if none. the variables are removed, so the programs we start
+ * never see them.
+ */
+static int inherited_listen_fds(void)
+{
+	int n = 0;
+	const char *fds = getenv("LISTEN_FDS");
+	const char *pid = getenv("LISTEN_PID");
+
+	if (fds && (!pid || atoi(pid) == getpid()) && atoi(fds) > 0)
+		n = atoi(fds);
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDNAMES");
+	return n;
+}
+
+/*
+ * The pipe to tell the old server that we have taken over its sockets,
+ * LISTEN_READY_FD is set by server_handoff(). return -1 if there is none.
+ */
+static int inherited_ready_fd(void)
 {
-	char date[DATE_BUFSZ];
-	char buf[RESPONSE_BUFSZ];
-	int len;
+	const char *var = getenv("LISTEN_READY_FD");
+	int fd = var ? atoi(var) : -1;
+
+	unsetenv("LISTEN_READY_FD");
+	if (fd < LISTEN_FDS_START || fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		return -1;
+	return fd;
+}
+
+/*
+ * Tell the old server that we listen on its sockets now, so it stops
+ * accepting. until then it goes on, a new server which fails to start
+ * leaves the port to it.
+ */
+static void handoff_ready(void)
+{
+	int ok = 0;
+
+	if (server.ready_fd == -1)
+		return;
+	if (write(server.ready_fd, &ok, sizeof(ok)) == -1)
+		perror("unable to tell the old server we are ready");
+	close(server.ready_fd);
+	server.ready_fd = -1;
+}
+
+/*
+ * Take over the inherited listen socket 'fd' for the group on 'cpu'. The
+ * connections in its backlog are kept, it's already listening on the port.
+ */
+static int adopt_listen_sk(int fd, int cpu)
+{
+	int on = 0;
+	socklen_t len = sizeof(on);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) == -1 ||
+	    !on) {
+		fprintf(stderr, "inherited descriptor %d is not a listen "
+				"socket.\n", fd);
+		return -1;
+	}
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		perror("unable to set FD_CLOEXEC on inherited socket");
+
+	if (cpu != -1 && setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+				    sizeof(cpu)) < 0)
+		perror("unable to set SO_INCOMING_CPU on socket");
+	return fd;
+}
+
+#define CONNECTION_KEEPALIVE	"Connection: keep-alive\r\n\r\n"
+#define CONNECTION_CLOSE	"Connection: close\r\n\r\n"
+
+/*
+ * The "Connection" field and the empty line end the response header.
+ */
+static void hb_connection(struct hbuf *b, const struct connection *conn)
+{
+	if (conn->keepalive)
+		HB_LIT(b, CONNECTION_KEEPALIVE);
+	else
+		HB_LIT(b, CONNECTION_CLOSE);
+}
+
+/*
+ * The fixed responses are built once at startup, one for the keep-alive
+ * connection and one for the others. sending one is a memcpy() and then the
+ * Date field is patched in place.
+ */
+enum {
+	TPL_BAD_REQUEST,
+	TPL_NOT_SUPPORTED,
+	TPL_NOT_FOUND,
+	TPL_FORBIDDEN,
+	TPL_UNAVAILABLE,
+	TPL_MAX
+};
+
+struct response_template {
+	int code;		/* status code */
+	size_t len;
+	size_t date_offset;
+	char data[TEMPLATE_BUFSZ];
+};
+
+static struct response_template templates[TPL_MAX][2];
+
+/* 'fields' are the extra header fields, each ends with CRLF. */
+static void template_build(int kind, const char *status, const char *fields,
+			   const char *body)
+{
+	struct connection conn;
+	struct response_template *t;
+	struct hbuf b;
+
+	for (conn.keepalive = 0; conn.keepalive < 2; conn.keepalive++) {
+		t = &templates[kind][conn.keepalive];
+		b.ptr = t->data;
+		b.end = t->data + sizeof(t->data);
+
+		hb_status_line(&b, status);
+		t->code = atoi(status);
+		t->date_offset = b.ptr - t->data - DATE_LEN - 2;
+		hb_str(&b, fields);
+		hb_content(&b, "text/html; charset=utf-8", strlen(body));
+		hb_connection(&b, &conn);
+		hb_str(&b, body);
+		t->len = b.ptr - t->data;
+	}
+}
+
+static void response_templates_init(void)
+{
+	/* a reader losing the trylock must never copy an empty slot. */
+	date_cache.sec[0] = time(NULL);
+	format_http_date(date_cache.sec[0], date_cache.str[0]);
+
+	template_build(TPL_BAD_REQUEST, "400 Bad Request", "",
+		       HTTP_BAD_REQ_BODY);
+	template_build(TPL_NOT_SUPPORTED, "501 Not supported", "",
+		       HTTP_NOT_SUPPORTED);
+	template_build(TPL_NOT_FOUND, "404 Not Found", "", HTTP_NOT_FOUND);
+	template_build(TPL_FORBIDDEN, "403 Forbidden", "", HTTP_FORBIDDEN);
+	template_build(TPL_UNAVAILABLE, "503 Service Unavailable",
+		       "Retry-After: " RETRY_AFTER "\r\n", HTTP_UNAVAILABLE);
+}
+
+/* copy the template to 'buf' with the current date, return its length. */
+static size_t template_copy(int kind, int keepalive, char *buf)
+{
+	const struct response_template *t = &templates[kind][!!keepalive];
+
+	memcpy(buf, t->data, t->len);
+	current_date(buf + t->date_offset);
+	stats_status(t->code);
+	return t->len;
+}
+
+static int response_template(struct connection *conn, int kind)
+{
+	char buf[TEMPLATE_BUFSZ];
+	size_t len = template_copy(kind, conn->keepalive, buf);
+
+	return nwrite(conn->sk, buf, len);
+}
+
+/*
+ * Refuse the client of 'sk' when the server is overloaded. it's usually
+ * called by the acceptor, so the response is tried once without blocking,
+ * the client which can't take it is simply closed. the request is drained
+ * first, closing the socket with unread data would reset the connection
+ * before the client read the response.
+ */
+static void response_unavailable(int sk)
+{
+	int i;
+	char buf[BUFSZ];
+	size_t len;
 
-	len = snprintf(buf, sizeof(buf),
-			  "%s 400 Bad Request\r\n"
-			  "Server: %s\r\n"
-			  "Date: %s\r\n"
-			  "Content-Type: text/html; charset=utf-8\r\n"
-			  "Content-Length: %ld\r\n"
-			  "Connection: close\r\n\r\n"
-			  "%s", HTTP_VERSION, SERV_VERSION,
-			  get_current_date(date, sizeof(date)),
-			  strlen(HTTP_BAD_REQ_BODY), HTTP_BAD_REQ_BODY);
-
-	if (nwrite(sk, buf, len) <= 0)
+	for (i = 0; i < 4 && recv(sk, buf, sizeof(buf), MSG_DONTWAIT) > 0; i++)
+		;
+
+	len = template_copy(TPL_UNAVAILABLE, 0, buf);
+	if (send(sk, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) == -1 &&
+	    errno != EAGAIN && errno != EPIPE && errno != ECONNRESET)
+		perror("send error when response service unavailable");
+}
+
+static void response_bad_request(struct connection *conn)
+{
+	if (response_template(conn, TPL_BAD_REQUEST) <= 0)
 		perror("nwrite error when response bad request");
 }
 
-static void response_not_supported(int sk)
+static void response_not_supported(struct connection *conn)
 {
-	char date[DATE_BUFSZ];
-	char buf[RESPONSE_BUFSZ];
-	int len;
-	
-	len = snprintf(buf, sizeof(buf),
-			  "%s 501 Not supported\r\n"
-			  "Server: %s\r\n"
-			  "Date: %s\r\n"
-			  "Content-Type: text/html; charset=utf-8\r\n"
-			  "Content-Length: %ld\r\n"
-			  "Connection: close\r\n\r\n"
-			  "%s", HTTP_VERSION, SERV_VERSION,
-			  get_current_date(date, sizeof(date)),
-			  strlen(HTTP_NOT_SUPPORTED), HTTP_NOT_SUPPORTED);
-	
-	if (nwrite(sk, buf, len) <= 0)
+	if (response_template(conn, TPL_NOT_SUPPORTED) <= 0)
 		perror("nwrite error when response not supported");
 }
 
-static void response_not_found(int sk)
+static void response_not_found(struct connection *conn)
 {
-	char date[DATE_BUFSZ];
-	char buf[RESPONSE_BUFSZ];
-	int len;
-	
-	len = snprintf(buf, sizeof(buf),
-			  "%s 404 Not Found\r\n"
-			  "Server: %s\r\n"
-			  "Date: %s\r\n"
-			  "Content-Type: text/html; charset=utf-8\r\n"
-			  "Content-Length: %ld\r\n"
-			  "Connection: close\r\n\r\n"
-			  "%s", HTTP_VERSION, SERV_VERSION,
-			  get_current_date(date, sizeof(date)),
-			  strlen(HTTP_NOT_FOUND), HTTP_NOT_FOUND);
-	
-	if (nwrite(sk, buf, len) <= 0)
+	if (response_template(conn, TPL_NOT_FOUND) <= 0)
 		perror("nwrite error when response request path not found");
 }
 
-static void response_found(int sk, const char *pathname)
+static void response_found(struct connection *conn, const char *pathname)
 {
-	char date[DATE_BUFSZ];
-	char buf[RESPONSE_BUFSZ];
-	int len;
-	
-	len = snprintf(buf, sizeof(buf),
-			  "%s 302 Found\r\n"
-			  "Server: %s\r\n"
-			  "Date: %s\r\n"
-			  "Location: %s\\\r\n"
-			  "Content-Type: text/html; charset=utf-8\r\n"
-			  "Content-Length: %ld\r\n"
-			  "Connection: close\r\n\r\n"
-			  "%s", HTTP_VERSION, SERV_VERSION,
-			  get_current_date(date, sizeof(date)), pathname,
-			  strlen(HTTP_FOUND), HTTP_FOUND);
-	
-	if (nwrite(sk, buf, len) <= 0)
+	char buf[HEADER_BUFSZ + PATHNAME_BUFSZ + sizeof(HTTP_FOUND)];
+	struct hbuf b = HB_INIT(buf);
+
+	hb_status(&b, "302 Found");
+	HB_LIT(&b, "Location: ");
+	hb_str(&b, pathname);
+	HB_LIT(&b, "/\r\n");
+	hb_content(&b, "text/html; charset=utf-8", sizeof(HTTP_FOUND) - 1);
+	hb_connection(&b, conn);
+	HB_LIT(&b, HTTP_FOUND);
+
+	if (nwrite(conn->sk, buf, HB_LEN(&b, buf)) <= 0)
 		perror("nwrite error when response request resource found in"
 		       "other place");
 }
 
-static void response_forbidden(int clisk)
+static void response_forbidden(struct connection *conn)
 {
-	char date[DATE_BUFSZ];
-	char buf[RESPONSE_BUFSZ];
-	int len;
-	
-	len = snprintf(buf, sizeof(buf),
-			  "%s 403 Forbidden\r\n"
-			  "Server: %s\r\n"
-			  "Date: %s\r\n"
-			  "Content-Type: text/html; charset=utf-8\r\n"
-			  "Content-Length: %ld\r\n"
-			  "Connection: close\r\n\r\n"
-			  "%s", HTTP_VERSION, SERV_VERSION,
-			  get_current_date(date, sizeof(date)),
-			  strlen(HTTP_FORBIDDEN), HTTP_FORBIDDEN);
-	
-	if (nwrite(clisk, buf, len) <= 0)
+	if (response_template(conn, TPL_FORBIDDEN) <= 0)
 		perror("nwrite error when response request forbidden");
-
 }
 
 
@@ -393,496 +947,2707 @@ static char *get_mime_type(const char *name)
 }
 
 /*
- * We parsing the METHOD, PATH and VERSION tokens from the request. return 0 on
- * success, if the request from client couldn't be understood, then -1 will
- * be returned.
+ * The validators of the variant, the ETag is made of the mtime and the size
+ * of file, and the variant compressed by us has a suffix. it's quoted, 'out'
+ * should have ETAG_BUFSZ bytes. return the length.
  */
-static int parsing_request_header(char *data, char *method, int method_len,
-				  char *pathname, int pathname_len,
-				  char *version, int version_len)
+static size_t format_etag(const struct variant *v, char *out)
 {
-	int i;
-	char *startptr = data;
-	char *endptr = strstr(data, "\r\n");
+	struct hbuf b = { out, out + ETAG_BUFSZ };
+
+	HB_LIT(&b, "\"");
+	hb_hex(&b, v->entry->mtime);
+	HB_LIT(&b, "-");
+	hb_hex(&b, v->entry->size);
+	if (v->gzipped)
+		HB_LIT(&b, "-gz");
+	HB_LIT(&b, "\"");
+	return b.ptr - out;
+}
 
-	if (!endptr)
-		return -1;
-	
-	*endptr = 0;
+/*
+ * The types worth to be compressed, the others are compressed already.
+ */
+static int mime_compressible(const char *mime)
+{
+	return !strncmp(mime, "text/", 5);
+}
 
-	i = 0;
-	SKIP_BLANK(startptr, endptr);
-	while (startptr < endptr && i < method_len && !isblank(*startptr)) {
-		method[i++] = *startptr++;
-	}
-	method[i] = 0;
+/*
+ * The fields describe the variant: the coding, the validators, and whether
+ * the ranges could be asked.
+ */
+static void hb_representation(struct hbuf *b, const struct variant *v)
+{
+	char etag[ETAG_BUFSZ];
 
-	i = 0;
-	SKIP_BLANK(startptr, endptr);	
-	while (startptr < endptr && i < pathname_len && !isblank(*startptr)) {
-		pathname[i++] = *startptr++;
+	if (v->encoding) {
+		HB_LIT(b, "Content-Encoding: ");
+		hb_str(b, v->encoding);
+		HB_LIT(b, "\r\n");
 	}
-	pathname[i] = 0;
-	
-	i = 0;
-	SKIP_BLANK(startptr, endptr);	
-	while (startptr < endptr && i < version_len && !isblank(*startptr)) {
-		version[i++] = *startptr++;
+	if (mime_compressible(v->mime))
+		HB_LIT(b, "Vary: Accept-Encoding\r\n");
+
+	HB_LIT(b, "ETag: ");
+	hb_put(b, etag, format_etag(v, etag));
+	HB_LIT(b, "\r\nLast-Modified: ");
+	hb_date(b, v->entry->mtime);
+	HB_LIT(b, "\r\n");
+	if (!v->gzipped)
+		HB_LIT(b, "Accept-Ranges: bytes\r\n");
+}
+
+/*
+ * Send the response of the small file kept in memory, the status line and the
+ * per-request fields are gathered with it into one writev().
+ */
+static int transfer_hot_object(struct connection *conn,
+			       const struct hot_object *obj)
+{
+	char status[HEADER_BUFSZ];
+	struct hbuf b = HB_INIT(status);
+	struct iovec iov[4];
+
+	hb_status(&b, "200 OK");
+	iov[0].iov_base = status;
+	iov[0].iov_len = HB_LEN(&b, status);
+	iov[1].iov_base = obj->data;
+	iov[1].iov_len = obj->header_len;
+	if (conn->keepalive) {
+		iov[2].iov_base = CONNECTION_KEEPALIVE;
+		iov[2].iov_len = sizeof(CONNECTION_KEEPALIVE) - 1;
+	} else {
+		iov[2].iov_base = CONNECTION_CLOSE;
+		iov[2].iov_len = sizeof(CONNECTION_CLOSE) - 1;
 	}
-	version[i] = 0;
+	iov[3].iov_base = obj->data + obj->header_len;
+	iov[3].iov_len = obj->len - obj->header_len;
 
-	/* A regular HTTP request, should at least have these 3 tokens. */
-	if (!*method || !*pathname || !*version)
+	if (nwritev(conn->sk, iov, 4) == -1) {
+		fprintf(stderr, "nwritev error when transfer cached file.\n");
 		return -1;
-
+	}
 	return 0;
 }
 
-static char *pathname_find_file(char *pathname, const char *file)
+/*
+ * Look up the response of the small file in the hot cache, build it if it's
+ * not there. return the object with a reference, NULL if it can't be cached.
+ */
+static struct hot_object *hot_object_get(const struct variant *v, int fd)
 {
-	DIR *dir = opendir(pathname);
-	struct dirent entry, *res;
-
-	if (!dir)
-		goto out;
-
-	while (readdir_r(dir, &entry, &res) == 0 && res) {
-		if (!strcmp(entry.d_name, ".") || !strcmp(entry.d_name, ".."))
-			continue;
+	char header[HEADER_BUFSZ];
+	struct hbuf b = HB_INIT(header);
+	const struct file_entry *entry = v->entry;
+	struct hot_object *obj;
+	struct hot_key key = {
+		.dev = entry->dev,
+		.ino = entry->ino,
+		.mtime = entry->mtime,
+		.mtime_nsec = entry->mtime_nsec,
+		.size = entry->size,
+	};
+
+	if (!hot_cache || (size_t)entry->size > hot_cache->max_object)
+		return NULL;
 
-		if (!strcmp(entry.d_name, file))
-			return strncat(pathname, file, PATHNAME_BUFSZ);
+	if ((obj = hot_cache_get(hot_cache, v->pathname, &key)))
+		return obj;
 
-	}
-out:
-	return NULL;
+	hb_content(&b, v->mime, entry->size);
+	hb_representation(&b, v);
+	return hot_cache_add(hot_cache, v->pathname, &key, header,
+			     HB_LEN(&b, header), fd);
 }
 
-static int transfer_header(int clisk, const char *pathname,
-			   size_t content_length)
+/*
+ * The return value of the body senders below, when the kernel doesn't support
+ * the syscall for this pair of descriptors. '*offset' tells where the next
+ * sender should continue.
+ */
+#define XFER_UNSUPPORTED	1
+
+#if defined(USE_SENDFILE)
+/*
+ * Send the file from the page cache to the socket directly, the data won't
+ * be copied to the user space.
+ */
+static int send_body_sendfile(int clisk, int fd, off_t *offset, off_t length)
 {
-	char date[DATE_BUFSZ];
-	char buf[HEADER_BUFSZ];
-	int len;
-	char *mime = get_mime_type(pathname);
+	ssize_t nsent;
+	off_t begin = *offset;
 
-	if (!mime) {
-		fprintf(stderr, "unknown mime type when request file: %s.\n",
-				pathname);
-		return -1;
-	}
-	
-	len = snprintf(buf, sizeof(buf),
-			  "%s 200 OK\r\n"
-			  "Server: %s\r\n"
-			  "Date: %s\r\n"
-			  "Content-Type: %s\r\n"
-			  "Content-Length: %ld\r\n"
-			  "Connection: close\r\n\r\n",
-			  HTTP_VERSION, SERV_VERSION,
-			  get_current_date(date, sizeof(date)),
-			  mime, content_length);
-	
-	if (nwrite(clisk, buf, len) <= 0) {
-		perror("nwrite error when transfer http header to client");
+	while (*offset < length) {
+		nsent = sendfile(clisk, fd, offset, length - *offset);
+		if (nsent > 0) {
+			write_progress();
+			continue;
+		}
+		if (nsent == 0) {
+			fprintf(stderr, "file has been truncated when send.\n");
+			return -1;
+		}
+
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN && wait_writable(clisk) == 0)
+			continue;
+		if ((errno == EINVAL || errno == ENOSYS) && *offset == begin)
+			return XFER_UNSUPPORTED;
+		perror("sendfile error when transfer file");
 		return -1;
 	}
 
 	return 0;
 }
 
-static off_t get_file_length_by_fd(int fd)
+/*
+ * Move the file to the socket through a pipe, used when sendfile() couldn't
+ * handle this kind of file. The data stays in the kernel too.
+ */
+static int send_body_splice(int clisk, int fd, off_t *offset, off_t length)
 {
-	size_t save, length;
+	int ret = -1;
+	int pfd[2];
+	ssize_t nin, nout;
+	off_t begin = *offset;
 
-	if ((save = lseek(fd, 0, SEEK_CUR)) == (off_t)-1)
-		return -1;
-	if ((length = lseek(fd, 0, SEEK_END)) == (off_t)-1)
-		return -1;
-	if ((lseek(fd, save, SEEK_SET)) == (off_t)-1)
+	if (pipe2(pfd, O_CLOEXEC) == -1) {
+		perror("pipe2 error when transfer file");
 		return -1;
+	}
 
-	return length;
-}
+	while (*offset < length) {
+		nin = splice(fd, offset, pfd[1], NULL,
+			     MIN(length - *offset, SPLICE_CHUNK),
+			     SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (nin == 0) {
+			fprintf(stderr, "file has been truncated when send.\n");
+			goto out;
+		} else if (nin == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EINVAL && *offset == begin)
+				ret = XFER_UNSUPPORTED;
+			else
+				perror("splice error when read file");
+			goto out;
+		}
 
-static int transfer_file(int clisk, const char *pathname)
-{
-	int fd;
-	off_t length;
-	ssize_t nread;
-	char buf[BUFSZ];
+		/* drain the pipe completely, before refill it. */
+		while (nin > 0) {
+			nout = splice(pfd[0], NULL, clisk, NULL, nin,
+				      SPLICE_F_MOVE |
+				      (*offset < length ? SPLICE_F_MORE : 0));
+			if (nout > 0) {
+				nin -= nout;
+				write_progress();
+			} else if (nout == -1 && errno == EINTR) {
+				continue;
+			} else if (nout == -1 && errno == EAGAIN &&
+				   wait_writable(clisk) == 0) {
+				continue;
+			} else {
+				perror("splice error when write socket");
+				goto out;
+			}
+		}
+	}
 
-	if ((fd = open(pathname, O_RDONLY)) == -1) {
+	ret = 0;
+out:
+	close(pfd[0]);
+	close(pfd[1]);
+	return ret;
+}
+#endif
+
+/*
+ * The traditional way, copy every BUFSZ bytes through the user space.
+ */
+static int send_body_copy(int clisk, int fd, off_t *offset, off_t length)
+{
+	ssize_t nread;
+	char buf[BUFSZ];
+
+	while (*offset < length) {
+		nread = pread(fd, buf, MIN(length - *offset, sizeof(buf)),
+			      *offset);
+		if (nread == -1 && errno == EINTR)
+			continue;
+		if (nread <= 0) {
+			perror("read error when transfer file");
+			return -1;
+		}
+
+		if (nwrite(clisk, buf, nread) <= 0) {
+			fprintf(stderr, "nwrite error when transfer file.\n");
+			return -1;
+		}
+		*offset += nread;
+	}
+
+	return 0;
+}
+
+/*
+ * Send the bytes [start, end) of the file 'fd' to the client. try the
+ * zero-copy syscalls first, and fall back to the next one, if the kernel
+ * refused it.
+ */
+static int transfer_file_body(int clisk, int fd, off_t start, off_t end)
+{
+	int ret = XFER_UNSUPPORTED;
+	off_t offset = start;
+
+#if defined(USE_SENDFILE)
+	ret = send_body_sendfile(clisk, fd, &offset, end);
+	if (ret == XFER_UNSUPPORTED)
+		ret = send_body_splice(clisk, fd, &offset, end);
+	/* send_body_copy() counts by itself. */
+	stats_sent(offset - start);
+#endif
+	if (ret == XFER_UNSUPPORTED)
+		ret = send_body_copy(clisk, fd, &offset, end);
+
+	return ret;
+}
+
+/*
+ * Parse the HTTP-date in 'value'. return 0 on success, -1 if it's not in the
+ * format of RFC 1123.
+ */
+static int parse_http_date(const char *value, size_t len, time_t *t)
+{
+	char str[64];
+	char *end;
+	struct tm tm = { 0 };
+
+	if (len >= sizeof(str))
+		return -1;
+	memcpy(str, value, len);
+	str[len] = 0;
+
+	if (!(end = strptime(str, RFC1123FMT, &tm)) || *end)
+		return -1;
+	*t = timegm(&tm);
+	return 0;
+}
+
+/*
+ * Whether the entity-tag 'etag' is one of the list in If-None-Match. the weak
+ * comparison is used, "W/" is ignored.
+ */
+static int etag_list_match(const char *p, size_t len, const char *etag,
+			   size_t etag_len)
+{
+	const char *end = p + len, *tag;
+
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		if (p < end && *p == '*')
+			return 1;
+		if (end - p > 2 && !memcmp(p, "W/", 2))
+			p += 2;
+
+		tag = p;
+		while (p < end && *p != ',')
+			p++;
+		while (p > tag && (p[-1] == ' ' || p[-1] == '\t'))
+			p--;
+		if ((size_t)(p - tag) == etag_len && !memcmp(tag, etag, etag_len))
+			return 1;
+		while (p < end && *p != ',')
+			p++;
+	}
+	return 0;
+}
+
+/*
+ * Whether the copy of client is still fresh, so a 304 will be sent instead
+ * of the file. If-None-Match wins if both of them are present.
+ */
+static int request_not_modified(const struct connection *conn,
+				const struct file_entry *entry,
+				const char *etag, size_t etag_len)
+{
+	const char *buf = conn->reqbuf;
+	const struct http_span *value;
+	time_t t;
+
+	if ((value = http_header_find(&conn->req, buf, "If-None-Match")))
+		return etag_list_match(HTTP_SPAN_PTR(buf, *value), value->len,
+				       etag, etag_len);
+
+	if ((value = http_header_find(&conn->req, buf, "If-Modified-Since")) &&
+	    parse_http_date(HTTP_SPAN_PTR(buf, *value), value->len, &t) == 0)
+		return entry->mtime <= t;
+
+	return 0;
+}
+
+/*
+ * Parse a decimal number of the range, stop at the first non-digit.
+ * return -1 if there is no digit or it overflowed.
+ */
+static off_t parse_range_number(const char **p, const char *end)
+{
+	off_t n = 0;
+	const char *start = *p;
+
+	while (*p < end && isdigit(**p)) {
+		if (n > (LLONG_MAX - 9) / 10)
+			return -1;
+		n = n * 10 + (*(*p)++ - '0');
+	}
+	return *p == start ? -1 : n;
+}
+
+/*
+ * Parse the value of Range for the file of 'size' bytes. the satisfiable
+ * ranges are stored in 'ranges'. return the number of them, 0 if none could
+ * be satisfied, or -1 if the whole file should be sent, since the field is
+ * malformed or it asked too many ranges.
+ */
+static int parse_ranges(const char *p, size_t len, off_t size,
+			struct byte_range *ranges)
+{
+	const char *end = p + len;
+	off_t first, last;
+	int n = 0, nspecs = 0;
+
+	if (len < 6 || strncasecmp(p, "bytes=", 6))
+		return -1;
+	p += 6;
+
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		if (p == end)
+			break;
+		if (++nspecs > RANGES_MAX)
+			return -1;
+
+		if (*p == '-') {		/* the last 'last' bytes */
+			p++;
+			if ((last = parse_range_number(&p, end)) == -1)
+				return -1;
+			first = last < size ? size - last : 0;
+			last = size - 1;
+			if (first > last)	/* "-0" or the file is empty */
+				goto next;
+		} else {
+			if ((first = parse_range_number(&p, end)) == -1 ||
+			    p == end || *p++ != '-')
+				return -1;
+			if (p < end && isdigit(*p)) {
+				if ((last = parse_range_number(&p, end)) == -1 ||
+				    last < first)
+					return -1;
+			} else {
+				last = size - 1;
+			}
+			if (first >= size)
+				goto next;
+			if (last >= size)
+				last = size - 1;
+		}
+
+		ranges[n].start = first;
+		ranges[n].end = last + 1;
+		n++;
+next:
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if (p < end && *p != ',')
+			return -1;
+	}
+
+	return nspecs ? n : -1;
+}
+
+/*
+ * The ranges of the file requested. If-Range only lets them through if the
+ * file is still the one client has. return the same as parse_ranges().
+ */
+static int request_ranges(const struct connection *conn,
+			  const struct file_entry *entry, const char *etag,
+			  size_t etag_len, struct byte_range *ranges)
+{
+	const char *buf = conn->reqbuf;
+	const struct http_span *range, *cond;
+	time_t t;
+
+	if (!(range = http_header_find(&conn->req, buf, "Range")))
+		return -1;
+
+	if ((cond = http_header_find(&conn->req, buf, "If-Range"))) {
+		if (cond->len && *HTTP_SPAN_PTR(buf, *cond) == '"') {
+			if (cond->len != etag_len ||
+			    memcmp(HTTP_SPAN_PTR(buf, *cond), etag, etag_len))
+				return -1;
+		} else if (parse_http_date(HTTP_SPAN_PTR(buf, *cond),
+					   cond->len, &t) == -1 ||
+			   t != entry->mtime) {
+			return -1;
+		}
+	}
+
+	return parse_ranges(HTTP_SPAN_PTR(buf, *range), range->len,
+			    entry->size, ranges);
+}
+
+static int transfer_not_modified(struct connection *conn,
+				 const struct variant *v)
+{
+	char buf[HEADER_BUFSZ];
+	struct hbuf b = HB_INIT(buf);
+
+	hb_status(&b, "304 Not Modified");
+	hb_representation(&b, v);
+	hb_connection(&b, conn);
+
+	if (nwrite(conn->sk, buf, HB_LEN(&b, buf)) <= 0) {
+		perror("nwrite error when response not modified");
+		return -1;
+	}
+	return 0;
+}
+
+static int response_range_not_satisfiable(struct connection *conn,
+					  off_t size)
+{
+	char buf[HEADER_BUFSZ];
+	struct hbuf b = HB_INIT(buf);
+
+	hb_status(&b, "416 Range Not Satisfiable");
+	HB_LIT(&b, "Content-Range: bytes */");
+	hb_num(&b, size);
+	HB_LIT(&b, "\r\nContent-Length: 0\r\n");
+	hb_connection(&b, conn);
+
+	if (nwrite(conn->sk, buf, HB_LEN(&b, buf)) <= 0) {
+		perror("nwrite error when response range not satisfiable");
+		return -1;
+	}
+	return 0;
+}
+
+static void hb_content_range(struct hbuf *b, const struct byte_range *range,
+			     off_t size)
+{
+	HB_LIT(b, "Content-Range: bytes ");
+	hb_num(b, range->start);
+	HB_LIT(b, "-");
+	hb_num(b, range->end - 1);
+	HB_LIT(b, "/");
+	hb_num(b, size);
+	HB_LIT(b, "\r\n");
+}
+
+/*
+ * Send the header and the small range of file together.
+ */
+static int transfer_inline(int clisk, char *header, size_t header_len, int fd,
+			   const struct byte_range *range)
+{
+	char body[INLINE_BODY_MAX];
+	size_t len = range->end - range->start, offset = 0;
+	ssize_t nread;
+	struct iovec iov[2];
+
+	while (offset < len) {
+		nread = pread(fd, body + offset, len - offset,
+			      range->start + offset);
+		if (nread == -1 && errno == EINTR)
+			continue;
+		if (nread <= 0) {
+			perror("read error when transfer file");
+			return -1;
+		}
+		offset += nread;
+	}
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = header_len;
+	iov[1].iov_base = body;
+	iov[1].iov_len = len;
+	if (nwritev(clisk, iov, 2) == -1) {
+		fprintf(stderr, "nwritev error when transfer file.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The whole file, or the only range of it.
+ */
+static int transfer_single(struct connection *conn, int fd,
+			   const struct variant *v,
+			   const struct byte_range *range)
+{
+	char buf[HEADER_BUFSZ];
+	struct hbuf b = HB_INIT(buf);
+	struct byte_range whole = { 0, v->entry->size };
+
+	if (range) {
+		hb_status(&b, "206 Partial Content");
+		hb_content_range(&b, range, v->entry->size);
+	} else {
+		hb_status(&b, "200 OK");
+		range = &whole;
+	}
+	hb_content(&b, v->mime, range->end - range->start);
+	hb_representation(&b, v);
+	hb_connection(&b, conn);
+
+	/*
+	 * the small body is read into memory and leaves with the header by one
+	 * writev(). the larger one follows the header sent with MSG_MORE, so
+	 * the header is held until sendfile() fills the first segment.
+	 */
+	if (range->end - range->start <= INLINE_BODY_MAX)
+		return transfer_inline(conn->sk, buf, HB_LEN(&b, buf), fd,
+				       range);
+
+	if (nsend(conn->sk, buf, HB_LEN(&b, buf), MSG_MORE) <= 0) {
+		perror("nsend error when transfer http header to client");
+		return -1;
+	}
+
+	return transfer_file_body(conn->sk, fd, range->start, range->end);
+}
+
+/*
+ * Several ranges are sent as multipart/byteranges, each part has its own
+ * Content-Type and Content-Range. all of the part headers are built first,
+ * since the Content-Length counts them.
+ */
+static int transfer_multirange(struct connection *conn, int fd,
+			       const struct variant *v,
+			       const struct byte_range *ranges, int nranges)
+{
+	static unsigned long sequence;
+	char boundary[32];
+	char header[HEADER_BUFSZ];
+	char parts[RANGES_MAX * PART_HEADER_BUFSZ];
+	size_t part_len[RANGES_MAX + 1];
+	struct hbuf bb = HB_INIT(boundary);
+	struct hbuf hb = HB_INIT(header);
+	struct hbuf pb = HB_INIT(parts);
+	char *part = parts, *start;
+	size_t boundary_len, length = 0;
+	int i;
+
+	hb_hex(&bb, time(NULL));
+	hb_hex(&bb, __atomic_add_fetch(&sequence, 1, __ATOMIC_RELAXED));
+	boundary_len = HB_LEN(&bb, boundary);
+
+	for (i = 0; i <= nranges; i++) {
+		start = pb.ptr;
+		HB_LIT(&pb, "\r\n--");
+		hb_put(&pb, boundary, boundary_len);
+		if (i == nranges) {
+			HB_LIT(&pb, "--\r\n");
+		} else {
+			HB_LIT(&pb, "\r\nContent-Type: ");
+			hb_str(&pb, v->mime);
+			HB_LIT(&pb, "\r\n");
+			hb_content_range(&pb, &ranges[i], v->entry->size);
+			HB_LIT(&pb, "\r\n");
+			length += ranges[i].end - ranges[i].start;
+		}
+		part_len[i] = pb.ptr - start;
+		length += part_len[i];
+	}
+
+	hb_status(&hb, "206 Partial Content");
+	HB_LIT(&hb, "Content-Type: multipart/byteranges; boundary=");
+	hb_put(&hb, boundary, boundary_len);
+	HB_LIT(&hb, "\r\nContent-Length: ");
+	hb_num(&hb, length);
+	HB_LIT(&hb, "\r\n");
+	hb_representation(&hb, v);
+	hb_connection(&hb, conn);
+
+	/* the parts are small, don't let each of them be a packet. */
+	tcp_cork(conn->sk, 1);
+	if (nwrite(conn->sk, header, HB_LEN(&hb, header)) <= 0)
+		goto err;
+
+	for (i = 0; i <= nranges; i++) {
+		if (nwrite(conn->sk, part, part_len[i]) <= 0)
+			goto err;
+		part += part_len[i];
+		if (i < nranges &&
+		    transfer_file_body(conn->sk, fd, ranges[i].start,
+				       ranges[i].end) == -1)
+			goto out;
+	}
+	tcp_cork(conn->sk, 0);
+	return 0;
+err:
+	perror("nwrite error when transfer multiple ranges");
+out:
+	tcp_cork(conn->sk, 0);
+	return -1;
+}
+
+/*
+ * Send the variant which is a file on disk. The validators of the request are
+ * checked first, then the whole file, a range, or several ranges of it is
+ * sent. The descriptor cached in the entry is shared by the threads, it's
+ * fine since the senders never move the file offset.
+ */
+static int transfer_variant(struct connection *conn, const struct variant *v)
+{
+	const struct file_entry *entry = v->entry;
+	int fd = entry->fd;
+	int ret = -1;
+	int nranges;
+	char etag[ETAG_BUFSZ];
+	size_t etag_len = format_etag(v, etag);
+	struct byte_range ranges[RANGES_MAX];
+	struct hot_object *obj;
+
+	if (request_not_modified(conn, entry, etag, etag_len))
+		return transfer_not_modified(conn, v);
+
+	if ((nranges = request_ranges(conn, entry, etag, etag_len,
+				      ranges)) == 0)
+		return response_range_not_satisfiable(conn, entry->size);
+
+	if (fd == -1 && (fd = open(v->pathname, O_RDONLY | O_CLOEXEC)) == -1) {
 		perror("open error when transfer file");
 		goto out;
 	}
 
-	if ((length = get_file_length_by_fd(fd)) == -1) {
-		perror("couldn't get the length of requested file");
-		goto out;
+	if (nranges == -1 && (obj = hot_object_get(v, fd))) {
+		ret = transfer_hot_object(conn, obj);
+		hot_cache_put(obj);
+		goto out;
+	}
+
+	if (nranges > 1)
+		ret = transfer_multirange(conn, fd, v, ranges, nranges);
+	else
+		ret = transfer_single(conn, fd, v,
+				      nranges == 1 ? ranges : NULL);
+out:
+	if (fd != -1 && fd != entry->fd)
+		close(fd);
+	return ret;
+}
+
+/*
+ * The content-codings in Accept-Encoding which we could send, as the mask of
+ * ENC_*. the coding with "q=0" is refused by the client.
+ */
+static int request_encodings(const struct connection *conn)
+{
+	const char *buf = conn->reqbuf;
+	const struct http_span *value;
+	const char *p, *end, *token, *token_end;
+	int mask = 0, coding;
+
+	if (!(value = http_header_find(&conn->req, buf, "Accept-Encoding")))
+		return 0;
+
+	p = HTTP_SPAN_PTR(buf, *value);
+	end = p + value->len;
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		token = p;
+		while (p < end && *p != ',' && *p != ';' && *p != ' ')
+			p++;
+		token_end = p;
+
+		if (token_end - token == 4 && !strncasecmp(token, "gzip", 4))
+			coding = ENC_GZIP;
+		else if (token_end - token == 2 && !strncasecmp(token, "br", 2))
+			coding = ENC_BR;
+		else if (token_end - token == 1 && *token == '*')
+			coding = ENC_GZIP | ENC_BR;
+		else
+			coding = 0;
+
+		/* the parameters, only "q=0" matters. */
+		while (p < end && *p != ',') {
+			if ((*p == 'q' || *p == 'Q') && end - p > 2 &&
+			    p[1] == '=' && p[2] == '0') {
+				for (p += 3; p < end && (*p == '.' || *p == '0');)
+					p++;
+				if (p == end || !isdigit(*p))
+					coding = 0;
+				continue;
+			}
+			p++;
+		}
+		mask |= coding;
+	}
+	return mask;
+}
+
+/*
+ * The precompressed sibling "foo.css.br" or "foo.css.gz" of the file, it's
+ * used only if it's not older than the file. return XFER_UNSUPPORTED if there
+ * is none of them.
+ */
+static int transfer_sibling(struct connection *conn, const struct variant *v,
+			    int encodings)
+{
+	static const struct {
+		int coding;
+		const char *name;
+		const char *suffix;
+	} siblings[] = {
+		{ ENC_BR, "br", ".br" },
+		{ ENC_GZIP, "gzip", ".gz" },
+	};
+	char pathname[PATHNAME_BUFSZ];
+	struct file_entry *entry;
+	struct variant sv;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < sizeof(siblings) / sizeof(siblings[0]); i++) {
+		if (!(encodings & siblings[i].coding) ||
+		    snprintf(pathname, sizeof(pathname), "%s%s", v->pathname,
+			     siblings[i].suffix) >= (int)sizeof(pathname))
+			continue;
+
+		if (!(entry = file_cache_get(file_cache, pathname)))
+			return -1;
+		if (!entry->error && S_ISREG(entry->mode) && entry->readable &&
+		    entry->mtime >= v->entry->mtime) {
+			sv = *v;
+			sv.pathname = pathname;
+			sv.entry = entry;
+			sv.encoding = siblings[i].name;
+			ret = transfer_variant(conn, &sv);
+			file_cache_put(file_cache, entry);
+			return ret;
+		}
+		file_cache_put(file_cache, entry);
+	}
+
+	return XFER_UNSUPPORTED;
+}
+
+/*
+ * Compress the file with gzip, the result is returned in a new buffer. It's
+ * read by pread() rather than mapped, the file may have been truncated since
+ * 'size' was taken, and a mapping touched past its end kills us by SIGBUS.
+ * NULL if the size is not 'size' any more, the variant is not offered then.
+ */
+static char *gzip_file(int fd, size_t size, size_t *len)
+{
+	z_stream zs = { 0 };
+	char *in, *out = NULL;
+	size_t bound, got = 0;
+	ssize_t n;
+
+	/* one more byte, to see if it has grown. */
+	if (!(in = malloc(size + 1))) {
+		perror("allocate memory error when compress file");
+		return NULL;
+	}
+	while (got <= size) {
+		if ((n = pread(fd, in + got, size + 1 - got, got)) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("pread error when compress file");
+			goto out;
+		}
+		if (n == 0)
+			break;
+		got += n;
+	}
+	if (got != size)
+		goto out;
+
+	if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK) {
+		fprintf(stderr, "deflateInit2 error when compress file\n");
+		goto out;
+	}
+
+	bound = deflateBound(&zs, size);
+	if (!(out = malloc(bound))) {
+		perror("allocate memory error when compress file");
+		goto end;
+	}
+
+	zs.next_in = (Bytef *)in;
+	zs.avail_in = size;
+	zs.next_out = (Bytef *)out;
+	zs.avail_out = bound;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		fprintf(stderr, "deflate error when compress file\n");
+		free(out);
+		out = NULL;
+		goto end;
+	}
+	*len = zs.total_out;
+end:
+	deflateEnd(&zs);
+out:
+	free(in);
+	return out;
+}
+
+/*
+ * Look up the compressed variant in the gzip cache, compress the file if it's
+ * not there. return the object with a reference, NULL on error.
+ */
+static struct hot_object *gzip_object_get(const struct variant *v)
+{
+	char header[HEADER_BUFSZ];
+	struct hbuf b = HB_INIT(header);
+	const struct file_entry *entry = v->entry;
+	int fd = entry->fd;
+	char *data;
+	size_t len;
+	struct hot_object *obj;
+	struct hot_key key = {
+		.dev = entry->dev,
+		.ino = entry->ino,
+		.mtime = entry->mtime,
+		.mtime_nsec = entry->mtime_nsec,
+		.size = entry->size,
+	};
+
+	if ((obj = hot_cache_get(gzip_cache, v->pathname, &key)))
+		return obj;
+
+	if (fd == -1 && (fd = open(v->pathname, O_RDONLY | O_CLOEXEC)) == -1) {
+		perror("open error when compress file");
+		return NULL;
+	}
+	data = gzip_file(fd, entry->size, &len);
+	if (fd != entry->fd)
+		close(fd);
+	if (!data)
+		return NULL;
+
+	hb_content(&b, v->mime, len);
+	hb_representation(&b, v);
+	obj = hot_cache_add_data(gzip_cache, v->pathname, &key, header,
+				 HB_LEN(&b, header), data, len);
+	free(data);
+	return obj;
+}
+
+/*
+ * Send the variant compressed by us, it's kept in the gzip cache, so a file
+ * is compressed only once until it's modified. the ranges are not offered
+ * for it. return XFER_UNSUPPORTED if the file couldn't be compressed.
+ */
+static int transfer_gzip(struct connection *conn, const struct variant *v)
+{
+	int ret;
+	char etag[ETAG_BUFSZ];
+	size_t etag_len = format_etag(v, etag);
+	struct hot_object *obj;
+
+	if (request_not_modified(conn, v->entry, etag, etag_len))
+		return transfer_not_modified(conn, v);
+
+	if (!(obj = gzip_object_get(v)))
+		return XFER_UNSUPPORTED;
+
+	ret = transfer_hot_object(conn, obj);
+	hot_cache_put(obj);
+	return ret;
+}
+
+/*
+ * Send the regular file 'pathname' whose metadata is 'entry'. The text file
+ * is sent compressed if the client accepts it, the precompressed sibling is
+ * preferred, or it's compressed by us.
+ */
+static int transfer_file(struct connection *conn, const char *pathname,
+			 const struct file_entry *entry)
+{
+	int ret, encodings;
+	struct variant v = {
+		.pathname = pathname,
+		.entry = entry,
+		.mime = get_mime_type(pathname),
+	};
+
+	/*
+	 * if the file of client requested is a not valid MIME type, terminate
+	 * this transfer.
+	 */
+	if (!v.mime) {
+		fprintf(stderr, "unknown mime type when request file: %s.\n",
+				pathname);
+		return -1;
+	}
+
+	if (mime_compressible(v.mime) &&
+	    (encodings = request_encodings(conn))) {
+		if ((ret = transfer_sibling(conn, &v, encodings)) !=
+		    XFER_UNSUPPORTED)
+			return ret;
+
+		if (gzip_cache && (encodings & ENC_GZIP) &&
+		    entry->size >= GZIP_MIN_LENGTH &&
+		    entry->size <= GZIP_SOURCE_MAX) {
+			v.encoding = "gzip";
+			v.gzipped = 1;
+			if ((ret = transfer_gzip(conn, &v)) != XFER_UNSUPPORTED)
+				return ret;
+			v.encoding = NULL;
+			v.gzipped = 0;
+		}
+	}
+
+	return transfer_variant(conn, &v);
+}
+
+/*
+ * Format the row of file 'name' in the listing of directory, 'pathname' is
+ * the full path of it. return the length of the row, -1 if couldn't stat it.
+ */
+static int format_dir_item(const char *pathname, const char *name,
+			   char *buf, size_t size)
+{
+	char date_str[DATE_BUFSZ];
+	char filesize_str[FILESIZE_BUFSZ] = "";
+	char filename[NAME_MAX + 2];
+	struct stat st;
+	int len;
+
+	if (stat(pathname, &st) == -1) {
+		perror("stat error when try add entity of directory.");
+		return -1;
+	}
+
+	if (S_ISREG(st.st_mode))
+		snprintf(filesize_str, sizeof(filesize_str),
+					"%ld bytes", st.st_size);
+
+	snprintf(filename, sizeof(filename), "%s%s", name,
+		 S_ISDIR(st.st_mode) ? "/" : "");
+
+	get_date((time_t)st.st_mtime, date_str, sizeof(date_str));
+	len = snprintf(buf, size, HTTP_DIR_ITEMS, filename, filename,
+		       date_str, filesize_str);
+	return len < (int)size ? len : (int)size - 1;
+}
+
+/*
+ * Render the row for the directory cache.
+ */
+static int render_dir_row(const char *dirpath, const char *name,
+			  char *buf, size_t size)
+{
+	char pathname[PATHNAME_BUFSZ];
+
+	snprintf(pathname, sizeof(pathname), "%s%s", dirpath, name);
+	return format_dir_item(pathname, name, buf, size);
+}
+
+/*
+ * Send the listing from the cached rows. the HTML header and tail are
+ * gathered with them by writev(), nothing is copied.
+ */
+static int transfer_cached_list(struct connection *conn, const char *pathname,
+				const struct dir_body *body)
+{
+	char header[HEADER_BUFSZ];
+	struct hbuf b = HB_INIT(header);
+	char *head, *tail = NULL;
+	int head_len, tail_len;
+	int ret = -1;
+	struct iovec iov[4];
+
+	head_len = asprintf(&head, HTTP_DIR_HEAD, pathname, pathname);
+	tail_len = asprintf(&tail, HTTP_DIR_TAIL, SERV_VERSION);
+	if (head_len == -1 || tail_len == -1) {
+		perror("allocate memory error when transfer list of file");
+		if (head_len != -1)
+			free(head);
+		return -1;
+	}
+
+	hb_status(&b, "200 OK");
+	hb_content(&b, "text/html; charset=utf-8",
+		   head_len + body->len + tail_len);
+	hb_connection(&b, conn);
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = HB_LEN(&b, header);
+	iov[1].iov_base = head;
+	iov[1].iov_len = head_len;
+	iov[2].iov_base = body->data;
+	iov[2].iov_len = body->len;
+	iov[3].iov_base = tail;
+	iov[3].iov_len = tail_len;
+
+	if (nwritev(conn->sk, iov, 4) == -1)
+		fprintf(stderr, "nwritev error when send contents of "
+				"directory\n");
+	else
+		ret = 0;
+
+	free(head);
+	free(tail);
+	return ret;
+}
+
+/*
+ * The listing without the cache is streamed, the rows are formatted into a
+ * buffer of LIST_CHUNK_BUFSZ bytes, which is sent as one chunk once it's
+ * full. so the memory doesn't grow with the directory, and the first rows go
+ * out before the scan finished. The client of HTTP/1.0 gets the raw body, and
+ * the connection is closed to mark its end.
+ */
+struct list_stream {
+	struct connection *conn;
+	int chunked;		/* Transfer-Encoding: chunked */
+	size_t header_len;	/* bytes in 'header' not sent yet */
+	size_t len;		/* bytes in 'buf' */
+	char header[HEADER_BUFSZ];
+	char buf[LIST_CHUNK_BUFSZ];
+};
+
+/*
+ * Send the rows in buffer as a chunk, the response header goes out with the
+ * first one, and the 'last' chunk is appended to the final one.
+ */
+static int list_stream_flush(struct list_stream *ls, int last)
+{
+	char size[24];
+	struct hbuf b = HB_INIT(size);
+	struct iovec iov[5];
+	int n = 0;
+
+	if (ls->header_len) {
+		iov[n].iov_base = ls->header;
+		iov[n++].iov_len = ls->header_len;
+	}
+	if (ls->len && ls->chunked) {
+		hb_hex(&b, ls->len);
+		HB_LIT(&b, "\r\n");
+		iov[n].iov_base = size;
+		iov[n++].iov_len = HB_LEN(&b, size);
+	}
+	if (ls->len) {
+		iov[n].iov_base = ls->buf;
+		iov[n++].iov_len = ls->len;
+	}
+	if (ls->len && ls->chunked) {
+		iov[n].iov_base = "\r\n";
+		iov[n++].iov_len = 2;
+	}
+	if (last && ls->chunked) {
+		iov[n].iov_base = "0\r\n\r\n";
+		iov[n++].iov_len = 5;
+	}
+
+	if (n && nwritev(ls->conn->sk, iov, n) == -1) {
+		fprintf(stderr, "nwritev error when send contents of "
+				"directory\n");
+		return -1;
+	}
+	ls->header_len = 0;
+	ls->len = 0;
+	return 0;
+}
+
+/*
+ * Make sure there are at least 'room' bytes free in the buffer.
+ */
+static int list_stream_reserve(struct list_stream *ls, size_t room)
+{
+	if (sizeof(ls->buf) - ls->len >= room)
+		return 0;
+	return list_stream_flush(ls, 0);
+}
+
+static void list_stream_start(struct list_stream *ls,
+			      struct connection *conn, const char *pathname)
+{
+	struct hbuf b = HB_INIT(ls->header);
+
+	ls->conn = conn;
+	ls->chunked = HTTP_SPAN_EQ(conn->reqbuf, conn->req.version,
+				   "HTTP/1.1");
+	if (!ls->chunked)
+		conn->keepalive = 0;
+
+	hb_status(&b, "200 OK");
+	HB_LIT(&b, "Content-Type: text/html; charset=utf-8\r\n");
+	if (ls->chunked)
+		HB_LIT(&b, "Transfer-Encoding: chunked\r\n");
+	hb_connection(&b, conn);
+	ls->header_len = HB_LEN(&b, ls->header);
+
+	/* the room is enough for the longest pathname. */
+	ls->len = snprintf(ls->buf, sizeof(ls->buf), HTTP_DIR_HEAD,
+			   pathname, pathname);
+}
+
+/*
+ * Send the rest of rows, the tail of HTML, and the last chunk together.
+ */
+static int list_stream_finish(struct list_stream *ls)
+{
+	if (list_stream_reserve(ls, HTMLTAIL_BUFSZ) == -1)
+		return -1;
+	ls->len += snprintf(ls->buf + ls->len, sizeof(ls->buf) - ls->len,
+			    HTTP_DIR_TAIL, SERV_VERSION);
+	return list_stream_flush(ls, 1);
+}
+
+/*
+ * When request directory haven't index.html, we travel the directory, and
+ * return a html file which contains a file list of current directory.
+ */
+static int transfer_list(struct connection *conn, char *pathname)
+{
+	int ret = -1;
+	int len;
+	size_t pathname_len = strlen(pathname);
+	char *ptr = pathname + pathname_len;
+	DIR *dir = NULL;
+	struct dirent entry, *res;
+	struct dir_body *body;
+	struct list_stream *ls = NULL;
+
+	if (dir_cache) {
+		if (!(body = dir_cache_get(dir_cache, pathname))) {
+			if (errno == EACCES)
+				response_forbidden(conn);
+			else if (errno == ENOENT)
+				response_not_found(conn);
+			else
+				perror("error when get the cached list of file");
+			return -1;
+		}
+
+		ret = transfer_cached_list(conn, pathname, body);
+		dir_body_put(body);
+		return ret;
+	}
+
+	if (!(dir = opendir(pathname))) {
+		if (errno == EACCES)
+			response_forbidden(conn);
+		else if (errno == ENOENT)
+			response_not_found(conn);
+		else
+			perror("opendir error when transfer list of file");
+
+		goto out;
+	}
+
+	if (!(ls = malloc(sizeof(*ls)))) {
+		perror("allocate memory error when transfer list of file");
+		goto out;
+	}
+	list_stream_start(ls, conn, pathname);
+
+	while (readdir_r(dir, &entry, &res) == 0 && res) {
+		strncpy(ptr, entry.d_name, PATHNAME_BUFSZ - pathname_len);
+
+		/*
+		 * Add the file's name, modification time and size to the
+		 * buffer in form of HTML. the file couldn't be stat is
+		 * skipped.
+		 */
+		if (list_stream_reserve(ls, DIR_ROW_BUFSZ) == -1)
+			goto out;
+		if ((len = format_dir_item(pathname, entry.d_name,
+					   ls->buf + ls->len,
+					   DIR_ROW_BUFSZ)) > 0)
+			ls->len += len;
+		*ptr = 0;
+	}
+	*ptr = 0;
+
+	if (list_stream_finish(ls) == -1)
+		goto out;
+
+	ret = 0;
+out:
+	if (dir)
+		closedir(dir);
+	free(ls);
+	return ret;
+}
+
+
+static int process_pathname_is_directory(struct connection *conn,
+					 char *pathname)
+{
+	int ret;
+	size_t len = strlen(pathname);
+	struct file_entry *index;
+
+	strncat(pathname, "index.html", PATHNAME_BUFSZ - len - 1);
+	if (!(index = file_cache_get(file_cache, pathname)))
+		return -1;
+
+	if (!index->error && S_ISREG(index->mode)) {
+		if (index->readable) {
+			ret = transfer_file(conn, pathname, index);
+		} else {
+			response_forbidden(conn);
+			ret = 0;
+		}
+		file_cache_put(file_cache, index);
+		return ret;
+	}
+	file_cache_put(file_cache, index);
+	pathname[len] = 0;
+	
+	/*
+	 * not 'index.html', then return a file list of current dir.
+	 */
+	if (transfer_list(conn, pathname) == -1)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Decide whether the connection could be kept after this request. HTTP/1.1
+ * keep the connection by default, and HTTP/1.0 only if the client asked for
+ * it.
+ */
+static int request_wants_keepalive(const struct http_request *req,
+				   const char *buf)
+{
+	int keepalive = HTTP_SPAN_EQ(buf, req->version, "HTTP/1.1");
+	const struct http_span *value;
+
+	if ((value = http_header_find(req, buf, "Connection"))) {
+		if (value->len >= 5 &&
+		    !strncasecmp(HTTP_SPAN_PTR(buf, *value), "close", 5))
+			keepalive = 0;
+		else if (value->len >= 10 &&
+			 !strncasecmp(HTTP_SPAN_PTR(buf, *value),
+				      "keep-alive", 10))
+			keepalive = 1;
+	}
+
+	return keepalive;
+}
+
+/*
+ * The counters of the server, served at STATUS_PATH. the text is for the
+ * human, "?format=prometheus" for the scraper.
+ */
+static int transfer_status(struct connection *conn, const char *query)
+{
+	int i, ret = -1;
+	int format = STATS_TEXT;
+	long queued = 0, threads = 0, rejected = 0;
+	char *body = NULL;
+	size_t len = 0;
+	FILE *fp;
+	char buf[HEADER_BUFSZ];
+	struct hbuf b = HB_INIT(buf);
+	struct iovec iov[2];
+	struct thread_pool *pool;
+
+	if (query && !strcmp(query, "format=prometheus"))
+		format = STATS_PROMETHEUS;
+
+	if (!(fp = open_memstream(&body, &len))) {
+		perror("open_memstream");
+		return -1;
+	}
+	for (i = 0; i < server.nacceptors; i++) {
+		pool = server.acceptors[i].pool;
+		queued += __atomic_load_n(&pool->qsize, __ATOMIC_RELAXED);
+		threads += __atomic_load_n(&pool->num_threads,
+					   __ATOMIC_RELAXED);
+		rejected += __atomic_load_n(&pool->rejected,
+					    __ATOMIC_RELAXED);
+	}
+	stats_write(fp, format);
+	stats_gauge(fp, format, "connections", "Connections being served.",
+		    __atomic_load_n(&server.nconns, __ATOMIC_RELAXED));
+	stats_gauge(fp, format, "queued_jobs",
+		    "Jobs waiting in the queues of pools.", queued);
+	stats_gauge(fp, format, "threads", "Threads of the pools.", threads);
+	stats_counter(fp, format, "rejected_jobs_total",
+		      "Jobs refused by the pools with 503.", rejected);
+	stats_counter(fp, format, "timeouts_total",
+		      "Connections shut down by the header, send or transfer "
+		      "deadline.",
+		      __atomic_load_n(&server.timeouts, __ATOMIC_RELAXED));
+	if (fclose(fp) == EOF) {
+		perror("write the counters of server");
+		goto out;
+	}
+
+	hb_status(&b, "200 OK");
+	HB_LIT(&b, "Cache-Control: no-store\r\n");
+	hb_content(&b, format == STATS_PROMETHEUS ?
+		       "text/plain; version=0.0.4" : "text/plain; charset=utf-8",
+		   len);
+	hb_connection(&b, conn);
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = HB_LEN(&b, buf);
+	iov[1].iov_base = body;
+	iov[1].iov_len = len;
+	if (nwritev(conn->sk, iov, 2) == -1) {
+		fprintf(stderr, "nwritev error when send the counters.\n");
+		goto out;
+	}
+	ret = 0;
+out:
+	free(body);
+	return ret;
+}
+
+/*
+ * Response the request which has been parsed into 'req', 'buf' holds the
+ * bytes of it. return 0 on success, -1 if the connection should be closed
+ * since the response couldn't be completed.
+ */
+static int serve_request(struct connection *conn,
+			 const struct http_request *req, const char *buf)
+{
+	int ret = -1;
+	char pathname[PATHNAME_BUFSZ];
+	char *query;
+	struct file_entry *entry = NULL;
+
+	stats_begin();
+	conn->reqbuf = buf;
+	if (req->path.len >= sizeof(pathname)) {
+		conn->keepalive = 0;
+		response_bad_request(conn);
+		goto out;
+	}
+	memcpy(pathname, HTTP_SPAN_PTR(buf, req->path), req->path.len);
+	pathname[req->path.len] = 0;
+
+	conn->nrequests++;
+	conn->keepalive = conf.keepalive_max > 0 &&
+			  conn->nrequests < conf.keepalive_max &&
+			  !__atomic_load_n(&server.draining, __ATOMIC_RELAXED) &&
+			  request_wants_keepalive(req, buf);
+
+	if (!HTTP_SPAN_EQ(buf, req->method, "GET")) {	/* not supported */
+		response_not_supported(conn);
+		goto done;
+	}
+
+	if ((query = strchr(pathname, '?')))
+		*query++ = 0;
+	if (!strcmp(pathname, STATUS_PATH)) {
+		ret = transfer_status(conn, query);
+		goto out;
+	}
+	if (query)
+		query[-1] = '?';
+
+#if defined(USE_URL_DECODING)
+	pathname_decoding(pathname);
+#endif
+
+	/* one lookup answers all of the questions below. */
+	if (!(entry = file_cache_get(file_cache, pathname)))
+		goto out;
+	stats_mark(STATS_META);
+
+	if (entry->error == ENOENT) {		/* pathname don't exist */
+		response_not_found(conn);
+		goto done;
+	}
+	
+	if (!entry->error && S_ISDIR(entry->mode)) {
+		if (pathname[strlen(pathname) - 1] != '/') {
+			response_found(conn, pathname);
+			goto done;
+		}
+		
+		if (process_pathname_is_directory(conn, pathname) == -1)
+			goto out;
+		goto done;
+	}
+
+	if (entry->error || !S_ISREG(entry->mode) || !entry->readable) {
+		response_forbidden(conn);
+		goto done;
+	}
+	
+	if (transfer_file(conn, pathname, entry) == -1)
+			goto out;
+
+done:
+	ret = 0;
+out:
+	file_cache_put(file_cache, entry);
+	stats_mark(STATS_BODY);
+	stats_end();
+	return ret;
+}
+
+/*
+ * The deadlines of connection share one timer of the wheel, it fires at the
+ * earliest of them. the stall deadline moves with every write, so when the
+ * timer fires, it may not be due yet, then the timer is simply armed again.
+ */
+static unsigned long connection_due(struct connection *conn)
+{
+	unsigned long due = conn->deadline, stall;
+
+	if (conn->stall) {
+		stall = __atomic_load_n(&conn->progress, __ATOMIC_RELAXED) +
+			conn->stall;
+		if (!due || stall < due)
+			due = stall;
+	}
+	return due;
+}
+
+/*
+ * Called by the thread of wheel. whoever holds the connection, a thread
+ * blocked on the socket, or the reactor waiting for the request, wakes up
+ * by the shutdown and closes it as usual. the connection can't be released
+ * meanwhile, connection_release() cancels the timer first.
+ */
+static unsigned long connection_timeout(struct timer *timer)
+{
+	struct connection *conn = (struct connection *)
+				  ((char *)timer -
+				   offsetof(struct connection, timer));
+	unsigned long now = timer_wheel_now(timers);
+	unsigned long due = connection_due(conn);
+
+	if (due > now)
+		return due - now;
+	__atomic_add_fetch(&server.timeouts, 1, __ATOMIC_RELAXED);
+	shutdown(conn->sk, SHUT_RDWR);
+	return 0;
+}
+
+/*
+ * The partial request is in the buffer, the rest of header must come in
+ * time, no matter how slowly it's trickling in. it's armed only once per
+ * request.
+ */
+static void connection_header_deadline(struct connection *conn)
+{
+	if (!timers || !conf.header_timeout || conn->deadline)
+		return;
+	conn->deadline = timer_wheel_now(timers) + conf.header_timeout * 1000;
+	timer_arm(timers, &conn->timer, conf.header_timeout * 1000);
+}
+
+/*
+ * The request has been received, the response is going to be sent: the
+ * header deadline gives way to the stall and the transfer deadlines.
+ */
+static void connection_send_deadline(struct connection *conn)
+{
+	unsigned long now;
+
+	if (!timers)
+		return;
+	if (!conf.send_timeout && !conf.transfer_timeout) {
+		if (conn->deadline) {
+			timer_cancel(timers, &conn->timer);
+			conn->deadline = 0;
+		}
+		return;
+	}
+
+	/* the timer isn't touched by the wheel while it's updated. */
+	if (conn->deadline)
+		timer_cancel(timers, &conn->timer);
+	now = timer_wheel_now(timers);
+	conn->deadline = conf.transfer_timeout ?
+			 now + conf.transfer_timeout * 1000 : 0;
+	conn->stall = conf.send_timeout * 1000;
+	conn->progress = now;
+	if (conn->stall)
+		sending = conn;
+	timer_arm(timers, &conn->timer, connection_due(conn) - now);
+}
+
+static void connection_clear_deadline(struct connection *conn)
+{
+	if (!conn->deadline && !conn->stall)
+		return;
+	timer_cancel(timers, &conn->timer);
+	conn->deadline = 0;
+	conn->stall = 0;
+	sending = NULL;
+}
+
+/*
+ * Serve all of the complete requests in the buffer of connection one by one,
+ * this is how the pipelined requests are handled. the parser remembers where
+ * it stopped, so the partial request left in the buffer won't be scanned
+ * again. return 0 if the connection is waiting more data, -1 if it should be
+ * closed.
+ */
+static int serve_pipeline(struct connection *conn)
+{
+	int ret;
+	size_t start = 0;
+	unsigned long t;
+
+	for (;;) {
+		t = stats_now();
+		ret = http_parse(&conn->req, conn->buf + start,
+				 conn->len - start);
+		conn->parse_ns += stats_now() - t;
+		if (ret != HTTP_PARSE_DONE)
+			break;
+		stats_record(STATS_PARSE, conn->parse_ns);
+		conn->parse_ns = 0;
+
+		connection_send_deadline(conn);
+		ret = serve_request(conn, &conn->req, conn->buf + start);
+		connection_clear_deadline(conn);
+		if (ret == -1 || !conn->keepalive)
+			return -1;
+
+		start += conn->req.len;
+		http_parser_init(&conn->req);
+	}
+
+	if (ret == HTTP_PARSE_ERROR) {
+		conn->keepalive = 0;
+		response_bad_request(conn);
+		return -1;
+	}
+
+	if (start) {
+		conn->len -= start;
+		memmove(conn->buf, conn->buf + start, conn->len);
+	}
+	if (conn->len)
+		connection_header_deadline(conn);
+	return 0;
+}
+
+/*
+ * Make room in the buffer of connection for the rest of request. the header
+ * longer than the inline buffer moves to a larger one, which is kept until
+ * the connection is closed. return -1 if the header is too long.
+ */
+static int connection_reserve(struct connection *conn)
+{
+	char *buf;
+
+	if (conn->len < conn->size)
+		return 0;
+	if (conn->size >= REQUEST_MAX)
+		return -1;
+
+	if (conn->buf == conn->ibuf) {
+		if (!(buf = malloc(REQUEST_MAX)))
+			return -1;
+		memcpy(buf, conn->buf, conn->len);
+	} else if (!(buf = realloc(conn->buf, REQUEST_MAX))) {
+		return -1;
+	}
+	conn->buf = buf;
+	conn->size = REQUEST_MAX;
+	return 0;
+}
+
+/*
+ * Append the data from the socket to the buffer of connection. return the
+ * number of bytes read, 0 on end of file, -1 on error or would block.
+ */
+static ssize_t connection_fill(struct connection *conn)
+{
+	ssize_t nread;
+
+	if (connection_reserve(conn) == -1) {
+		conn->keepalive = 0;
+		response_bad_request(conn);
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	while ((nread = read(conn->sk, conn->buf + conn->len,
+			     conn->size - conn->len)) == -1) {
+		if (errno != EINTR)
+			break;
+	}
+
+	if (nread > 0)
+		conn->len += nread;
+	else if (nread == -1 && errno != EAGAIN)
+		perror("read request from client");
+
+	return nread;
+}
+
+static void connection_init(struct connection *conn, int sk)
+{
+	conn->sk = sk;
+	conn->buf = conn->ibuf;
+	conn->size = sizeof(conn->ibuf);
+	conn->parse_ns = 0;
+	conn->deadline = 0;
+	conn->stall = 0;
+	timer_init(&conn->timer, connection_timeout);
+	http_parser_init(&conn->req);
+	__atomic_add_fetch(&server.nconns, 1, __ATOMIC_RELAXED);
+}
+
+static void connection_release(struct connection *conn)
+{
+	/* the fd mustn't be shut down by the timer, once it's reused. */
+	if (conn->deadline || conn->stall)
+		timer_cancel(timers, &conn->timer);
+	__atomic_sub_fetch(&server.nconns, 1, __ATOMIC_RELAXED);
+	close(conn->sk);
+	if (conn->buf != conn->ibuf)
+		free(conn->buf);
+}
+
+/*
+ * Wait at most 'timeout' seconds for the request. return 1 if the descriptor
+ * become readable, 0 on timeout, -1 on error.
+ */
+static int wait_readable(int fd, int timeout)
+{
+	int n;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	while ((n = poll(&pfd, 1, timeout * 1000)) == -1) {
+		if (errno != EINTR)
+			return -1;
+	}
+	return n;
+}
+
+/*
+ * This function will be passing to the thread pool, used to process the request
+ * from the client, it will be store into a work_t object with socket descriptor
+ * associated with client. and finally will be called from a free thread.
+ *
+ * The thread is occupied until the client closed the connection, or it keeps
+ * idle longer than the keep-alive timeout, so the connection simply lives on
+ * the stack of the thread.
+ */
+static int process_request(void *arg)
+{
+	struct connection conn = { 0 };
+
+	stats_record(STATS_QUEUE, thread_pool_job_wait());
+	connection_init(&conn, JOB_INT(arg));
+	while (wait_readable(conn.sk, conf.keepalive_timeout) > 0 &&
+	       connection_fill(&conn) > 0 &&
+	       serve_pipeline(&conn) == 0)
+		;
+
+	connection_release(&conn);
+	return 0;
+}
+
+static void idle_list_add(struct reactor *reactor, struct connection *conn)
+{
+	conn->expire = time(NULL) + conf.keepalive_timeout;
+	conn->next = NULL;
+	conn->prev = reactor->idle_tail;
+	if (reactor->idle_tail)
+		reactor->idle_tail->next = conn;
+	else
+		reactor->idle_head = conn;
+	reactor->idle_tail = conn;
+}
+
+static void idle_list_del(struct reactor *reactor, struct connection *conn)
+{
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		reactor->idle_head = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	else
+		reactor->idle_tail = conn->prev;
+	conn->prev = conn->next = NULL;
+}
+
+static void reactor_close(struct connection *conn)
+{
+	struct reactor *reactor = conn->reactor;
+
+	connection_release(conn);
+	slab_free(reactor->conn_slab, conn);
+	__atomic_sub_fetch(&reactor->nconns, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Give the connection back to the epoll set, to wait its next request. It's
+ * linked to the idle list before re-armed, so the reactor always find it there
+ * once the event was reported.
+ */
+static int reactor_rearm(struct connection *conn)
+{
+	struct reactor *reactor = conn->reactor;
+	struct epoll_event ev = { 0 };
+
+	pthread_mutex_lock(&reactor->idle_lock);
+	idle_list_add(reactor, conn);
+	pthread_mutex_unlock(&reactor->idle_lock);
+
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.ptr = conn;
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, conn->sk, &ev) == -1) {
+		perror("epoll_ctl error when re-arm the connection");
+		pthread_mutex_lock(&reactor->idle_lock);
+		idle_list_del(reactor, conn);
+		pthread_mutex_unlock(&reactor->idle_lock);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Close the connections which have been idle longer than the keep-alive
+ * timeout. They are in the order of expiration, so we stop at the first one
+ * which is still alive.
+ */
+static void reactor_expire(struct reactor *reactor)
+{
+	time_t now = time(NULL);
+	struct connection *conn;
+
+	pthread_mutex_lock(&reactor->idle_lock);
+	while ((conn = reactor->idle_head) && conn->expire <= now) {
+		idle_list_del(reactor, conn);
+		reactor_close(conn);
+	}
+	pthread_mutex_unlock(&reactor->idle_lock);
+}
+
+/*
+ * Job of the reactor mode. It's dispatched only after the epoll reported the
+ * connection is readable. we read until the socket is drained, serve all of
+ * the complete requests, and then give the connection back to the reactor.
+ */
+static int process_connection(void *arg)
+{
+	ssize_t nread;
+	struct connection *conn = arg;
+
+	stats_record(STATS_QUEUE, thread_pool_job_wait());
+	do {
+		nread = connection_fill(conn);
+		if (nread == 0 || (nread == -1 && errno != EAGAIN))
+			goto out;
+		if (serve_pipeline(conn) == -1)
+			goto out;
+	} while (nread > 0);
+
+	if (reactor_rearm(conn) == -1)
+		goto out;
+	return 0;
+out:
+	reactor_close(conn);
+	return 0;
+}
+
+/*
+ * The responses are assembled before sent (writev, MSG_MORE and TCP_CORK),
+ * so Nagle's algorithm could only delay the last segment of them.
+ */
+static void set_nodelay(int sk)
+{
+	int on = 1;
+
+	if (setsockopt(sk, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1)
+		perror("setsockopt TCP_NODELAY");
+}
+
+static int set_nonblocking(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int accepted_all(void)
+{
+	return __atomic_load_n(&server.accepted, __ATOMIC_ACQUIRE) >=
+	       server.max_request;
+}
+
+/* stop accepting, all of them have come, or the sockets were handed off. */
+static int accepted_enough(void)
+{
+	return accepted_all() ||
+	       __atomic_load_n(&server.draining, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Count a accepted connection. The group which reached the 'max_request'
+ * shuts down all of the listen sockets, so the others blocking in accept()
+ * will return and see it.
+ */
+static void count_accepted(void)
+{
+	int i;
+
+	if (__atomic_add_fetch(&server.accepted, 1, __ATOMIC_ACQ_REL) !=
+	    server.max_request || conf.reactor)
+		return;
+
+	for (i = 0; i < server.nacceptors; i++)
+		shutdown(server.acceptors[i].sk, SHUT_RD);
+}
+
+/*
+ * Look up the binary 'name' in PATH like execvp(), into 'path' of 'size'
+ * bytes. it's done before fork(), the child may only make async-signal-safe
+ * calls. return -1 if it's not found.
+ */
+static int resolve_binary(const char *name, char *path, size_t size)
+{
+	int len;
+	const char *dirs, *end;
+
+	if (strchr(name, '/'))
+		return (size_t)snprintf(path, size, "%s", name) < size ? 0 : -1;
+
+	if (!(dirs = getenv("PATH")))
+		dirs = "/bin:/usr/bin";
+	for (;; dirs = end + 1) {
+		end = strchrnul(dirs, ':');
+		/* an empty one is the current directory. */
+		if ((len = end - dirs))
+			len = snprintf(path, size, "%.*s/%s", len, dirs, name);
+		else
+			len = snprintf(path, size, "%s", name);
+		if ((size_t)len < size && access(path, X_OK) == 0)
+			return 0;
+		if (!*end)
+			break;
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+/*
+ * Start the new server by the same command line, and hand our listen
+ * sockets to it as the descriptors from 3 on, with LISTEN_FDS. the binary
+ * is looked up by its name again, so this is how a new version takes over.
+ * The other descriptors are close-on-exec, but the write end of a pipe is
+ * passed right after the sockets, LISTEN_READY_FD. the child writes errno to
+ * it if exec failed, the new server writes 0 once it has adopted the
+ * sockets, and it's closed without a word if the new server died before.
+ * return 0 if the new server has been started, handoff_poll() waits for it.
+ */
+static int server_handoff(void)
+{
+	int i, n, err = 0, ret = -1;
+	int pfd[2], wfd;
+	int *fds = NULL;
+	char **envp = NULL;
+	char var[32], ready[32], path[PATH_MAX];
+	pid_t pid;
+
+	if (resolve_binary(server_argv[0], path, sizeof(path)) == -1) {
+		fprintf(stderr, "start the new server %s: %s\n",
+			server_argv[0], strerror(errno));
+		return -1;
+	}
+
+	for (n = 0; environ[n]; n++)
+		;
+	if (!(envp = calloc(n + 3, sizeof(*envp))) ||
+	    !(fds = calloc(server.nacceptors, sizeof(*fds)))) {
+		perror("allocate memory for handoff error");
+		goto out;
+	}
+	memcpy(envp, environ, n * sizeof(*envp));
+	snprintf(var, sizeof(var), "LISTEN_FDS=%d", server.nacceptors);
+	snprintf(ready, sizeof(ready), "LISTEN_READY_FD=%d",
+		 LISTEN_FDS_START + server.nacceptors);
+	envp[n] = var;
+	envp[n + 1] = ready;
+
+	if (pipe2(pfd, O_CLOEXEC | O_NONBLOCK) == -1) {
+		perror("pipe2 error when hand off");
+		goto out;
+	}
+
+	if ((pid = fork()) == -1) {
+		perror("fork error when hand off");
+		close(pfd[0]);
+		close(pfd[1]);
+		goto out;
+	}
+
+	if (pid == 0) {
+		/*
+		 * only the async-signal-safe calls here. everything is moved
+		 * above the targets first, so dup2() never overwrites the
+		 * descriptor which hasn't been moved yet.
+		 */
+		n = server.nacceptors;
+		wfd = fcntl(pfd[1], F_DUPFD_CLOEXEC, LISTEN_FDS_START + n + 1);
+		for (i = 0; i < n; i++) {
+			if ((fds[i] = fcntl(server.acceptors[i].sk,
+					    F_DUPFD_CLOEXEC,
+					    LISTEN_FDS_START + n + 1)) == -1)
+				goto fail;
+		}
+		for (i = 0; i < n; i++) {
+			if (dup2(fds[i], LISTEN_FDS_START + i) == -1)
+				goto fail;
+		}
+		/* the copy without close-on-exec, for the new server. */
+		if (wfd == -1 || dup2(wfd, LISTEN_FDS_START + n) == -1)
+			goto fail;
+		execve(path, server_argv, envp);
+fail:
+		err = errno;
+		if (write(wfd, &err, sizeof(err)) == -1)
+			;
+		_exit(127);
+	}
+
+	close(pfd[1]);
+	server.handoff_pid = pid;
+	__atomic_store_n(&server.handoff_fd, pfd[0], __ATOMIC_RELEASE);
+	fprintf(stderr, "new server %d started, waiting for it.\n", pid);
+	ret = 0;
+out:
+	free(envp);
+	free(fds);
+	return ret;
+}
+
+/*
+ * See whether the new server has taken over, without blocking. it's ready
+ * by a 0, and the errno or EOF means it has failed, we go on as usual then.
+ */
+static void handoff_poll(void)
+{
+	int err = -1;
+	ssize_t n;
+
+	if ((n = read(server.handoff_fd, &err, sizeof(err))) == -1 &&
+	    (errno == EAGAIN || errno == EINTR))
+		return;
+
+	close(server.handoff_fd);
+	__atomic_store_n(&server.handoff_fd, -1, __ATOMIC_RELEASE);
+	if (n == sizeof(err) && !err) {
+		fprintf(stderr, "listen sockets handed off, draining.\n");
+		__atomic_store_n(&server.draining, 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	if (n == sizeof(err))
+		fprintf(stderr, "start the new server %s: %s\n",
+			server_argv[0], strerror(err));
+	else
+		fprintf(stderr, "the new server exited before it was "
+				"ready.\n");
+	waitpid(server.handoff_pid, NULL, 0);
+}
+
+/*
+ * Called by the accept loops, at least every REACTOR_TICK. the first one
+ * which sees SIGUSR2 starts the new server. we keep accepting until it's
+ * ready, and then all of the loops stop, the connections we have are served
+ * until they are closed.
+ */
+static void handoff_check(void)
+{
+	if (!__atomic_load_n(&server.upgrade, __ATOMIC_ACQUIRE) &&
+	    __atomic_load_n(&server.handoff_fd, __ATOMIC_ACQUIRE) == -1)
+		return;
+	if (pthread_mutex_trylock(&handoff_lock))
+		return;
+
+	/* another SIGUSR2 waits until this one has been settled. */
+	if (server.handoff_fd == -1 &&
+	    __atomic_exchange_n(&server.upgrade, 0, __ATOMIC_ACQ_REL))
+		server_handoff();
+	if (server.handoff_fd != -1)
+		handoff_poll();
+	pthread_mutex_unlock(&handoff_lock);
+}
+
+/*
+ * The connection of the socket accepted by the reactor. return NULL on error,
+ * the socket has been closed then.
+ */
+static struct connection *reactor_conn_new(struct reactor *reactor, int clisk)
+{
+	struct connection *conn;
+
+	set_nodelay(clisk);
+	if (!(conn = slab_alloc(reactor->conn_slab))) {
+		fprintf(stderr, "allocate memory to store the connection "
+				"error\n");
+		close(clisk);
+		return NULL;
+	}
+	memset(conn, 0, offsetof(struct connection, ibuf));
+	connection_init(conn, clisk);
+	conn->reactor = reactor;
+	return conn;
+}
+
+/*
+ * Accept a new connection, and add it to the epoll set. It will be handed to
+ * the thread pool when the request arrived. return 1 if a connection has been
+ * accepted, 0 if nothing is pending, -1 on error.
+ */
+static int reactor_accept(struct acceptor *acc)
+{
+	int clisk;
+	struct connection *conn;
+	struct reactor *reactor = &acc->reactor;
+	struct epoll_event ev = { 0 };
+
+	if ((clisk = accept4(acc->sk, NULL, 0,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+		if (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED)
+			return 0;
+		perror("accept4");
+		return -1;
+	}
+
+	if (!(conn = reactor_conn_new(reactor, clisk)))
+		return -1;
+
+	/* the first request is limited by the keep-alive timeout as well. */
+	pthread_mutex_lock(&reactor->idle_lock);
+	idle_list_add(reactor, conn);
+	pthread_mutex_unlock(&reactor->idle_lock);
+
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.ptr = conn;
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, clisk, &ev) == -1) {
+		perror("epoll_ctl error when add the connection");
+		pthread_mutex_lock(&reactor->idle_lock);
+		idle_list_del(reactor, conn);
+		pthread_mutex_unlock(&reactor->idle_lock);
+		close(clisk);
+		slab_free(reactor->conn_slab, conn);
+		return -1;
+	}
+
+	__atomic_add_fetch(&reactor->nconns, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/*
+ * The epoll event loop. The listening socket and all of the idle connections
+ * are multiplexed by this thread, only the connections which are ready to be
+ * read will be dispatched to the thread pool. After 'max_request' connections
+ * have been accepted, we stop listening and wait the remaining connections.
+ */
+static int reactor_run(struct acceptor *acc)
+{
+	int i, j, n, njobs;
+	int listening = 1;
+	struct reactor *reactor = &acc->reactor;
+	struct epoll_event ev = { 0 }, events[MAX_EVENTS];
+	struct job jobs[MAX_EVENTS];
+
+	if (set_nonblocking(acc->sk) == -1) {
+		perror("unable to set O_NONBLOCK flags on listen socket");
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;		/* NULL stands for the listen socket */
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, acc->sk, &ev) == -1) {
+		perror("epoll_ctl error when add the listen socket");
+		return -1;
 	}
 
-	/*
-	 * if the file of client requested is a not valid MIME type, terminate
-	 * this transfer.
-	 */
-	if (transfer_header(clisk, pathname, length) == -1)
-		goto out;
+	while (listening ||
+	       __atomic_load_n(&reactor->nconns, __ATOMIC_ACQUIRE) > 0) {
+		if (listening)
+			handoff_check();
+		if ((n = epoll_wait(reactor->epfd, events, MAX_EVENTS,
+				    REACTOR_TICK)) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return -1;
+		}
 
-	while ((nread = read(fd, buf, sizeof(buf))) > 0) {
-		if (nwrite(clisk, buf, nread) <= 0) {
-			fprintf(stderr, "nwrite error when transfer file.\n");
-			goto out;
+		for (i = 0, njobs = 0; i < n; i++) {
+			if (!events[i].data.ptr) {
+				/* drain the backlog, it's level-triggered. */
+				for (j = 0; j < ACCEPT_BATCH && listening &&
+					    !accepted_enough(); j++) {
+					if (reactor_accept(acc) <= 0)
+						break;
+					count_accepted();
+				}
+				continue;
+			}
+
+			/*
+			 * EPOLLONESHOT disabled the descriptor, nobody else
+			 * will touch it until the job finished.
+			 */
+			pthread_mutex_lock(&reactor->idle_lock);
+			idle_list_del(reactor, events[i].data.ptr);
+			pthread_mutex_unlock(&reactor->idle_lock);
+
+			jobs[njobs].jb_routine = process_connection;
+			jobs[njobs++].jb_arg = events[i].data.ptr;
+		}
+
+		/* all of the ready connections are queued at once. */
+		dispatch_batch(acc->pool, jobs, njobs);
+
+		if (listening && accepted_enough()) {
+			epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, acc->sk, NULL);
+			listening = 0;
 		}
+
+		reactor_expire(reactor);
 	}
 
 	return 0;
-out:
-	return -1;
 }
 
+/* user data of the requests of io_uring, the others are connections. */
+#define URING_ACCEPT	1
+#define URING_TICK	2
+#define URING_CANCEL	3
+
 /*
- * we allocate a new space enough to store the HTML header and the contents
- * which consists with entities in the directory. if success, the contents
- * will include the HTML header, and return 0. otherwise, -1 will returned,
- * and the nothing will be changed.
+ * Wait for the next request of the connection by a recv of the io_uring,
+ * the data goes straight into the buffer of connection. Same as
+ * reactor_rearm(), it's linked to the idle list first. The recv is only
+ * queued, the caller submits it.
  */
-static int add_html_header_to_contents(char **contents, size_t *contents_len,
-				       size_t *offset, char *pathname)
+static int uring_rearm(struct connection *conn)
 {
-	char *ptr = malloc(*contents_len + HTMLHEADER_BUFSZ);
-	if (!ptr) {
-		perror("allocate memory error when add html header"
-						"to the contents");
+	struct reactor *reactor = conn->reactor;
+
+	if (connection_reserve(conn) == -1) {
+		conn->keepalive = 0;
+		response_bad_request(conn);
 		return -1;
 	}
 
+	pthread_mutex_lock(&reactor->idle_lock);
+	idle_list_add(reactor, conn);
+	pthread_mutex_unlock(&reactor->idle_lock);
 
-	*offset = snprintf(ptr, *contents_len + HTMLHEADER_BUFSZ,
-			   HTTP_DIR_CONTENTS, pathname, pathname,
-			   *contents, SERV_VERSION);
-	if (*contents)
-		free(*contents);
-	
-	*contents = ptr;
-	*contents_len += HTMLHEADER_BUFSZ;
+	if (uring_recv(reactor->ring, conn->sk, conn->buf + conn->len,
+		       conn->size - conn->len, (unsigned long)conn) == -1) {
+		perror("io_uring error when re-arm the connection");
+		pthread_mutex_lock(&reactor->idle_lock);
+		idle_list_del(reactor, conn);
+		pthread_mutex_unlock(&reactor->idle_lock);
+		return -1;
+	}
 
 	return 0;
 }
 
-static int transfer_dir_contents(int clisk, char **contents,
-				 size_t *contents_len, size_t *offset,
-				 char *pathname)
+/*
+ * Job of the io_uring engine. The request has been received by the kernel,
+ * there is nothing to read here. the connection may be served by another
+ * thread as soon as it's re-armed, so it's not touched after that.
+ */
+static int process_uring_connection(void *arg)
 {
-	int ret = -1;
-	char date[DATE_BUFSZ];
-	char *buf = NULL;
-	size_t len;
+	struct connection *conn = arg;
+	struct uring *ring = conn->reactor->ring;
 
-	if (add_html_header_to_contents(contents, contents_len, offset,
-					pathname) == -1)
-		goto out;
-
-	if (!(buf = malloc(*contents_len + HEADER_BUFSZ))) {
-		perror("allocate memory error when transfer contents of "
-							"directory");
-		goto out;
-	}
-	
-	len = snprintf(buf, *contents_len + HEADER_BUFSZ,
-		       "%s 200 OK\r\n"
-		       "Server: %s\r\n"
-		       "Date: %s\r\n"
-		       "Content-Type: text/html; charset=utf-8\r\n"
-		       "Content-Length: %ld\r\n"
-		       "Connection: close\r\n\r\n"
-		       "%s", HTTP_VERSION, SERV_VERSION,
-		       get_current_date(date, sizeof(date)),
-		       *contents_len, *contents);
-
-	if (nwrite(clisk, buf, len) <= 0) {
-		perror("nwrite error when send contents of directory");
-		goto out;
+	stats_record(STATS_QUEUE, thread_pool_job_wait());
+	if (serve_pipeline(conn) == -1 || uring_rearm(conn) == -1) {
+		reactor_close(conn);
+		return 0;
 	}
 
-	ret = 0;
-out:
-	if (buf)
-		free(buf);
-	return ret;	
+	uring_submit(ring);
+	return 0;
 }
 
 /*
- * Notes: this functions will only add most 'contents_len' bytes to the buffer
- * 'contents'(including the terminating '0'). This will cause if the files
- * under the directory is too many, there may not be enough space to store it.
- *
- * Alternatively, We just pass a pointer as the 'contents', and the memory will
- * be allocated by itself, if no enough space there are, it will re-allocate it.
+ * A completion of the accept. return 1 if the accept is still pending, its
+ * last completion may not have come yet.
  */
-static int dir_contents_add(char **contents, size_t *contents_len,
-			    size_t *offset, char *pathname)
+static int uring_accepted(struct acceptor *acc, const struct uring_event *ev,
+			  int listening)
 {
-	char date_str[DATE_BUFSZ];
-	char filesize_str[FILESIZE_BUFSZ] = "";
-	char *filename = get_filename(pathname);
-	struct stat st;
-
-	if (!*contents) {
-		/* First time, we need to allocate a memory for us to use. */
-		if (!(*contents = malloc(CONTENTS_BUFSZ))) {
-			perror("allocate memory error when add entity "
-							"of directory");
-			goto out;
+	struct connection *conn;
+	struct reactor *reactor = &acc->reactor;
+
+	if (ev->res >= 0) {
+		if (accepted_all()) {
+			close(ev->res);	/* came before the cancel */
+		} else if ((conn = reactor_conn_new(reactor, ev->res))) {
+			__atomic_add_fetch(&reactor->nconns, 1,
+					   __ATOMIC_RELAXED);
+			count_accepted();
+			if (uring_rearm(conn) == -1)
+				reactor_close(conn);
 		}
-	
-		*contents_len = CONTENTS_BUFSZ;
+	} else if (ev->res == -EINVAL && reactor->ring->multishot) {
+		/* the kernel is older than 5.19, accept one at a time. */
+		reactor->ring->multishot = 0;
+	} else if (ev->res != -ECANCELED && ev->res != -ECONNABORTED &&
+		   ev->res != -EINTR) {
+		errno = -ev->res;
+		perror("io_uring accept");
 	}
 
+	if (ev->more)
+		return 1;
+	if (!listening || accepted_enough())
+		return 0;
+	if (uring_accept(reactor->ring, acc->sk, URING_ACCEPT) == -1) {
+		perror("io_uring error when accept");
+		return 0;
+	}
+	return 1;
+}
 
-	if ((*contents_len - *offset) <= ENTITY_BUFSZ) {
-		/* 
-		 * no enough space to store next HTML formatted file name
-		 * entity. use realloc() to extension the space.
-		 */
-		char *ptr = realloc(*contents, *contents_len + CONTENTS_BUFSZ);
-		if (!ptr) {
-			perror("re-allocate memory error when add entity "
-							"of directory");
-			goto out;
-		}
-
-		*contents = ptr;
-		*contents_len += CONTENTS_BUFSZ;
+/*
+ * Same as reactor_expire(), but the pending recv still holds the connection,
+ * so the socket is shut down instead. the recv completes with 0, and the
+ * connection is closed there.
+ */
+static void uring_expire(struct reactor *reactor)
+{
+	time_t now = time(NULL);
+	struct connection *conn;
+
+	pthread_mutex_lock(&reactor->idle_lock);
+	while ((conn = reactor->idle_head) && conn->expire <= now) {
+		idle_list_del(reactor, conn);
+		conn->expire = 0;		/* not in the idle list */
+		shutdown(conn->sk, SHUT_RDWR);
 	}
+	pthread_mutex_unlock(&reactor->idle_lock);
+}
 
+/*
+ * The reactor on io_uring. One multishot accept takes the connections of the
+ * listen socket, and each idle connection has a recv pending, so the request
+ * is in the buffer of connection when its job is dispatched. The requests
+ * queued by this thread and the completions of the batch go through a single
+ * io_uring_enter(), the pool threads enter only to submit the re-arms.
+ */
+static int uring_run(struct acceptor *acc)
+{
+	int i, n, njobs;
+	int listening = 1;
+	int accepting = 1;	/* the accept is pending */
+	struct connection *conn;
+	struct reactor *reactor = &acc->reactor;
+	struct uring *ring = reactor->ring;
+	struct uring_event events[MAX_EVENTS];
+	struct job jobs[MAX_EVENTS];
+
+	/* the kernel polls the nonblocking socket, rather than a worker. */
+	if (set_nonblocking(acc->sk) == -1) {
+		perror("unable to set O_NONBLOCK flags on listen socket");
+		return -1;
+	}
 
-	/* If couldn't stat the pathname, we also return 0. only allocate the
-	 * memory error was occur. -1 will be returned. */
-	if (stat(pathname, &st) == -1) {
-		perror("stat error when try add entity of directory.");
-		errno = 0;
-		return 0;
+	if (uring_accept(ring, acc->sk, URING_ACCEPT) == -1 ||
+	    uring_timeout(ring, REACTOR_TICK, URING_TICK) == -1) {
+		perror("io_uring error when start the reactor");
+		return -1;
 	}
 
-	if (S_ISREG(st.st_mode))
-		snprintf(filesize_str, sizeof(filesize_str),
-					"%ld bytes", st.st_size);
-	else if (S_ISDIR(st.st_mode))
-		strncat(filename, "/", PATHNAME_BUFSZ - strlen(pathname));
+	/*
+	 * the connections accepted before the cancel are still in the queue,
+	 * they are served rather than reset by our exit.
+	 */
+	while (listening || accepting ||
+	       __atomic_load_n(&reactor->nconns, __ATOMIC_ACQUIRE) > 0) {
+		if (listening)
+			handoff_check();
+		if ((n = uring_wait(ring, events, MAX_EVENTS)) == -1)
+			return -1;
 
-	get_date((time_t)st.st_mtime, date_str, sizeof(date_str));
-	*offset += snprintf(*contents + *offset, *contents_len - *offset,
-			    HTTP_DIR_ITEMS, filename, filename,
-			    date_str, filesize_str);
+		for (i = 0, njobs = 0; i < n; i++) {
+			switch (events[i].data) {
+			case URING_ACCEPT:
+				accepting = uring_accepted(acc, &events[i],
+							   listening);
+				continue;
+			case URING_TICK:
+				uring_expire(reactor);
+				if (uring_timeout(ring, REACTOR_TICK,
+						  URING_TICK) == -1)
+					perror("io_uring error when tick");
+				continue;
+			case URING_CANCEL:
+				continue;
+			}
+
+			conn = (struct connection *)(unsigned long)
+			       events[i].data;
+			pthread_mutex_lock(&reactor->idle_lock);
+			if (conn->expire)
+				idle_list_del(reactor, conn);
+			pthread_mutex_unlock(&reactor->idle_lock);
+
+			if (events[i].res <= 0) {
+				if (events[i].res < 0 &&
+				    events[i].res != -ECONNRESET) {
+					errno = -events[i].res;
+					perror("recv request from client");
+				}
+				reactor_close(conn);
+				continue;
+			}
+			conn->len += events[i].res;
+			jobs[njobs].jb_routine = process_uring_connection;
+			jobs[njobs++].jb_arg = conn;
+		}
+
+		/* all of the requests received are queued at once. */
+		dispatch_batch(acc->pool, jobs, njobs);
+
+		if (listening && accepted_enough()) {
+			if (uring_cancel(ring, URING_ACCEPT,
+					 URING_CANCEL) == -1)
+				perror("io_uring error when cancel accept");
+			listening = 0;
+		}
+	}
 
 	return 0;
-out:
-	return -1;
 }
 
 /*
- * When request directory haven't index.html, we travel the directory, and
- * return a html file which contains a file list of current directory.
+ * The thread-per-connection model. the accepted connection is handed to the
+ * pool, and a thread serves it until it's closed. the listen socket is
+ * nonblocking, all of the pending connections are taken from the backlog
+ * once it's readable, and dispatched together.
  */
-static int transfer_list(int clisk, char *pathname)
+static int accept_loop(struct acceptor *acc)
 {
-	int ret = -1;
-	size_t pathname_len = strlen(pathname);
-	char *ptr = pathname + pathname_len;
-	
-	char *contents = NULL;		/* must initial */
-	size_t contents_len = 0;
-	size_t offset = 0;		/* used record offset, more							   efficency */
-	DIR *dir = opendir(pathname);
-	struct dirent entry, *res;
-	
-
-	if (!dir) {
-		if (errno == EACCES)
-			response_forbidden(clisk);
-		else
-			perror("opendir error when transfer list of file");
+	int n, clisk;
+	struct job jobs[ACCEPT_BATCH];
+	struct pollfd pfd = { .fd = acc->sk, .events = POLLIN };
 
-		goto out;
+	if (set_nonblocking(acc->sk) == -1) {
+		perror("unable to set O_NONBLOCK flags on listen socket");
+		return -1;
 	}
-	
-	while (readdir_r(dir, &entry, &res) == 0 && res) {
-		strncpy(ptr, entry.d_name, PATHNAME_BUFSZ - pathname_len);
-	
-		/*
-		 * Add the file's name, modification time and size to a buffer
-		 * in form of HTML.
-		 */	
-		if (dir_contents_add(&contents, &contents_len, &offset,
-				     pathname) == -1 ) {
-			goto out;
+
+	while (!accepted_enough()) {
+		if (poll(&pfd, 1, REACTOR_TICK) == -1 && errno != EINTR)
+			perror("poll");
+		handoff_check();
+
+		for (n = 0; n < ACCEPT_BATCH && !accepted_enough(); n++) {
+			/* the accepted socket doesn't inherit O_NONBLOCK. */
+			if ((clisk = accept4(acc->sk, NULL, 0,
+					     SOCK_CLOEXEC)) == -1) {
+				if (errno != EAGAIN && errno != EINTR &&
+				    errno != ECONNABORTED && !accepted_enough())
+					perror("accept4");
+				break;
+			}
+
+			set_nodelay(clisk);
+			/* the descriptor is passed inline, nothing to allocate. */
+			jobs[n].jb_routine = process_request;
+			jobs[n].jb_arg = JOB_ARG_INT(clisk);
+			count_accepted();
 		}
-		*ptr = 0;
-	}
 
-	if (transfer_dir_contents(clisk, &contents, &contents_len,
-					 &offset, pathname) == -1)
-		goto out;
+		dispatch_batch(acc->pool, jobs, n);
+	}
 
-	ret = 0;
-out:
-	if (contents)
-		free(contents);
-	return ret;
+	return 0;
 }
 
-
-static int process_pathname_is_directory(int clisk, char *pathname)
+static int bind_thread_to_cpu(pthread_t thread, int cpu)
 {
-	char *index_file = pathname_find_file(pathname, "index.html");
-
-	if (index_file) {
-		if (transfer_file(clisk, index_file) == -1)
-			return -1;
-	}
-	
-	/*
-	 * not 'index.html', then return a file list of current dir.
-	 */
-	if (transfer_list(clisk, pathname) == -1)
+	int err;
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if ((err = pthread_setaffinity_np(thread, sizeof(set), &set))) {
+		fprintf(stderr, "unable to bind thread to cpu %d: %s\n",
+				cpu, strerror(err));
 		return -1;
-
+	}
 	return 0;
 }
 
-static int pathname_is_file(const char *pathname)
+/*
+ * Get the cpus this process allowed to run on, return the number of them.
+ */
+static int get_allowed_cpus(int *cpus)
 {
-	struct stat st;
-	
-	if (stat(pathname, &st) == -1)
-		return 0;
+	int i, n = 0;
+	cpu_set_t set;
 
-	if (S_ISREG(st.st_mode))
+	if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+		perror("sched_getaffinity");
+		cpus[0] = 0;
 		return 1;
+	}
 
-	return 0;
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (CPU_ISSET(i, &set))
+			cpus[n++] = i;
+	}
+	return n;
 }
 
-static int has_permission_to_read(const char *pathname)
+static void acceptor_fini(struct acceptor *acc)
 {
-	int fd;
-
-	if ((fd = open(pathname, O_RDONLY)) >= 0) {
-		close(fd);
-		return 1;
-	}
-
-	return 0;
+	/* the threads may still hold connections until they exit. */
+	if (acc->pool)
+		thread_pool_delete(acc->pool);
+	if (acc->reactor.conn_slab)
+		slab_delete(acc->reactor.conn_slab);
+	if (acc->reactor.epfd != -1)
+		close(acc->reactor.epfd);
+	uring_delete(acc->reactor.ring);
+	if (acc->sk != -1)
+		close(acc->sk);
 }
 
 /*
- * This function will be passing to the thread pool, used to process the request
- * from the client, it will be store into a work_t object with socket descriptor
- * associated with client. and finally will be called from a free thread.
+ * The job refused by the pool, it's full or the job waited too long. the
+ * client gets 503 with Retry-After, and the connection is closed.
  */
-static int process_request(void *arg)
+static void reject_job(job_routine routine, void *arg)
 {
-	int ret = -1;
-	int clisk = *((int *)arg);
-	char pathname[PATHNAME_BUFSZ];
-	char method[METHOD_BUFSZ];
-	char version[VERSION_BUFSZ];
-	char buf[BUFSZ];
-	size_t nread;
-
-	free(arg);
+	struct connection *conn = arg;
 
-	if ((nread = read(clisk, buf, sizeof(buf))) == -1) {
-		perror("read request from client");
-		goto out;
+	if (routine == process_request) {
+		response_unavailable(JOB_INT(arg));
+		close(JOB_INT(arg));
+		return;
 	}
 
-	if (parsing_request_header(buf, method, sizeof(method),
-				   pathname, sizeof(pathname),
-				   version, sizeof(version)) == -1) {
-		response_bad_request(clisk);
-		goto out;
-	}
+	/* it's neither in the idle list nor has a recv pending of io_uring. */
+	response_unavailable(conn->sk);
+	reactor_close(conn);
+}
 
+static int acceptor_init(struct acceptor *acc, int port, int pool_size)
+{
+	int i;
+	struct thread_pool_attr attr;
+
+	i = acc - server.acceptors;
+	if (i < server.inherited)
+		acc->sk = adopt_listen_sk(LISTEN_FDS_START + i, acc->cpu);
+	else
+		acc->sk = create_listen_sk(port, acc->cpu);
+	if (acc->sk == -1)
+		goto out;
 
-	if (strcmp(method, "GET")) {		/* no supported method */
-		response_not_supported(clisk);
+	thread_pool_attr_init(&attr, pool_size);
+	attr.queue = conf.queue;
+	attr.stack_size = conf.stack_size;
+	attr.max_queue = conf.max_queue;
+	attr.queue_timeout = conf.queue_timeout;
+	attr.reject = reject_job;
+	/* the group per core has bound its threads already. */
+	if (acc->cpu == -1) {
+		attr.placement = conf.placement;
+		attr.cpus = conf.cpus;
+		attr.ncpus = conf.ncpus;
+	}
+	if (conf.max_threads > pool_size)
+		attr.max_threads = conf.max_threads;
+	if (!(acc->pool = thread_pool_new_attr(&attr))) {
+		fprintf(stderr, "create the thread pool failure.\n");
 		goto out;
 	}
 
-#if defined(USE_URL_DECODING)
-	pathname_decoding(pathname);
-#endif
-
-	if (!pathname_is_exist(pathname)) {	/* pathname don't exist */
-		response_not_found(clisk);
-		goto out;
+	/*
+	 * keep the connections on the core which accepted them. the threads
+	 * spawned later by the controller inherit its affinity.
+	 */
+	if (acc->cpu != -1) {
+		for (i = 0; i < acc->pool->num_threads; i++)
+			bind_thread_to_cpu(acc->pool->threads[i], acc->cpu);
+		if (acc->pool->has_controller)
+			bind_thread_to_cpu(acc->pool->controller, acc->cpu);
 	}
-	
-	if (pathname_is_directory(pathname)) {
-		if (pathname[strlen(pathname) - 1] != '/') {
-			response_found(clisk, pathname);
+
+	if (conf.reactor) {
+		if ((acc->reactor.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+			perror("epoll_create1");
 			goto out;
 		}
-		
-		process_pathname_is_directory(clisk, pathname);
-		ret = 0;
-		goto out;
-	}
 
-	if (!pathname_is_file(pathname) || !has_permission_to_read(pathname)) {
-		response_forbidden(clisk);
-		goto out;
-	}
-	
-	if (transfer_file(clisk, pathname) == -1)
+		if (!(acc->reactor.conn_slab =
+		      slab_new(sizeof(struct connection))))
 			goto out;
 
+		if (conf.uring && !(acc->reactor.ring =
+		    uring_new(URING_ENTRIES, URING_CQ_ENTRIES)))
+			fprintf(stderr, "io_uring is not available (%s), "
+				"fall back to epoll.\n", strerror(errno));
+	}
 
+	return 0;
 out:
-	close(clisk);
-	return ret;
-		
+	return -1;
+}
+
+static void *acceptor_main(void *arg)
+{
+	struct acceptor *acc = arg;
+
+	if (acc->cpu != -1)
+		bind_thread_to_cpu(pthread_self(), acc->cpu);
+
+	if (!conf.reactor)
+		acc->ret = accept_loop(acc);
+	else if (acc->reactor.ring)
+		acc->ret = uring_run(acc);
+	else
+		acc->ret = reactor_run(acc);
+	return NULL;
 }
 
 static int server_launch(int port, int pool_size, int max_request)
 {
-	int sk = -1;
-	int *skptr;
-	int request_counter = 0;
-	struct thread_pool *pool;
+	int i, err;
+	int ret = -1;
+	int ncpus = 0;
+	int nacceptors;
+	int *cpus = NULL;
+	struct acceptor *acc;
+
+	server.max_request = max_request;
+	response_templates_init();
+	if (stats_init() == -1)
+		return -1;
+	if (conf.cache_ttl > 0 &&
+	    !(file_cache = file_cache_new(conf.cache_ttl, FILE_CACHE_ENTRIES,
+					  FILE_CACHE_FDS)))
+		goto out;
 
-	if ((sk = create_listen_sk(port)) == -1)
+	if (conf.hot_bytes > 0 &&
+	    !(hot_cache = hot_cache_new(conf.hot_bytes, HOT_OBJECT_MAX)))
 		goto out;
 
-	if (!(pool = thread_pool_new(pool_size))) {
-		fprintf(stderr, "create the thread pool failure.\n");
+	if (conf.gzip_bytes > 0 &&
+	    !(gzip_cache = hot_cache_new(conf.gzip_bytes, GZIP_SOURCE_MAX)))
 		goto out;
-	}
 
-	while (request_counter < max_request) {
-		if (!(skptr = malloc(sizeof(*skptr)))) {
-			perror("allocate memory to store the descriptor error");
-			continue;
-		}
+	/* without inotify, the listing is simply not cached. */
+	if (conf.dir_cache_dirs > 0)
+		dir_cache = dir_cache_new(conf.dir_cache_dirs, render_dir_row);
 
-		if ((*skptr = accept(sk, NULL, 0)) == -1) {
-			perror("accept");
-			continue;
+	/* one thread keeps the time for all of the connections. */
+	if ((conf.header_timeout > 0 || conf.send_timeout > 0 ||
+	     conf.transfer_timeout > 0) &&
+	    !(timers = timer_wheel_new(TIMER_TICK)))
+		goto out;
+
+	if (conf.nacceptors > 0) {
+		if (!(cpus = calloc(CPU_SETSIZE, sizeof(*cpus)))) {
+			perror("allocate memory for cpu list error");
+			goto out;
 		}
+		ncpus = get_allowed_cpus(cpus);
+	}
+
+	/*
+	 * counted only once allocated and initialized, the cleanup walks
+	 * them.
+	 */
+	nacceptors = conf.nacceptors > 0 ? conf.nacceptors : 1;
+	if (!(server.acceptors = calloc(nacceptors,
+					sizeof(*server.acceptors)))) {
+		perror("allocate memory for acceptors error");
+		goto out;
+	}
+	server.nacceptors = nacceptors;
+
+	for (i = 0; i < server.nacceptors; i++) {
+		acc = &server.acceptors[i];
+		acc->sk = -1;
+		acc->reactor.epfd = -1;
+		acc->cpu = ncpus ? cpus[i % ncpus] : -1;
+		pthread_mutex_init(&acc->reactor.idle_lock, NULL);
+	}
 
-		dispatch(pool, process_request, skptr);
-		request_counter++;
+	for (i = 0; i < server.nacceptors; i++) {
+		if (acceptor_init(&server.acceptors[i], port, pool_size) == -1)
+			goto out;
+	}
+	/* the old server had more groups, nobody would accept from them. */
+	for (i = server.nacceptors; i < server.inherited; i++)
+		close(LISTEN_FDS_START + i);
+	handoff_ready();
+
+	if (!conf.nacceptors) {
+		acceptor_main(&server.acceptors[0]);
+		ret = server.acceptors[0].ret;
+		goto out;
 	}
 
-	thread_pool_delete(pool);
+	for (i = 0; i < server.nacceptors; i++) {
+		acc = &server.acceptors[i];
+		if ((err = pthread_create(&acc->thread, NULL, acceptor_main,
+					  acc))) {
+			fprintf(stderr, "create acceptor thread error: %s\n",
+					strerror(err));
+			break;
+		}
+	}
+	/* stop the started ones, if we failed to start all of them. */
+	if (i < server.nacceptors)
+		server.max_request = 0;
 
-	return 0;
+	ret = 0;
+	while (--i >= 0) {
+		acc = &server.acceptors[i];
+		if (server.max_request == 0)
+			shutdown(acc->sk, SHUT_RD);
+		pthread_join(acc->thread, NULL);
+		if (acc->ret == -1)
+			ret = -1;
+	}
 out:
-	if (sk != -1)
-		close(sk);
-	return -1;
+	for (i = 0; i < server.nacceptors; i++)
+		acceptor_fini(&server.acceptors[i]);
+	free(server.acceptors);
+	free(cpus);
+	file_cache_delete(file_cache);
+	file_cache = NULL;
+	hot_cache_delete(hot_cache);
+	hot_cache = NULL;
+	hot_cache_delete(gzip_cache);
+	gzip_cache = NULL;
+	dir_cache_delete(dir_cache);
+	dir_cache = NULL;
+	timer_wheel_delete(timers);
+	timers = NULL;
+	return ret;
 }
 
 static int ignore_sigpipe(void)
@@ -898,20 +3663,220 @@ static int ignore_sigpipe(void)
 	return 0;
 }
 
-int main(int argc, char *argv[])
+static void upgrade_handler(int signo)
+{
+	__atomic_store_n(&server.upgrade, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * SIGUSR2 asks the server to hand its listen sockets to a new one. there is
+ * no SA_RESTART, so the accept loop interrupted notices it right away.
+ */
+static int handle_upgrade(void)
+{
+	struct sigaction act = { 0 };
+
+	act.sa_handler = upgrade_handler;
+	sigemptyset(&act.sa_mask);
+	if (sigaction(SIGUSR2, &act, NULL) == -1) {
+		perror("handle_upgrade");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse the cpu list like "0-3,8", into 'cpus'. return the number of them,
+ * -1 if it's malformed.
+ */
+static int parse_cpu_list(const char *s, int *cpus, int max)
+{
+	int a, b, n = 0;
+	char *end;
+
+	do {
+		if (!isdigit((unsigned char)*s))
+			return -1;
+		a = b = strtol(s, &end, 10);
+		if (*end == '-' && isdigit((unsigned char)end[1]))
+			b = strtol(end + 1, &end, 10);
+		if (b < a || b >= CPU_SETSIZE)
+			return -1;
+		while (a <= b && n < max)
+			cpus[n++] = a++;
+		s = end + 1;
+	} while (*end == ',');
+
+	return *end ? -1 : n;
+}
+
+static int count_allowed_cpus(void)
+{
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == -1)
+		return 1;
+	return CPU_COUNT(&set);
+}
+
+static void usage(void)
 {
+	fprintf(stderr, "Usage: server [options] <port> <pool-size> "
+		"<max-number-of-request>\n"
+		"  -e    serve connections with the epoll reactor\n"
+		"  -u    serve connections with the io_uring reactor, epoll "
+		"if the kernel\n"
+		"        doesn't support it\n"
+		"  -k n  max requests per keep-alive connection, 0 disable "
+		"keep-alive (default %d)\n"
+		"  -t n  close the idle connection after n seconds "
+		"(default %d)\n"
+		"  -H n  close the connection whose request header isn't "
+		"received in n\n"
+		"        seconds, 0 forever (default %d)\n"
+		"  -s n  close the connection whose response sent nothing for "
+		"n seconds, 0\n"
+		"        forever (default %d)\n"
+		"  -T n  close the connection whose response took more than n "
+		"seconds, 0\n"
+		"        forever (default 0)\n"
+		"  -q list|ring|steal  job queue of the thread pool "
+		"(default list)\n"
+		"  -P n  grow the pool up to n threads when the jobs queue "
+		"up\n"
+		"  -S n  stack of the pool threads in KB\n"
+		"  -Q n  queue at most n jobs in a pool, refuse the others "
+		"with 503\n"
+		"  -W n  refuse the job which waited in the queue longer than "
+		"n ms with 503\n"
+		"  -c n  n SO_REUSEPORT listeners, each with its own accept "
+		"thread and pool\n"
+		"        bound to one core, 0 for all cores\n"
+		"  -A compact|scatter|<cpu list>  pin each pool thread to a "
+		"cpu, the stack and\n"
+		"        queues on its NUMA node\n"
+		"  -m n  cache the metadata of files for n seconds, 0 disable "
+		"(default %d)\n"
+		"  -C n  keep the small files in n MB of memory, 0 disable "
+		"(default %d)\n"
+		"  -L n  cache the listing of n directories, 0 disable "
+		"(default %d)\n"
+		"  -z n  keep the gzip compressed text files in n MB of "
+		"memory, 0 disable\n"
+		"        (default %d)\n"
+		"SIGUSR2 starts the new server by the same command line, "
+		"hands it the listen\n"
+		"sockets, and drains this one.\n",
+		KEEPALIVE_MAX, KEEPALIVE_TIMEOUT, HEADER_TIMEOUT, SEND_TIMEOUT,
+		FILE_CACHE_TTL,
+		HOT_CACHE_BYTES >> 20, DIR_CACHE_DIRS, GZIP_CACHE_BYTES >> 20);
+	exit(EXIT_FAILURE);
+}
 
-	if (argc != 4) {
-		fprintf(stderr, "Usage: server <port> <pool-size> "
-			"<max-number-of-request>\n");
-		exit(EXIT_FAILURE);
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	server_argv = argv;
+	while ((opt = getopt(argc, argv, "A:C:c:eH:k:L:m:P:Q:q:S:s:T:t:uW:z:")) != -1) {
+		switch (opt) {
+		case 'A':
+			if (!strcmp(optarg, "compact")) {
+				conf.placement = TP_PLACE_COMPACT;
+			} else if (!strcmp(optarg, "scatter")) {
+				conf.placement = TP_PLACE_SCATTER;
+			} else {
+				conf.placement = TP_PLACE_CPUS;
+				if (!(conf.cpus = calloc(CPU_SETSIZE,
+							 sizeof(int))) ||
+				    (conf.ncpus = parse_cpu_list(optarg,
+						conf.cpus, CPU_SETSIZE)) <= 0)
+					usage();
+			}
+			break;
+		case 'C':
+			conf.hot_bytes = atoi(optarg) > 0 ?
+					 (size_t)atoi(optarg) << 20 : 0;
+			break;
+		case 'c':
+			if ((conf.nacceptors = atoi(optarg)) <= 0)
+				conf.nacceptors = count_allowed_cpus();
+			break;
+		case 'e':
+			conf.reactor = 1;
+			break;
+		case 'H':
+			conf.header_timeout = atoi(optarg);
+			break;
+		case 'k':
+			conf.keepalive_max = atoi(optarg);
+			break;
+		case 'L':
+			conf.dir_cache_dirs = atoi(optarg);
+			break;
+		case 'm':
+			conf.cache_ttl = atoi(optarg);
+			break;
+		case 'P':
+			conf.max_threads = atoi(optarg);
+			break;
+		case 'Q':
+			conf.max_queue = atoi(optarg);
+			break;
+		case 'S':
+			conf.stack_size = atoi(optarg) > 0 ?
+					  (size_t)atoi(optarg) << 10 : 0;
+			break;
+		case 's':
+			conf.send_timeout = atoi(optarg);
+			break;
+		case 'T':
+			conf.transfer_timeout = atoi(optarg);
+			break;
+		case 't':
+			conf.keepalive_timeout = atoi(optarg);
+			break;
+		case 'u':
+			conf.reactor = 1;
+			conf.uring = 1;
+			break;
+		case 'q':
+			if (!strcmp(optarg, "ring"))
+				conf.queue = TP_QUEUE_RING;
+			else if (!strcmp(optarg, "steal"))
+				conf.queue = TP_QUEUE_STEAL;
+			else if (!strcmp(optarg, "list"))
+				conf.queue = TP_QUEUE_LIST;
+			else
+				usage();
+			break;
+		case 'W':
+			conf.queue_timeout = atoi(optarg);
+			break;
+		case 'z':
+			conf.gzip_bytes = atoi(optarg) > 0 ?
+					  (size_t)atoi(optarg) << 20 : 0;
+			break;
+		default:
+			usage();
+		}
 	}
 
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (argc != 4 || conf.keepalive_timeout < 1 || conf.header_timeout < 0 ||
+	    conf.send_timeout < 0 || conf.transfer_timeout < 0)
+		usage();
+
 	/* Ignore the SIGPIPE, it will cause server terminate unexpectedly, when
 	 * you write the data to client somtimes. */
-	if (ignore_sigpipe() == -1)
+	if (ignore_sigpipe() == -1 || handle_upgrade() == -1)
 		return -1;
 
+	server.inherited = inherited_listen_fds();
+	server.ready_fd = inherited_ready_fd();
+
 	if (server_launch(atoi(argv[1]), atoi(argv[2]), atoi(argv[3])) == -1)
 		return -1;
 
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "slab.h"
+
+/* every object is aligned to this size */
+#define SLAB_ALIGN	16
+
+/* the memory allocated by slab_grow(), followed by SLAB_CHUNK_OBJS objects. */
+struct slab_chunk {
+	struct slab_chunk *next;
+	char pad[SLAB_ALIGN - sizeof(struct slab_chunk *)];
+};
+
+/*
+ * Called when the thread exits. The cache can't be freed, since some of its
+ * objects may be still in use by the other threads. mark it orphan, and the
+ * next thread without a cache will adopt it.
+ */
+static void slab_cache_release(void *arg)
+{
+	struct slab_cache *cache = arg;
+
+	__atomic_store_n(&cache->orphan, 1, __ATOMIC_RELEASE);
+}
+
+static struct slab_cache *slab_cache_get(struct slab *slab)
+{
+	int err;
+	struct slab_cache *cache;
+
+	if ((err = pthread_mutex_lock(&slab->lock)))
+		perror("pthread_mutex_lock error in slab_cache_get");
+
+	for (cache = slab->caches; cache; cache = cache->next) {
+		if (__atomic_load_n(&cache->orphan, __ATOMIC_ACQUIRE)) {
+			cache->orphan = 0;
+			break;
+		}
+	}
+
+	if (!cache) {
+		if (!(cache = calloc(1, sizeof(*cache)))) {
+			perror("allocate memory for slab cache error");
+			goto out;
+		}
+		cache->next = slab->caches;
+		slab->caches = cache;
+	}
+
+	if ((err = pthread_setspecific(slab->key, cache)))
+		perror("pthread_setspecific error in slab_cache_get");
+out:
+	if ((err = pthread_mutex_unlock(&slab->lock)))
+		perror("pthread_mutex_unlock error in slab_cache_get");
+	return cache;
+}
+
+/*
+ * Carve a new chunk of objects into the local free list of 'cache'.
+ */
+static int slab_grow(struct slab *slab, struct slab_cache *cache)
+{
+	int i, err;
+	struct slab_obj *obj;
+	struct slab_chunk *chunk = malloc(sizeof(*chunk) +
+					  slab->objsize * SLAB_CHUNK_OBJS);
+
+	if (!chunk) {
+		perror("allocate memory for slab chunk error");
+		return -1;
+	}
+
+	for (i = 0; i < SLAB_CHUNK_OBJS; i++) {
+		obj = (struct slab_obj *)((char *)(chunk + 1) +
+					  slab->objsize * i);
+		obj->owner = cache;
+		obj->next = cache->free;
+		cache->free = obj;
+	}
+
+	if ((err = pthread_mutex_lock(&slab->lock)))
+		perror("pthread_mutex_lock error in slab_grow");
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+	if ((err = pthread_mutex_unlock(&slab->lock)))
+		perror("pthread_mutex_unlock error in slab_grow");
+
+	return 0;
+}
+
+void *slab_alloc(struct slab *slab)
+{
+	struct slab_obj *obj;
+	struct slab_cache *cache = pthread_getspecific(slab->key);
+
+	if (!cache && !(cache = slab_cache_get(slab)))
+		return NULL;
+
+	/* take back all of the objects freed by the other threads. */
+	if (!cache->free)
+		cache->free = __atomic_exchange_n(&cache->remote, NULL,
+						  __ATOMIC_ACQUIRE);
+
+	if (!cache->free && slab_grow(slab, cache) == -1)
+		return NULL;
+
+	obj = cache->free;
+	cache->free = obj->next;
+	return obj + 1;
+}
+
+void slab_free(struct slab *slab, void *ptr)
+{
+	struct slab_obj *head, *obj;
+	struct slab_cache *cache;
+
+	if (!ptr)
+		return;
+
+	obj = (struct slab_obj *)ptr - 1;
+	cache = obj->owner;
+
+	if (cache == pthread_getspecific(slab->key)) {
+		obj->next = cache->free;
+		cache->free = obj;
+		return;
+	}
+
+	/*
+	 * only the owner takes the list away, and it takes the whole list by
+	 * exchange, so the push can't suffer the ABA problem.
+	 */
+	head = __atomic_load_n(&cache->remote, __ATOMIC_RELAXED);
+	do {
+		obj->next = head;
+	} while (!__atomic_compare_exchange_n(&cache->remote, &head, obj, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+struct slab *slab_new(size_t size)
+{
+	int err;
+	struct slab *slab = calloc(1, sizeof(*slab));
+
+	if (!slab) {
+		perror("allocate memory for slab error");
+		return NULL;
+	}
+
+	slab->objsize = (sizeof(struct slab_obj) + size + SLAB_ALIGN - 1) &
+			~((size_t)SLAB_ALIGN - 1);
+
+	if ((err = pthread_key_create(&slab->key, slab_cache_release))) {
+		fprintf(stderr, "pthread_key_create error in slab_new\n");
+		free(slab);
+		return NULL;
+	}
+
+	if ((err = pthread_mutex_init(&slab->lock, NULL))) {
+		pthread_key_delete(slab->key);
+		free(slab);
+		return NULL;
+	}
+
+	return slab;
+}
+
+/*
+ * Free all of the memory of the slab. All of the objects must have been
+ * returned, and no other thread is using it.
+ */
+void slab_delete(struct slab *slab)
+{
+	struct slab_chunk *chunk;
+	struct slab_cache *cache;
+
+	if (!slab)
+		return;
+
+	pthread_key_delete(slab->key);
+	while ((chunk = slab->chunks)) {
+		slab->chunks = chunk->next;
+		free(chunk);
+	}
+	while ((cache = slab->caches)) {
+		slab->caches = cache->next;
+		free(cache);
+	}
+	pthread_mutex_destroy(&slab->lock);
+	free(slab);
+}
@@ -0,0 +1,40 @@
+#include <pthread.h>
+#include <stddef.h>
+
+/* objects carved from malloc() at once, when a cache runs out */
+#define SLAB_CHUNK_OBJS	64
+
+/*
+ * Every object is preceded by this header. 'owner' is the cache which carved
+ * the object, the object always goes back to it when freed.
+ */
+struct slab_obj {
+	struct slab_cache *owner;
+	struct slab_obj *next;		/* link in the free lists */
+};
+
+/*
+ * The per-thread cache. 'free' is touched only by the thread owns the cache,
+ * the other threads return the objects to 'remote' by a lock-free push, and
+ * the owner takes the whole list back at once when 'free' is empty.
+ */
+struct slab_cache {
+	struct slab_obj *free;		/* local free list */
+	struct slab_obj *remote;	/* freed by the other threads */
+	int orphan;			/* 1 if the owner thread has exited */
+	struct slab_cache *next;	/* all of the caches of the slab */
+};
+
+struct slab {
+	size_t objsize;			/* size of object including header */
+	pthread_key_t key;		/* cache of the current thread */
+	pthread_mutex_t lock;		/* lock on 'caches' and 'chunks' */
+	struct slab_cache *caches;
+	void *chunks;			/* memory allocated by malloc() */
+};
+
+
+struct slab *slab_new(size_t size);
+void *slab_alloc(struct slab *slab);
+void slab_free(struct slab *slab, void *ptr);
+void slab_delete(struct slab *slab);
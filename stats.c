@@ -0,0 +1,346 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+
+#define SUB_BUCKETS	(1 << STATS_SUB_BITS)
+
+static const char *stage_names[STATS_STAGES] = {
+	"queue", "parse", "meta", "header", "body", "total",
+};
+
+/* the counters of all threads ever seen, they are never freed. */
+static struct stats_thread *threads;
+static pthread_key_t thread_key;
+static __thread struct stats_thread *self;
+static time_t started;
+
+/* the thread exited, its counters are free for the next new thread. */
+static void stats_thread_release(void *arg)
+{
+	struct stats_thread *t = arg;
+
+	t->begin = 0;
+	__atomic_store_n(&t->in_use, 0, __ATOMIC_RELEASE);
+}
+
+int stats_init(void)
+{
+	int err;
+
+	if ((err = pthread_key_create(&thread_key, stats_thread_release))) {
+		fprintf(stderr, "pthread_key_create: %s\n", strerror(err));
+		return -1;
+	}
+	started = time(NULL);
+	return 0;
+}
+
+static struct stats_thread *stats_thread_get(void)
+{
+	int unused;
+	struct stats_thread *t;
+
+	if (self)
+		return self;
+
+	for (t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+		unused = 0;
+		if (__atomic_compare_exchange_n(&t->in_use, &unused, 1, 0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			goto out;
+	}
+
+	if (!(t = calloc(1, sizeof(*t))))
+		return NULL;
+	t->in_use = 1;
+	t->next = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&threads, &t->next, t, 1,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+out:
+	pthread_setspecific(thread_key, t);
+	self = t;
+	return t;
+}
+
+/* only the owner adds, the readers may see the value a bit late. */
+static inline void counter_add(unsigned long *p, unsigned long n)
+{
+	__atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+static int bucket_of(unsigned long v)
+{
+	int msb, shift;
+
+	if (v < SUB_BUCKETS)
+		return v;
+	msb = 63 - __builtin_clzl(v);
+	if (msb >= STATS_MAX_BITS)
+		return STATS_BUCKETS - 1;
+	shift = msb - STATS_SUB_BITS;
+	return ((shift + 1) << STATS_SUB_BITS) +
+	       ((v >> shift) & (SUB_BUCKETS - 1));
+}
+
+/* the lowest value falls in bucket 'i'. */
+static unsigned long bucket_value(int i)
+{
+	int b = i >> STATS_SUB_BITS;
+	unsigned long s = i & (SUB_BUCKETS - 1);
+
+	if (b == 0)
+		return s;
+	return (SUB_BUCKETS + s) << (b - 1);
+}
+
+unsigned long stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void stats_record(int stage, unsigned long ns)
+{
+	struct stats_thread *t = stats_thread_get();
+
+	if (!t)
+		return;
+	counter_add(&t->hist[stage][bucket_of(ns)], 1);
+	counter_add(&t->sum[stage], ns);
+	if (ns > t->max[stage])
+		__atomic_store_n(&t->max[stage], ns, __ATOMIC_RELAXED);
+}
+
+/*
+ * The stage clock of the thread: a request begins, and each stage ends at a
+ * mark, it lasts from the previous mark.
+ */
+void stats_begin(void)
+{
+	struct stats_thread *t = stats_thread_get();
+
+	if (!t)
+		return;
+	t->begin = t->mark = stats_now();
+	t->once = 0;
+}
+
+void stats_mark(int stage)
+{
+	unsigned long now;
+	struct stats_thread *t = self;
+
+	if (!t || !t->begin)
+		return;
+	now = stats_now();
+	stats_record(stage, now - t->mark);
+	t->mark = now;
+}
+
+/* same as stats_mark(), but only the first one of a request counts. */
+void stats_mark_once(int stage)
+{
+	struct stats_thread *t = self;
+
+	if (!t || !t->begin || (t->once & (1U << stage)))
+		return;
+	t->once |= 1U << stage;
+	stats_mark(stage);
+}
+
+void stats_end(void)
+{
+	struct stats_thread *t = self;
+
+	if (!t || !t->begin)
+		return;
+	stats_record(STATS_TOTAL, stats_now() - t->begin);
+	t->begin = 0;
+}
+
+void stats_status(int code)
+{
+	struct stats_thread *t = stats_thread_get();
+
+	if (t && code >= 0 && code < STATS_CODES)
+		counter_add(&t->codes[code], 1);
+}
+
+void stats_sent(size_t bytes)
+{
+	struct stats_thread *t = stats_thread_get();
+
+	if (t)
+		counter_add(&t->bytes, bytes);
+}
+
+static void stats_value(FILE *fp, int format, const char *type,
+			const char *name, const char *help, long value)
+{
+	if (format == STATS_PROMETHEUS)
+		fprintf(fp, "# HELP httpserver_%s %s\n"
+			    "# TYPE httpserver_%s %s\n"
+			    "httpserver_%s %ld\n", name, help, name, type, name,
+			value);
+	else
+		fprintf(fp, "%s: %ld\n", name, value);
+}
+
+void stats_gauge(FILE *fp, int format, const char *name, const char *help,
+		 long value)
+{
+	stats_value(fp, format, "gauge", name, help, value);
+}
+
+void stats_counter(FILE *fp, int format, const char *name, const char *help,
+		   long value)
+{
+	stats_value(fp, format, "counter", name, help, value);
+}
+
+/*
+ * The highest value of the bucket where the 'q' quantile falls, so the
+ * percentile is never under reported. 'max' is exact.
+ */
+static unsigned long quantile(const unsigned long *hist, unsigned long count,
+			      unsigned long max, double q)
+{
+	int i;
+	unsigned long seen = 0, rank = q * count + 0.5;
+
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < STATS_BUCKETS - 1; i++) {
+		if ((seen += hist[i]) >= rank)
+			break;
+	}
+	if (i == STATS_BUCKETS - 1 || bucket_value(i + 1) - 1 > max)
+		return max;
+	return bucket_value(i + 1) - 1;
+}
+
+struct stats_sum {
+	unsigned long hist[STATS_STAGES][STATS_BUCKETS];
+	unsigned long count[STATS_STAGES];
+	unsigned long sum[STATS_STAGES];
+	unsigned long max[STATS_STAGES];
+	unsigned long codes[STATS_CODES];
+	unsigned long bytes;
+};
+
+static void stats_sum_up(struct stats_sum *s)
+{
+	int i, j;
+	unsigned long v;
+	struct stats_thread *t;
+
+	for (t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+		for (i = 0; i < STATS_STAGES; i++) {
+			for (j = 0; j < STATS_BUCKETS; j++) {
+				v = __atomic_load_n(&t->hist[i][j],
+						    __ATOMIC_RELAXED);
+				s->hist[i][j] += v;
+				s->count[i] += v;
+			}
+			s->sum[i] += __atomic_load_n(&t->sum[i],
+						     __ATOMIC_RELAXED);
+			v = __atomic_load_n(&t->max[i], __ATOMIC_RELAXED);
+			if (v > s->max[i])
+				s->max[i] = v;
+		}
+		for (i = 0; i < STATS_CODES; i++)
+			s->codes[i] += __atomic_load_n(&t->codes[i],
+						       __ATOMIC_RELAXED);
+		s->bytes += __atomic_load_n(&t->bytes, __ATOMIC_RELAXED);
+	}
+}
+
+static void write_text(FILE *fp, const struct stats_sum *s)
+{
+	int i, j;
+	static const double q[] = { 0.5, 0.9, 0.99, 0.999 };
+
+	fprintf(fp, "uptime: %ld\nrequests: %lu\nbytes sent: %lu\n",
+		(long)(time(NULL) - started), s->count[STATS_TOTAL], s->bytes);
+	for (i = 0; i < STATS_CODES; i++) {
+		if (s->codes[i])
+			fprintf(fp, "status %d: %lu\n", i, s->codes[i]);
+	}
+
+	fprintf(fp, "\n%-8s %10s %10s %10s %10s %10s %10s %10s (us)\n",
+		"stage", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+	for (i = 0; i < STATS_STAGES; i++) {
+		fprintf(fp, "%-8s %10lu %10.1f", stage_names[i], s->count[i],
+			s->count[i] ? s->sum[i] / 1e3 / s->count[i] : 0.0);
+		for (j = 0; j < 4; j++)
+			fprintf(fp, " %10.1f", s->count[i] ?
+				quantile(s->hist[i], s->count[i], s->max[i],
+					 q[j]) / 1e3 : 0.0);
+		fprintf(fp, " %10.1f\n", s->max[i] / 1e3);
+	}
+}
+
+static void write_prometheus(FILE *fp, const struct stats_sum *s)
+{
+	int i, j;
+	static const double q[] = { 0.5, 0.9, 0.99, 0.999 };
+
+	fprintf(fp, "# HELP httpserver_responses_total Responses sent, by "
+		    "status code.\n"
+		    "# TYPE httpserver_responses_total counter\n");
+	for (i = 0; i < STATS_CODES; i++) {
+		if (s->codes[i])
+			fprintf(fp, "httpserver_responses_total{code=\"%d\"} "
+				    "%lu\n", i, s->codes[i]);
+	}
+
+	fprintf(fp, "# HELP httpserver_sent_bytes_total Bytes sent to the "
+		    "clients.\n"
+		    "# TYPE httpserver_sent_bytes_total counter\n"
+		    "httpserver_sent_bytes_total %lu\n", s->bytes);
+
+	fprintf(fp, "# HELP httpserver_stage_seconds Latency of the stages "
+		    "of a request.\n"
+		    "# TYPE httpserver_stage_seconds summary\n");
+	for (i = 0; i < STATS_STAGES; i++) {
+		for (j = 0; s->count[i] && j < 4; j++)
+			fprintf(fp, "httpserver_stage_seconds{stage=\"%s\","
+				    "quantile=\"%g\"} %.9f\n", stage_names[i],
+				q[j], quantile(s->hist[i], s->count[i],
+					       s->max[i], q[j]) / 1e9);
+		fprintf(fp, "httpserver_stage_seconds_sum{stage=\"%s\"} %.9f\n"
+			    "httpserver_stage_seconds_count{stage=\"%s\"} "
+			    "%lu\n", stage_names[i], s->sum[i] / 1e9,
+			stage_names[i], s->count[i]);
+	}
+}
+
+/*
+ * Write the counters of all threads, summed up, in 'format'. the threads
+ * keep counting meanwhile, so the numbers are not a exact snapshot.
+ */
+void stats_write(FILE *fp, int format)
+{
+	struct stats_sum *s;
+
+	/* too large for the small stacks of the pool threads. */
+	if (!(s = calloc(1, sizeof(*s)))) {
+		perror("allocate memory for stats");
+		return;
+	}
+
+	stats_sum_up(s);
+	if (format == STATS_PROMETHEUS)
+		write_prometheus(fp, s);
+	else
+		write_text(fp, s);
+	free(s);
+}
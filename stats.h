@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stddef.h>
+
+/* stages of a request, each of them has a latency histogram */
+enum {
+	STATS_QUEUE,	/* the job waited in the queue of pool */
+	STATS_PARSE,	/* parsing the request header */
+	STATS_META,	/* looking up the metadata of the pathname */
+	STATS_HEADER,	/* then until the first write of response is done */
+	STATS_BODY,	/* then until the response is done */
+	STATS_TOTAL,	/* the response, META to BODY */
+	STATS_STAGES
+};
+
+/*
+ * The histograms are log-linear (HDR style): each power of 2 is split into
+ * 2^STATS_SUB_BITS buckets, so a value is kept within 1/16 (6%). the values
+ * are ns, up to 2^STATS_MAX_BITS (18 minutes).
+ */
+#define STATS_SUB_BITS	4
+#define STATS_MAX_BITS	40
+#define STATS_BUCKETS	((STATS_MAX_BITS - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+#define STATS_CODES	600	/* status codes counted, below it */
+
+/* output format of stats_write() */
+#define STATS_TEXT		0
+#define STATS_PROMETHEUS	1
+
+/*
+ * The counters of one thread. only the owner writes them, the reader sums
+ * all of the threads without any lock. the counters of a exited thread are
+ * taken over by the next new thread, nothing is lost.
+ */
+struct stats_thread {
+	unsigned long hist[STATS_STAGES][STATS_BUCKETS];
+	unsigned long sum[STATS_STAGES];	/* ns */
+	unsigned long max[STATS_STAGES];
+	unsigned long codes[STATS_CODES];
+	unsigned long bytes;		/* sent to the clients */
+	unsigned long begin;		/* when the request began, 0 if none */
+	unsigned long mark;		/* when the last stage ended */
+	unsigned int once;		/* stages done by stats_mark_once() */
+	int in_use;
+	struct stats_thread *next;
+};
+
+int stats_init(void);
+unsigned long stats_now(void);
+void stats_record(int stage, unsigned long ns);
+void stats_begin(void);
+void stats_mark(int stage);
+void stats_mark_once(int stage);
+void stats_end(void);
+void stats_status(int code);
+void stats_sent(size_t bytes);
+void stats_gauge(FILE *fp, int format, const char *name, const char *help,
+		 long value);
+void stats_counter(FILE *fp, int format, const char *name, const char *help,
+		   long value);
+void stats_write(FILE *fp, int format);
@@ -1,14 +1,665 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "thread_pool.h"
+#include "slab.h"
+#include "placement.h"
 
-static void *do_the_job(void *arg)
+/* times a idle thread polls the ring before it parks on the futex. */
+#define SPIN_COUNT	1024
+
+/* ms between two checks of the controller of a elastic pool */
+#define ADJUST_INTERVAL	20
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()	__builtin_ia32_pause()
+#else
+#define cpu_relax()	sched_yield()
+#endif
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int futex_wait(int *addr, int val, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout,
+		       NULL, 0);
+}
+
+static void futex_wake(int *addr, int num)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, num, NULL, NULL, 0);
+}
+
+/*
+ * The cells of a ring or deque, on 'node' if the threads are placed, -1 for
+ * anywhere.
+ */
+static struct ring_cell *cells_alloc(int size, int node)
+{
+	if (node < 0)
+		return calloc(size, sizeof(struct ring_cell));
+	return node_alloc(size * sizeof(struct ring_cell), node);
+}
+
+static void cells_free(struct ring_cell *cells, int size, int node)
+{
+	if (node < 0)
+		free(cells);
+	else
+		node_free(cells, size * sizeof(struct ring_cell));
+}
+
+static int ring_init(struct job_ring *ring, int size, int node)
+{
+	int i;
+
+	if (size < 2 || (size & (size - 1))) {
+		fprintf(stderr, "invalid ring size: %d (power of 2)\n", size);
+		return -1;
+	}
+
+	if (!(ring->cells = cells_alloc(size, node))) {
+		perror("allocate memory for job ring error");
+		return -1;
+	}
+
+	for (i = 0; i < size; i++)
+		ring->cells[i].seq = i;
+	ring->mask = size - 1;
+
+	/* spinning only steals the cpu from the producer on a uniprocessor. */
+	ring->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_COUNT : 1;
+	return 0;
+}
+
+/*
+ * Put a job to the ring, 'seq' of 'job' is not used. return 0 on success, -1
+ * if the ring is full.
+ */
+static int ring_push(struct job_ring *ring, const struct ring_cell *job)
+{
+	struct ring_cell *cell;
+	unsigned long seq;
+	unsigned long pos = __atomic_load_n(&ring->enqueue_pos,
+					    __ATOMIC_RELAXED);
+	long diff;
+
+	while (1) {
+		cell = &ring->cells[pos & ring->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)pos;
+
+		if (diff == 0) {
+			/* the slot is free, try to claim it. */
+			if (__atomic_compare_exchange_n(&ring->enqueue_pos,
+							&pos, pos + 1, 1,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&ring->enqueue_pos,
+					      __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->routine = job->routine;
+	cell->arg = job->arg;
+	cell->stamp = job->stamp;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Take a job from the ring. return 0 on success, -1 if the ring is empty.
+ */
+static int ring_pop(struct job_ring *ring, struct ring_cell *job)
+{
+	struct ring_cell *cell;
+	unsigned long seq;
+	unsigned long pos = __atomic_load_n(&ring->dequeue_pos,
+					    __ATOMIC_RELAXED);
+	long diff;
+
+	while (1) {
+		cell = &ring->cells[pos & ring->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)(pos + 1);
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring->dequeue_pos,
+							&pos, pos + 1, 1,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&ring->dequeue_pos,
+					      __ATOMIC_RELAXED);
+		}
+	}
+
+	job->routine = cell->routine;
+	job->arg = cell->arg;
+	job->stamp = cell->stamp;
+	/* the slot is free for the producer of next round. */
+	__atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * How long a idle thread sleeps before it thinks about retiring, NULL if the
+ * pool is not elastic.
+ */
+static struct timespec *idle_timeout(struct thread_pool *pool,
+				     struct timespec *ts)
+{
+	if (__atomic_load_n(&pool->min_threads, __ATOMIC_RELAXED) ==
+	    __atomic_load_n(&pool->max_threads, __ATOMIC_RELAXED))
+		return NULL;
+
+	ts->tv_sec = pool->idle_timeout / 1000;
+	ts->tv_nsec = pool->idle_timeout % 1000 * 1000000L;
+	return ts;
+}
+
+/*
+ * Called by a thread which found no job. it retires if the pool has more
+ * threads than max_threads, or it has been idle for idle_timeout and there
+ * are more than min_threads. return 1 if the thread should exit.
+ */
+static int worker_retire(struct worker *w, int idle)
+{
+	int retire;
+	struct thread_pool *pool = w->pool;
+
+	if (!idle && __atomic_load_n(&pool->num_threads, __ATOMIC_RELAXED) <=
+		     __atomic_load_n(&pool->max_threads, __ATOMIC_RELAXED))
+		return 0;
+
+	pthread_mutex_lock(&pool->resize_lock);
+	retire = pool->num_threads > pool->max_threads ||
+		 (idle && pool->num_threads > pool->min_threads);
+	if (retire) {
+		__atomic_sub_fetch(&pool->num_threads, 1, __ATOMIC_RELAXED);
+		w->state = WORKER_EXITING;
+	}
+	pthread_mutex_unlock(&pool->resize_lock);
+	return retire;
+}
+
+/* ns the job being run by the calling thread waited in the queue. */
+static __thread unsigned long job_wait;
+
+unsigned long thread_pool_job_wait(void)
+{
+	return job_wait;
+}
+
+/* called when a job has been taken, before it's run. */
+static void job_start(struct worker *w, unsigned long stamp)
+{
+	job_wait = now_ns() - stamp;
+	__atomic_store_n(&w->ntaken, w->ntaken + 1, __ATOMIC_RELAXED);
+}
+
+static void job_reject(struct thread_pool *pool, job_routine routine,
+		       void *arg)
+{
+	__atomic_add_fetch(&pool->rejected, 1, __ATOMIC_RELAXED);
+	if (pool->reject)
+		pool->reject(routine, arg);
+}
+
+/*
+ * Run the job just taken from the queue. the one waited beyond the deadline
+ * is refused, its client has probably given up, and the time is better
+ * spent on the fresh ones.
+ */
+static void job_run(struct worker *w, job_routine routine, void *arg,
+		    unsigned long stamp)
+{
+	job_start(w, stamp);
+	if (w->pool->queue_timeout && job_wait > w->pool->queue_timeout)
+		job_reject(w->pool, routine, arg);
+	else
+		routine(arg);
+}
+
+/*
+ * Take 'n' places in the queue of the lock-free backends. return how many
+ * of them are admitted, the rest have to be refused.
+ */
+static int queue_admit(struct thread_pool *pool, int n)
+{
+	int qsize, over;
+
+	qsize = __atomic_add_fetch(&pool->qsize, n, __ATOMIC_RELAXED);
+	if (!pool->max_queue || qsize <= pool->max_queue)
+		return n;
+
+	over = qsize - pool->max_queue < n ? qsize - pool->max_queue : n;
+	__atomic_sub_fetch(&pool->qsize, over, __ATOMIC_RELAXED);
+	return n - over;
+}
+
+/* the last thing a thread does, its slot will be joined and reused. */
+static void worker_exit(struct worker *w)
+{
+	struct thread_pool *pool = w->pool;
+
+	pthread_mutex_lock(&pool->resize_lock);
+	if (w->state == WORKER_RUNNING)
+		__atomic_sub_fetch(&pool->num_threads, 1, __ATOMIC_RELAXED);
+	w->state = WORKER_EXITED;
+	pthread_mutex_unlock(&pool->resize_lock);
+}
+
+/*
+ * Wait a job from the ring. spin a while at first, since the job usually
+ * arrives soon under load, then park on the futex. return 0 if a job has
+ * been taken, -1 if the pool is shutting down and the ring has been drained.
+ */
+static int ring_wait_job(struct worker *w, struct ring_cell *job)
+{
+	int i, val, idle;
+	struct timespec ts;
+	struct thread_pool *pool = w->pool;
+	struct job_ring *ring = &pool->ring;
+
+	while (1) {
+		for (i = 0; i < ring->spin; i++) {
+			if (ring_pop(ring, job) == 0)
+				return 0;
+			if (__atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE))
+				return -1;
+			cpu_relax();
+		}
+
+		if (worker_retire(w, 0))
+			return -1;
+
+		/*
+		 * read the futex word before we announce we are sleeping,
+		 * and check the ring again. a producer who pushed after that
+		 * must see 'nsleepers' and change the word, so the wake up
+		 * won't be lost.
+		 */
+		val = __atomic_load_n(&ring->wakeup, __ATOMIC_ACQUIRE);
+		__atomic_add_fetch(&ring->nsleepers, 1, __ATOMIC_SEQ_CST);
+
+		if (ring_pop(ring, job) == 0) {
+			__atomic_sub_fetch(&ring->nsleepers, 1,
+					   __ATOMIC_RELAXED);
+			return 0;
+		}
+
+		idle = 0;
+		if (!__atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE))
+			idle = futex_wait(&ring->wakeup, val,
+					  idle_timeout(pool, &ts)) == -1 &&
+			       errno == ETIMEDOUT;
+		__atomic_sub_fetch(&ring->nsleepers, 1, __ATOMIC_RELAXED);
+
+		if (idle && worker_retire(w, 1))
+			return -1;
+	}
+}
+
+static void ring_wake(struct job_ring *ring, int num)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->nsleepers, __ATOMIC_RELAXED) > 0) {
+		__atomic_add_fetch(&ring->wakeup, 1, __ATOMIC_RELEASE);
+		futex_wake(&ring->wakeup, num);
+	}
+}
+
+static void *do_the_ring_job(struct worker *w)
+{
+	struct ring_cell job;
+
+	while (ring_wait_job(w, &job) == 0) {
+		__atomic_sub_fetch(&w->pool->qsize, 1, __ATOMIC_RELAXED);
+		job_run(w, job.routine, job.arg, job.stamp);
+	}
+
+	worker_exit(w);
+	return NULL;
+}
+
+/*
+ * Lock-free version of dispatch(). If the ring is full, the caller yields
+ * the cpu until a slot is freed by the threads.
+ */
+static void dispatch_ring(struct thread_pool *from_me,
+			  job_routine job_routine, void *arg)
+{
+	struct ring_cell job = { 0, job_routine, arg, now_ns() };
+
+	if (from_me->dont_accept)
+		return;
+
+	if (!queue_admit(from_me, 1)) {
+		job_reject(from_me, job_routine, arg);
+		return;
+	}
+	while (ring_push(&from_me->ring, &job) == -1)
+		sched_yield();
+
+	ring_wake(&from_me->ring, 1);
+}
+
+/* the calling thread, if it's one of a TP_QUEUE_STEAL pool. */
+static __thread struct worker *self;
+
+static int deque_init(struct job_deque *deque, int size, int node)
+{
+	if (deque->cells)
+		return 0;
+	if (!(deque->cells = cells_alloc(size, node))) {
+		perror("allocate memory for job deque error");
+		return -1;
+	}
+	deque->mask = size - 1;
+	return 0;
+}
+
+/*
+ * Put a job to the bottom, called by the owner only. return 0 on success,
+ * -1 if the deque is full.
+ */
+static int deque_push(struct job_deque *deque, const struct ring_cell *job)
+{
+	struct ring_cell *cell;
+	long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+	if (b - t > deque->mask)
+		return -1;
+
+	/*
+	 * a thief may be reading a slot when it's refilled after a wrap, the
+	 * fields are accessed atomically and its CAS on 'top' will fail.
+	 */
+	cell = &deque->cells[b & deque->mask];
+	__atomic_store_n(&cell->routine, job->routine, __ATOMIC_RELAXED);
+	__atomic_store_n(&cell->arg, job->arg, __ATOMIC_RELAXED);
+	__atomic_store_n(&cell->stamp, job->stamp, __ATOMIC_RELAXED);
+	__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Take the job at the bottom, called by the owner only. return 0 on success,
+ * -1 if the deque is empty.
+ */
+static int deque_take(struct job_deque *deque, struct ring_cell *job)
+{
+	struct ring_cell *cell;
+	long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	long t;
+	int ret = 0;
+
+	/* reserve the bottom one before looking at 'top'. */
+	__atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+	if (t > b) {
+		__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	cell = &deque->cells[b & deque->mask];
+	job->routine = __atomic_load_n(&cell->routine, __ATOMIC_RELAXED);
+	job->arg = __atomic_load_n(&cell->arg, __ATOMIC_RELAXED);
+	job->stamp = __atomic_load_n(&cell->stamp, __ATOMIC_RELAXED);
+	if (t == b) {
+		/* the last one, the thieves may want it as well. */
+		if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0,
+						 __ATOMIC_SEQ_CST,
+						 __ATOMIC_RELAXED))
+			ret = -1;
+		__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return ret;
+}
+
+/*
+ * Steal the job at the top, called by the other threads. return 0 on
+ * success, -1 if the deque is empty, 1 if another thread won the race.
+ */
+static int deque_steal(struct job_deque *deque, struct ring_cell *job)
+{
+	struct ring_cell *cell;
+	long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	long b;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return -1;
+
+	cell = &deque->cells[t & deque->mask];
+	job->routine = __atomic_load_n(&cell->routine, __ATOMIC_RELAXED);
+	job->arg = __atomic_load_n(&cell->arg, __ATOMIC_RELAXED);
+	job->stamp = __atomic_load_n(&cell->stamp, __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return 1;
+	return 0;
+}
+
+/*
+ * Find a job for 'w'. its own deque and inbox come first, then the ones of
+ * the other threads, starting from a random thread so the thieves don't all
+ * hit the same victim.
+ */
+static int steal_find_job(struct worker *w, struct ring_cell *job)
+{
+	int i, ret, n;
+	struct thread_pool *pool = w->pool;
+	struct worker *victim;
+	unsigned int start;
+
+	if (deque_take(&w->deque, job) == 0 || ring_pop(&w->inbox, job) == 0)
+		return 0;
+
+	/*
+	 * the slots of retired threads are visited as well, the jobs left
+	 * in their inboxes are taken over by stealing.
+	 */
+	n = __atomic_load_n(&pool->num_workers, __ATOMIC_ACQUIRE);
+	start = rand_r(&w->seed);
+	for (i = 0; i < n; i++) {
+		victim = &pool->workers[(start + i) % n];
+		if (victim == w)
+			continue;
+		while ((ret = deque_steal(&victim->deque, job)) == 1)
+			cpu_relax();
+		if (ret == 0 || ring_pop(&victim->inbox, job) == 0)
+			return 0;
+	}
+	return -1;
+}
+
+/*
+ * Same as ring_wait_job(), but look for a job in all of the threads. the
+ * threads park on the futex of pool->ring.
+ */
+static int steal_wait_job(struct worker *w, struct ring_cell *job)
+{
+	int i, val, idle;
+	struct timespec ts;
+	struct thread_pool *pool = w->pool;
+	struct job_ring *park = &pool->ring;
+
+	while (1) {
+		for (i = 0; i < park->spin; i++) {
+			if (steal_find_job(w, job) == 0)
+				return 0;
+			if (__atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE))
+				return -1;
+			cpu_relax();
+		}
+
+		if (worker_retire(w, 0))
+			return -1;
+
+		val = __atomic_load_n(&park->wakeup, __ATOMIC_ACQUIRE);
+		__atomic_add_fetch(&park->nsleepers, 1, __ATOMIC_SEQ_CST);
+
+		if (steal_find_job(w, job) == 0) {
+			__atomic_sub_fetch(&park->nsleepers, 1,
+					   __ATOMIC_RELAXED);
+			return 0;
+		}
+
+		idle = 0;
+		if (!__atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE))
+			idle = futex_wait(&park->wakeup, val,
+					  idle_timeout(pool, &ts)) == -1 &&
+			       errno == ETIMEDOUT;
+		__atomic_sub_fetch(&park->nsleepers, 1, __ATOMIC_RELAXED);
+
+		if (idle && worker_retire(w, 1))
+			return -1;
+	}
+}
+
+static void *do_the_steal_job(struct worker *w)
+{
+	struct ring_cell job;
+
+	self = w;
+	while (steal_wait_job(w, &job) == 0) {
+		__atomic_sub_fetch(&w->pool->qsize, 1, __ATOMIC_RELAXED);
+		job_run(w, job.routine, job.arg, job.stamp);
+	}
+
+	worker_exit(w);
+	return NULL;
+}
+
+/*
+ * The inbox for a job from outside of the pool, by round-robin. if the
+ * threads are placed, the ones on the node of caller are preferred, so the
+ * job runs on the node where its connection was accepted, and the memory
+ * it touches stays local. the slot which has never had a thread has no
+ * inbox, then any of them is taken.
+ */
+static struct worker *inbox_pick(struct thread_pool *pool)
+{
+	int cpu, node, first, n;
+	int nworkers = __atomic_load_n(&pool->num_workers, __ATOMIC_ACQUIRE);
+	unsigned int next = __atomic_fetch_add(&pool->next_worker, 1,
+					       __ATOMIC_RELAXED);
+
+	if (pool->nplaces && (cpu = sched_getcpu()) >= 0 &&
+	    cpu < CPU_SETSIZE && (node = pool->cpu_node[cpu]) >= 0 &&
+	    node < pool->nnodes) {
+		first = pool->node_first[node];
+		if ((n = pool->node_first[node + 1] - first) > 0 &&
+		    (n = pool->node_slots[first + next % n]) < nworkers)
+			return &pool->workers[n];
+	}
+	return &pool->workers[next % nworkers];
+}
+
+/*
+ * Put a job to TP_QUEUE_STEAL. the job dispatched by a thread of the pool
+ * stays in its own deque, the ones from outside are spread over the inboxes
+ * by round-robin. the caller yields while the inbox is full.
+ */
+static void steal_push(struct thread_pool *from_me,
+		       const struct ring_cell *job)
+{
+	struct worker *w;
+
+	if (!self || self->pool != from_me ||
+	    deque_push(&self->deque, job) == -1) {
+		w = inbox_pick(from_me);
+		while (ring_push(&w->inbox, job) == -1)
+			sched_yield();
+	}
+}
+
+static void dispatch_steal(struct thread_pool *from_me,
+			   job_routine job_routine, void *arg)
+{
+	struct ring_cell job = { 0, job_routine, arg, now_ns() };
+
+	if (from_me->dont_accept)
+		return;
+
+	if (!queue_admit(from_me, 1)) {
+		job_reject(from_me, job_routine, arg);
+		return;
+	}
+	steal_push(from_me, &job);
+	ring_wake(&from_me->ring, 1);
+}
+
+/*
+ * Wait on q_not_empty, until the idle timeout if the pool is elastic. return
+ * 1 if it timed out.
+ */
+static int list_wait(struct thread_pool *pool)
 {
 	int err;
+	struct timespec ts, deadline;
+
+	if (!idle_timeout(pool, &ts)) {
+		if ((err = pthread_cond_wait(&pool->q_not_empty, &pool->qlock)))
+			perror("pthread_cond_wait error in do_the_job");
+		return 0;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += ts.tv_sec;
+	if ((deadline.tv_nsec += ts.tv_nsec) >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	err = pthread_cond_timedwait(&pool->q_not_empty, &pool->qlock,
+				     &deadline);
+	if (err && err != ETIMEDOUT)
+		perror("pthread_cond_timedwait error in do_the_job");
+	return err == ETIMEDOUT;
+}
+
+static void *do_the_job(void *arg)
+{
+	int err, idle;
 	struct job *job;
-	struct thread_pool *pool = arg;
+	struct worker *w = arg;
+	struct thread_pool *pool = w->pool;
+
+	if (pool->queue == TP_QUEUE_RING)
+		return do_the_ring_job(w);
+	if (pool->queue == TP_QUEUE_STEAL)
+		return do_the_steal_job(w);
 
 	while (1) {
+		job = NULL;
 		if ((err = pthread_mutex_lock(&pool->qlock)))
 			perror("pthread_mutex_lock error in do_the_job");
 
@@ -19,14 +670,14 @@ static void *do_the_job(void *arg)
 		 * when dont_accept flags is set, all of the threads won't wait
 		 * the struct job (request from the client) any more.
 		 */
+		idle = 0;
 		while (!pool->dont_accept && !pool->qhead) {
-			if ((err = pthread_cond_wait(&pool->q_not_empty,
-						     &pool->qlock)))
-				perror("pthread_cond_wait error in do_the_job");
+			if (worker_retire(w, idle))
+				goto out;
 
+			idle = list_wait(pool);
 			if (pool->shutdown)
 				goto out;
-	
 		}
 	
 		if (pool->qhead) {
@@ -49,17 +700,17 @@ static void *do_the_job(void *arg)
 		
 		if (job) {
 			/* start the job, and process the request from client. */
-			job->jb_routine(job->jb_arg);		
-			/* when using -lpthread, thread safe version is used */
-			free(job);
+			job_run(w, job->jb_routine, job->jb_arg, job->jb_stamp);
+			/* return to the thread-local cache of the dispatcher */
+			slab_free(pool->job_slab, job);
 		}
 	}
 
 out:
-	pool->num_threads--;
 	if ((err = pthread_mutex_unlock(&pool->qlock)))
 		perror("pthread_mutex_unlock error in do_the_job");
 
+	worker_exit(w);
 	return NULL;
 }
 
@@ -71,13 +722,24 @@ void dispatch(struct thread_pool *from_me, job_routine job_routine, void *arg)
 	if ( !from_me | !job_routine)
 		goto out;
 
-	if (!(job = calloc(1, sizeof(*job)))) {
-		perror("calloc error in dispatch");
+	if (from_me->queue == TP_QUEUE_RING) {
+		dispatch_ring(from_me, job_routine, arg);
+		return;
+	}
+	if (from_me->queue == TP_QUEUE_STEAL) {
+		dispatch_steal(from_me, job_routine, arg);
+		return;
+	}
+
+	if (!(job = slab_alloc(from_me->job_slab))) {
+		fprintf(stderr, "allocate job error in dispatch\n");
 		goto out;
 	}
 
 	job->jb_routine = job_routine;
 	job->jb_arg = arg;
+	job->jb_stamp = now_ns();
+	job->jb_next = NULL;
 
 	if (from_me->dont_accept)
 		goto out;
@@ -85,6 +747,13 @@ void dispatch(struct thread_pool *from_me, job_routine job_routine, void *arg)
 	if ((s = pthread_mutex_lock(&from_me->qlock)))
 		perror("pthread_mutex_lock error in dispatch");
 
+	if (from_me->max_queue && from_me->qsize >= from_me->max_queue) {
+		if ((s = pthread_mutex_unlock(&from_me->qlock)))
+			perror("pthread_mutex_unlock error in dispatch");
+		job_reject(from_me, job_routine, arg);
+		goto out;
+	}
+
 	/* 
 	 * qhead empty means there not job in the queue. 
 	 */
@@ -107,17 +776,351 @@ void dispatch(struct thread_pool *from_me, job_routine job_routine, void *arg)
 	return;
 out:
 	if (job)
-		free(job);
+		slab_free(from_me->job_slab, job);
+}
+
+/*
+ * Dispatch 'n' jobs at once, only jb_routine and jb_arg of them are used.
+ * the list is locked once and the threads are woken by one broadcast. the
+ * lock-free queues take the jobs one by one, but wake the threads once. if
+ * the queue is bounded, the jobs beyond its room are refused.
+ */
+void dispatch_batch(struct thread_pool *from_me, const struct job *jobs, int n)
+{
+	int i, s, room;
+	struct job *job, *next, *head = NULL, *tail = NULL;
+	struct ring_cell cell = { .stamp = now_ns() };
+
+	if (!from_me || n <= 0 || from_me->dont_accept)
+		return;
+
+	if (from_me->queue != TP_QUEUE_LIST) {
+		room = queue_admit(from_me, n);
+		for (i = room; i < n; i++)
+			job_reject(from_me, jobs[i].jb_routine, jobs[i].jb_arg);
+		for (n = room, i = 0; i < n; i++) {
+			cell.routine = jobs[i].jb_routine;
+			cell.arg = jobs[i].jb_arg;
+			if (from_me->queue == TP_QUEUE_STEAL) {
+				steal_push(from_me, &cell);
+				continue;
+			}
+			while (ring_push(&from_me->ring, &cell) == -1)
+				sched_yield();
+		}
+		if (n)
+			ring_wake(&from_me->ring, n);
+		return;
+	}
+
+	/* chain them before taking the lock. */
+	for (i = 0; i < n; i++) {
+		if (!(job = slab_alloc(from_me->job_slab))) {
+			fprintf(stderr, "allocate job error in dispatch_batch\n");
+			break;
+		}
+		job->jb_routine = jobs[i].jb_routine;
+		job->jb_arg = jobs[i].jb_arg;
+		job->jb_stamp = cell.stamp;
+		job->jb_next = NULL;
+		if (tail)
+			tail->jb_next = job;
+		else
+			head = job;
+		tail = job;
+	}
+	if (!head)
+		return;
+
+	if ((s = pthread_mutex_lock(&from_me->qlock)))
+		perror("pthread_mutex_lock error in dispatch_batch");
+
+	/* cut the chain after the room left, the rest are refused. */
+	room = i;
+	if (from_me->max_queue && from_me->qsize + i > from_me->max_queue)
+		room = from_me->qsize < from_me->max_queue ?
+		       from_me->max_queue - from_me->qsize : 0;
+	next = head;
+	for (i = 0, tail = NULL; i < room; i++) {
+		tail = next;
+		next = next->jb_next;
+	}
+
+	if (tail) {
+		tail->jb_next = NULL;
+		from_me->qsize += room;
+		if (from_me->qhead && from_me->qtail)
+			from_me->qtail->jb_next = head;
+		else
+			from_me->qhead = head;
+		from_me->qtail = tail;
+	}
+
+	if ((s = pthread_mutex_unlock(&from_me->qlock)))
+		perror("pthread_mutex_unlock error in dispatch_batch");
+
+	for (job = next; job; job = next) {
+		next = job->jb_next;
+		job_reject(from_me, job->jb_routine, job->jb_arg);
+		slab_free(from_me->job_slab, job);
+	}
+
+	if (i == 0)
+		return;
+	if (i == 1)
+		s = pthread_cond_signal(&from_me->q_not_empty);
+	else
+		s = pthread_cond_broadcast(&from_me->q_not_empty);
+	if (s)
+		perror("pthread_cond_broadcast error in dispatch_batch");
+}
+
+/*
+ * The attributes of the thread of a placed slot: pinned to its cpu before
+ * it runs, with the stack on its node. the stack belongs to the slot, as
+ * the deque and inbox do, the next thread of the slot takes it over.
+ */
+static int placed_attr_init(struct thread_pool *pool, struct worker *w,
+			    pthread_attr_t *attr)
+{
+	int err;
+	cpu_set_t set;
+
+	if (!w->stack) {
+		if (!(w->stack = node_alloc(pool->stack_size, w->node))) {
+			perror("allocate the stack of thread error");
+			return -1;
+		}
+		/* the guard page, as the stacks of glibc have. */
+		mprotect(w->stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	if ((err = pthread_attr_init(attr)))
+		goto out;
+	if ((err = pthread_attr_setstack(attr, w->stack, pool->stack_size)) ||
+	    (err = pthread_attr_setaffinity_np(attr, sizeof(set), &set))) {
+		pthread_attr_destroy(attr);
+		goto out;
+	}
+	return 0;
+out:
+	errno = err;
+	perror("set the placement of thread error");
+	return -1;
+}
+
+/*
+ * Start a thread in a free slot, called with resize_lock held. the slot of
+ * TP_QUEUE_STEAL keeps its deque and inbox after the thread retired, the
+ * jobs left there are served by the new one. return 0 on success.
+ */
+static int worker_spawn(struct thread_pool *pool)
+{
+	int i, err;
+	struct worker *w;
+	pthread_attr_t attr;
+
+	for (i = 0; i < pool->slots; i++) {
+		if (pool->workers[i].state == WORKER_FREE)
+			break;
+	}
+	if (i == pool->slots)
+		return -1;
+
+	w = &pool->workers[i];
+	w->pool = pool;
+	w->seed = i;
+	if (pool->queue == TP_QUEUE_STEAL &&
+	    ((!w->inbox.cells &&
+	      ring_init(&w->inbox, pool->ring_size, w->node) == -1) ||
+	     deque_init(&w->deque, pool->ring_size, w->node) == -1))
+		return -1;
+
+	if (w->cpu != -1 && placed_attr_init(pool, w, &attr) == -1)
+		return -1;
+
+	w->state = WORKER_RUNNING;
+	__atomic_add_fetch(&pool->num_threads, 1, __ATOMIC_RELAXED);
+	err = pthread_create(&pool->threads[i],
+			     w->cpu != -1 ? &attr : &pool->thread_attr,
+			     do_the_job, w);
+	if (w->cpu != -1)
+		pthread_attr_destroy(&attr);
+	if (err) {
+		errno = err;
+		perror("pthread_create error in worker_spawn");
+		w->state = WORKER_FREE;
+		__atomic_sub_fetch(&pool->num_threads, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	if (i >= pool->num_workers)
+		__atomic_store_n(&pool->num_workers, i + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* join the threads which have retired, so their slots can be reused. */
+static void worker_reap(struct thread_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->num_workers; i++) {
+		if (pool->workers[i].state != WORKER_EXITED)
+			continue;
+		pthread_join(pool->threads[i], NULL);
+		pool->workers[i].state = WORKER_FREE;
+	}
+}
+
+/*
+ * Wake up all of the idle threads, the ones above max_threads will find it
+ * and retire.
+ */
+static void pool_kick(struct thread_pool *pool)
+{
+	if (pool->queue == TP_QUEUE_LIST) {
+		pthread_mutex_lock(&pool->qlock);
+		pthread_cond_broadcast(&pool->q_not_empty);
+		pthread_mutex_unlock(&pool->qlock);
+		return;
+	}
+
+	__atomic_add_fetch(&pool->ring.wakeup, 1, __ATOMIC_RELEASE);
+	futex_wake(&pool->ring.wakeup, INT_MAX);
+}
+
+/*
+ * The controller of the elastic pool. every ADJUST_INTERVAL it reaps the
+ * retired threads, and spawns more if the jobs wait too long: the queue is
+ * longer than the jobs taken during the last interval, so the last one will
+ * wait more than a interval at the current rate. no job is taken at all if
+ * the threads are blocked. it grows by the jobs which are left, at most
+ * doubling the threads at once. the idle threads retire themselves.
+ */
+static void *pool_controller(void *arg)
+{
+	int i, n, qsize, rate, grow;
+	unsigned long taken, last_taken = 0;
+	struct thread_pool *pool = arg;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&pool->resize_lock);
+	while (!pool->stop_controller) {
+		worker_reap(pool);
+
+		qsize = __atomic_load_n(&pool->qsize, __ATOMIC_RELAXED);
+		for (taken = 0, i = 0; i < pool->num_workers; i++)
+			taken += __atomic_load_n(&pool->workers[i].ntaken,
+						 __ATOMIC_RELAXED);
+
+		rate = taken - last_taken;
+		last_taken = taken;
+
+		n = pool->min_threads - pool->num_threads;
+		if (qsize > rate) {
+			grow = qsize - rate;
+			i = pool->num_threads > 0 ? pool->num_threads : 1;
+			if (grow > i)
+				grow = i;
+			if (n < grow)
+				n = grow;
+		}
+		if (n > pool->max_threads - pool->num_threads)
+			n = pool->max_threads - pool->num_threads;
+		while (n-- > 0 && worker_spawn(pool) == 0)
+			;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += ADJUST_INTERVAL * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&pool->resize_cond, &pool->resize_lock,
+				       &deadline);
+	}
+	pthread_mutex_unlock(&pool->resize_lock);
+	return NULL;
+}
+
+/* called with resize_lock held. */
+static int controller_start(struct thread_pool *pool)
+{
+	int err;
+
+	if (pool->has_controller)
+		return 0;
+	if ((err = pthread_create(&pool->controller, NULL, pool_controller,
+				  pool))) {
+		errno = err;
+		perror("pthread_create error in controller_start");
+		return -1;
+	}
+	pool->has_controller = 1;
+	return 0;
+}
+
+/*
+ * Change the bounds of the number of threads, up to the max_threads the pool
+ * was created with. the controller spawns the threads to reach the new
+ * min_threads at once, the idle threads above max_threads retire at once,
+ * the busy ones after their job.
+ */
+int thread_pool_resize(struct thread_pool *pool, int min_threads,
+		       int max_threads)
+{
+	int ret;
+
+	if (min_threads <= 0 || min_threads > max_threads ||
+	    max_threads > pool->slots) {
+		fprintf(stderr, "invalid pool size: %d-%d (%d-%d)\n",
+			min_threads, max_threads, 1, pool->slots);
+		return -1;
+	}
+
+	pthread_mutex_lock(&pool->resize_lock);
+	__atomic_store_n(&pool->min_threads, min_threads, __ATOMIC_RELAXED);
+	__atomic_store_n(&pool->max_threads, max_threads, __ATOMIC_RELAXED);
+	if ((ret = controller_start(pool)) == 0)
+		pthread_cond_signal(&pool->resize_cond);
+	pthread_mutex_unlock(&pool->resize_lock);
+
+	pool_kick(pool);
+	return ret;
 }
 
 void thread_pool_delete(struct thread_pool *pool)
 {
-	int i, err, num_threads_saved;
+	int i, err;
+	struct worker *w;
 
 	if (!pool)
 		return;
 
-       	num_threads_saved = pool->num_threads;
+	/* no thread is spawned from now on. */
+	if (pool->has_controller) {
+		pthread_mutex_lock(&pool->resize_lock);
+		pool->stop_controller = 1;
+		pthread_cond_signal(&pool->resize_cond);
+		pthread_mutex_unlock(&pool->resize_lock);
+		pthread_join(pool->controller, NULL);
+	}
+
+	if (pool->queue != TP_QUEUE_LIST) {
+		/*
+		 * the threads exit only when the ring (or all of the deques and
+		 * inboxes) is empty, so all of the jobs dispatched before will
+		 * be finished.
+		 */
+		pool->dont_accept = 1;
+		__atomic_store_n(&pool->shutdown, 1, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&pool->ring.wakeup, 1, __ATOMIC_RELEASE);
+		futex_wake(&pool->ring.wakeup, INT_MAX);
+		goto join;
+	}
+
 	if ((err = pthread_mutex_lock(&pool->qlock)))	/* LOCK */
 		perror("pthread_mutex_lock error in thread_pool_delete");
 
@@ -147,11 +1150,18 @@ void thread_pool_delete(struct thread_pool *pool)
 	if ((err = pthread_cond_broadcast(&pool->q_not_empty)))
 		perror("pthread_mutex_unlock error in thread_pool_delete");
 	
+join:
 	/*
-	 * join all of the threads we created before. and also, we don't use
-	 * return value. just leave it NULL.
+	 * join all of the threads we created before, including the retired
+	 * ones which have not been reaped. and also, we don't use return
+	 * value. just leave it NULL.
 	 */
-	for (i = 0; i < num_threads_saved; i++) {
+	for (i = 0; i < pool->num_workers; i++) {
+		pthread_mutex_lock(&pool->resize_lock);
+		err = pool->workers[i].state == WORKER_FREE;
+		pthread_mutex_unlock(&pool->resize_lock);
+		if (err)
+			continue;
 		if ((err = pthread_join(pool->threads[i], NULL)))
 			perror("pthread_join error in destroy_threadpoll");
 	}
@@ -159,34 +1169,200 @@ void thread_pool_delete(struct thread_pool *pool)
 	/* free memory resource which allocated by malloc(). */
 	if (pool->threads)
 		free(pool->threads);
+	if (pool->ring.cells)
+		free(pool->ring.cells);
+	for (i = 0; pool->workers && i < pool->slots; i++) {
+		w = &pool->workers[i];
+		cells_free(w->inbox.cells, pool->ring_size, w->node);
+		cells_free(w->deque.cells, pool->ring_size, w->node);
+		node_free(w->stack, pool->stack_size);
+	}
+	free(pool->workers);
+	free(pool->places);
+	free(pool->node_first);
+	free(pool->node_slots);
+	free(pool->cpu_node);
+	slab_delete(pool->job_slab);
+	pthread_attr_destroy(&pool->thread_attr);
 	if (pool)
 		free(pool);	
 }
 
+/*
+ * Decide the cpu of every slot by the policy of 'attr', see TP_PLACE_*, and
+ * which slots are on each node. return -1 if the cpus are not there.
+ */
+static int pool_place(struct thread_pool *pool,
+		      const struct thread_pool_attr *attr)
+{
+	int i, k, n = 0, node, ncpus;
+	size_t page = sysconf(_SC_PAGESIZE);
+	struct cpu_place place;
+	struct worker *w;
+
+	for (i = 0; i < pool->slots; i++) {
+		pool->workers[i].cpu = -1;
+		pool->workers[i].node = -1;
+	}
+	if (attr->placement == TP_PLACE_NONE)
+		return 0;
+
+	if (!(pool->places = calloc(CPU_SETSIZE, sizeof(*pool->places))) ||
+	    !(pool->cpu_node = calloc(CPU_SETSIZE,
+				      sizeof(*pool->cpu_node)))) {
+		perror("allocate memory for placement error");
+		return -1;
+	}
+
+	if (attr->placement == TP_PLACE_CPUS) {
+		for (; n < attr->ncpus && n < CPU_SETSIZE; n++) {
+			if (placement_probe_cpu(attr->cpus[n],
+						&pool->places[n]) == -1) {
+				fprintf(stderr, "invalid cpu to place the "
+						"thread: %d\n", attr->cpus[n]);
+				return -1;
+			}
+		}
+	} else {
+		n = placement_probe(pool->places, CPU_SETSIZE);
+		if (attr->placement == TP_PLACE_SCATTER)
+			placement_scatter(pool->places, n);
+		else
+			placement_compact(pool->places, n);
+	}
+	if (n == 0) {
+		fprintf(stderr, "no cpu to place the threads.\n");
+		return -1;
+	}
+	pool->nplaces = n;
+
+	/* the callers of dispatch() may run on any cpu. */
+	ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		pool->cpu_node[i] = -1;
+		if (i < ncpus && placement_probe_cpu(i, &place) == 0)
+			pool->cpu_node[i] = place.node;
+	}
+
+	for (i = 0; i < pool->slots; i++) {
+		w = &pool->workers[i];
+		w->cpu = pool->places[i % n].cpu;
+		w->node = pool->places[i % n].node;
+		if (w->node >= pool->nnodes)
+			pool->nnodes = w->node + 1;
+	}
+
+	if (!(pool->node_first = calloc(pool->nnodes + 1,
+					sizeof(*pool->node_first))) ||
+	    !(pool->node_slots = calloc(pool->slots,
+					sizeof(*pool->node_slots)))) {
+		perror("allocate memory for placement error");
+		return -1;
+	}
+	for (k = 0, node = 0; node < pool->nnodes; node++) {
+		pool->node_first[node] = k;
+		for (i = 0; i < pool->slots; i++) {
+			if (pool->workers[i].node == node)
+				pool->node_slots[k++] = i;
+		}
+	}
+	pool->node_first[node] = k;
+
+	/* the stacks are ours, of the size the threads would have had. */
+	if (!pool->stack_size)
+		pthread_attr_getstacksize(&pool->thread_attr,
+					  &pool->stack_size);
+	pool->stack_size = (pool->stack_size + page - 1) / page * page;
+	return 0;
+}
+
+void thread_pool_attr_init(struct thread_pool_attr *attr, int num_threads)
+{
+	attr->num_threads = num_threads;
+	attr->queue = TP_QUEUE_LIST;
+	attr->ring_size = RING_SIZE_DEFAULT;
+	attr->min_threads = num_threads;
+	attr->max_threads = num_threads;
+	attr->idle_timeout = IDLE_TIMEOUT_DEFAULT;
+	attr->stack_size = 0;
+	attr->max_queue = 0;
+	attr->queue_timeout = 0;
+	attr->reject = NULL;
+	attr->placement = TP_PLACE_NONE;
+	attr->cpus = NULL;
+	attr->ncpus = 0;
+}
+
 struct thread_pool *thread_pool_new(int num_threads_in_pool)
+{
+	struct thread_pool_attr attr;
+
+	thread_pool_attr_init(&attr, num_threads_in_pool);
+	return thread_pool_new_attr(&attr);
+}
+
+struct thread_pool *thread_pool_new_attr(const struct thread_pool_attr *attr)
 {
 	int err;
 	int i;
-	struct thread_pool *pool = calloc(1, sizeof(*pool));
+	int num_threads_in_pool = attr->num_threads;
+	struct thread_pool *pool;
 
-	if (num_threads_in_pool <= 0 || num_threads_in_pool > MAXT_IN_POOL) {
+	if (attr->min_threads <= 0 || attr->max_threads > MAXT_IN_POOL ||
+	    num_threads_in_pool < attr->min_threads ||
+	    num_threads_in_pool > attr->max_threads) {
 		fprintf(stderr, "invalid arguments: %d (%d-%d)\n",
-				num_threads_in_pool, 1, MAXT_IN_POOL);
-		goto out;
+				num_threads_in_pool, attr->min_threads > 0 ?
+				attr->min_threads : 1, attr->max_threads);
+		return NULL;
 	}
 
-	if (!pool) {
+	if (!(pool = calloc(1, sizeof(*pool)))) {
 		perror("allocate memory for thread pool error");
+		return NULL;
+	}
+
+	/* the rest of the pool is cleaned up by thread_pool_delete(). */
+	if ((err = pthread_mutex_init(&pool->resize_lock, NULL)) ||
+	    (err = pthread_cond_init(&pool->resize_cond, NULL)) ||
+	    (err = pthread_attr_init(&pool->thread_attr))) {
+		free(pool);
+		return NULL;
+	}
+
+	if (attr->stack_size &&
+	    (err = pthread_attr_setstacksize(&pool->thread_attr,
+			attr->stack_size < PTHREAD_STACK_MIN ?
+			PTHREAD_STACK_MIN : attr->stack_size))) {
+		errno = err;
+		perror("pthread_attr_setstacksize error");
 		goto out;
 	}
 
+	pool->min_threads = attr->min_threads;
+	pool->max_threads = attr->max_threads;
+	pool->slots = attr->max_threads;
+	pool->idle_timeout = attr->idle_timeout > 0 ?
+			     attr->idle_timeout : IDLE_TIMEOUT_DEFAULT;
+	pool->ring_size = attr->ring_size;
+	pool->max_queue = attr->max_queue > 0 ? attr->max_queue : 0;
+	pool->queue_timeout = attr->queue_timeout > 0 ?
+			      attr->queue_timeout * 1000000UL : 0;
+	pool->reject = attr->reject;
+
 	/* use to store the thread pointer to array. */
-	if (!(pool->threads = calloc(num_threads_in_pool,
-				     sizeof(*(pool->threads))))) {
+	if (!(pool->threads = calloc(pool->slots, sizeof(*(pool->threads)))) ||
+	    !(pool->workers = calloc(pool->slots, sizeof(*pool->workers)))) {
 		perror("allocate memory for threads array error");
 		goto out;
 	}
 
+	if (attr->stack_size)
+		pool->stack_size = attr->stack_size < PTHREAD_STACK_MIN ?
+				   PTHREAD_STACK_MIN : attr->stack_size;
+	if (pool_place(pool, attr) == -1)
+		goto out;
+
 	if ((err = pthread_mutex_init(&pool->qlock, NULL)))
 		goto out;
 
@@ -196,20 +1372,37 @@ struct thread_pool *thread_pool_new(int num_threads_in_pool)
 	if ((err = pthread_cond_init(&pool->q_empty, NULL)))
 		goto out;
 
+	pool->queue = attr->queue;
+	if (pool->queue == TP_QUEUE_RING &&
+	    ring_init(&pool->ring, attr->ring_size, -1) == -1)
+		goto out;
+
+	/* only the sleeping part of the ring, the threads park on it. */
+	if (pool->queue == TP_QUEUE_STEAL)
+		pool->ring.spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ?
+				  SPIN_COUNT : 1;
+
+	if (pool->queue == TP_QUEUE_LIST &&
+	    !(pool->job_slab = slab_new(sizeof(struct job))))
+		goto out;
+
 	/*
 	 * create a number of thread, which specified by 'num_threads_in_pool'.
+	 * they take the first slots.
 	 */
-	pool->num_threads = num_threads_in_pool;
-	for (i = 0; i < pool->num_threads; i++) {
-		if ((err = pthread_create(&pool->threads[i], NULL, do_the_job,
-					  pool)))
-			goto out;
+	pthread_mutex_lock(&pool->resize_lock);
+	for (i = 0; i < num_threads_in_pool; i++) {
+		if (worker_spawn(pool) == -1)
+			break;
 	}
-
+	if (i == num_threads_in_pool && pool->min_threads < pool->max_threads)
+		err = controller_start(pool);
+	pthread_mutex_unlock(&pool->resize_lock);
+	if (i < num_threads_in_pool || err)
+		goto out;
 
 	return pool;
 out:
 	thread_pool_delete(pool);
 	return NULL;
 }
-
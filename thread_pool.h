@@ -1,20 +1,139 @@
 #include <pthread.h>
+#include <stdint.h>
 
 /* maximum number of threads allowed in a pool */
-#define MAXT_IN_POOL 200
+#define MAXT_IN_POOL 1024
+
+/* default ms a idle thread above min_threads waits before it exits */
+#define IDLE_TIMEOUT_DEFAULT 30000
+
+/* default number of slots in the lock-free ring, must be power of 2 */
+#define RING_SIZE_DEFAULT 4096
+
+/* backends of the job queue */
+#define TP_QUEUE_LIST	0	/* linked list protected by qlock */
+#define TP_QUEUE_RING	1	/* bounded lock-free MPMC ring */
+#define TP_QUEUE_STEAL	2	/* deque per thread, idle threads steal */
+
+/* placement of the threads, each one is pinned to a cpu */
+#define TP_PLACE_NONE		0	/* wherever the scheduler likes */
+#define TP_PLACE_COMPACT	1	/* fill a node core by core, then next */
+#define TP_PLACE_SCATTER	2	/* a core of every node, then the next */
+#define TP_PLACE_CPUS		3	/* the 'cpus' of attr, in the order */
+
+/*
+ * pass a small integer, such as a descriptor, as the argument of job inline,
+ * so the caller doesn't need to allocate memory for it.
+ */
+#define JOB_ARG_INT(i)	((void *)(intptr_t)(i))
+#define JOB_INT(arg)	((int)(intptr_t)(arg))
 
 typedef int (*job_routine)(void *);
+
+/*
+ * Called with the job refused by the pool, instead of running it: the queue
+ * was full when it's dispatched, or it waited longer than the deadline. it
+ * must release what 'arg' holds.
+ */
+typedef void (*reject_routine)(job_routine routine, void *arg);
 struct job {
 	job_routine jb_routine;	/* the threads process function */
 	void *jb_arg;			/* argument to the function */
 	struct job *jb_next;
+	unsigned long jb_stamp;		/* ns when it was dispatched */
+};
+
+/*
+ * One slot of the ring. 'seq' tells the slot is free for the producer of
+ * round 'seq', or filled for the consumer of round 'seq - 1'.
+ */
+struct ring_cell {
+	unsigned long seq;
+	job_routine routine;
+	void *arg;
+	unsigned long stamp;	/* ns when it was dispatched */
+};
+
+/*
+ * The bounded MPMC queue by Dmitry Vyukov. The producers and the consumers
+ * claim a slot by the CAS on their own position, so no lock is taken.
+ */
+struct job_ring {
+	struct ring_cell *cells;
+	unsigned long mask;	/* number of cells - 1 */
+	int spin;		/* polls before a idle thread parks */
+	unsigned long enqueue_pos __attribute__((aligned(64)));
+	unsigned long dequeue_pos __attribute__((aligned(64)));
+	int nsleepers __attribute__((aligned(64)));
+				/* number of threads parked on 'wakeup' */
+	int wakeup;		/* futex word, changed on every wake up */
 };
 
+/*
+ * The Chase-Lev deque of one thread in TP_QUEUE_STEAL. the owner pushes and
+ * takes at the bottom (LIFO, the job is still hot in its cache), the other
+ * threads steal from the top by the CAS on 'top'.
+ */
+struct job_deque {
+	struct ring_cell *cells;	/* 'seq' is not used */
+	long mask;
+	long top __attribute__((aligned(64)));
+	long bottom __attribute__((aligned(64)));
+};
+
+/* states of the slot of a thread */
+#define WORKER_FREE	0	/* no thread */
+#define WORKER_RUNNING	1
+#define WORKER_EXITING	2	/* retired, not counted in num_threads */
+#define WORKER_EXITED	3	/* the thread returned, to be joined */
+
+/*
+ * The slot of a thread in the pool. for TP_QUEUE_STEAL, the deque takes the
+ * jobs dispatched by the thread itself, only the owner may push to it. the
+ * jobs from outside of the pool go to the inbox of the threads by
+ * round-robin.
+ */
+struct worker {
+	struct thread_pool *pool;
+	int state;		/* WORKER_*, protected by resize_lock */
+	int cpu;		/* the thread is pinned to, -1 if not placed */
+	int node;		/* NUMA node of 'cpu', -1 if not placed */
+	void *stack;		/* on 'node', kept for the next thread */
+	unsigned long ntaken;	/* jobs taken, read by the controller */
+	struct job_deque deque;
+	struct job_ring inbox;
+	unsigned int seed;	/* picks the first victim to steal from */
+};
+
+/* attributes used to create the pool, see thread_pool_attr_init(). */
+struct thread_pool_attr {
+	int num_threads;	/* number of threads created at first */
+	int queue;		/* TP_QUEUE_* */
+	int ring_size;		/* slots of the ring, power of 2. also the
+				   size of deque and inbox of TP_QUEUE_STEAL */
+	int min_threads;	/* the pool never shrinks below it */
+	int max_threads;	/* nor grows above it, the pool is elastic if
+				   it's larger than min_threads */
+	int idle_timeout;	/* ms, see IDLE_TIMEOUT_DEFAULT */
+	size_t stack_size;	/* of each thread, 0 for the default */
+	int max_queue;		/* jobs waiting at most, 0 unbounded */
+	int queue_timeout;	/* ms a job may wait in the queue, 0 forever */
+	reject_routine reject;	/* takes the refused jobs, NULL drops them */
+	int placement;		/* TP_PLACE_* */
+	const int *cpus;	/* for TP_PLACE_CPUS, copied by the pool */
+	int ncpus;
+};
+
+struct slab;
+struct cpu_place;
 
 struct thread_pool {
 	int num_threads;	/*number of active threads */
+	int min_threads;	/* bounds of num_threads, protected by */
+	int max_threads;	/* resize_lock, see thread_pool_resize() */
+	int slots;		/* size of 'threads' and 'workers' */
 	int qsize;		/* number in the queue */
-	pthread_t *threads;	/* pointer to threads */
+	pthread_t *threads;	/* pointer to threads, one per slot */
 	struct job *qhead;		/* queue head pointer */
 	struct job *qtail;		/* queue tail pointer */
 	pthread_mutex_t qlock;	/* lock on the queue list */
@@ -23,9 +142,51 @@ struct thread_pool {
 	pthread_cond_t q_empty;
 	int shutdown;		/* 1 if the pool is in distruction process */
 	int dont_accept;	/* 1 if destroy function has begun */
+	int queue;		/* backend of the queue, TP_QUEUE_* */
+	int ring_size;		/* of the deque and inbox of a new slot */
+	struct job_ring ring;	/* used if queue is TP_QUEUE_RING. only the
+				   sleeping part if TP_QUEUE_STEAL */
+	struct worker *workers;	/* slots of the threads */
+	int num_workers;	/* highest slot ever used + 1 */
+	unsigned int next_worker;
+				/* inbox of the next external dispatch() */
+	struct slab *job_slab;	/* struct job of TP_QUEUE_LIST come from */
+
+	pthread_mutex_t resize_lock;
+	pthread_cond_t resize_cond;	/* kicks the controller */
+	pthread_attr_t thread_attr;	/* stack size of the threads */
+	int idle_timeout;
+	pthread_t controller;	/* spawns and reaps the threads */
+	int has_controller;
+	int stop_controller;
+
+	int max_queue;		/* admission control, see thread_pool_attr */
+	unsigned long queue_timeout;	/* ns */
+	reject_routine reject;
+	unsigned long rejected;	/* jobs refused */
+
+	/*
+	 * placement, slot i runs on places[i % nplaces]. the jobs from outside
+	 * of a TP_QUEUE_STEAL pool go to the slots on the node of caller,
+	 * they are node_slots[node_first[node]] to node_slots[node_first[node
+	 * + 1] - 1].
+	 */
+	struct cpu_place *places;
+	int nplaces;		/* 0 if the threads are not placed */
+	size_t stack_size;	/* of the stacks allocated on the nodes */
+	int nnodes;
+	int *node_first;
+	int *node_slots;
+	int *cpu_node;		/* node of every cpu, -1 unknown */
 };
 
 
+void thread_pool_attr_init(struct thread_pool_attr *attr, int num_threads);
+struct thread_pool *thread_pool_new_attr(const struct thread_pool_attr *attr);
 struct thread_pool *thread_pool_new(int num_threads_in_pool);
 void dispatch(struct thread_pool * from_me, job_routine job_routine, void *arg);
+void dispatch_batch(struct thread_pool *from_me, const struct job *jobs, int n);
+unsigned long thread_pool_job_wait(void);
+int thread_pool_resize(struct thread_pool *pool, int min_threads,
+		       int max_threads);
 void thread_pool_delete(struct thread_pool * pool);
@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "timer_wheel.h"
+
+#define TW_MASK		(TW_SLOTS - 1)
+#define TW_MAX		((1UL << (TW_LEVELS * TW_BITS)) - 1)
+
+static void list_init(struct timer *head)
+{
+	head->next = head->prev = head;
+}
+
+static void list_add(struct timer *head, struct timer *timer)
+{
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+static void list_del(struct timer *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = timer->prev = NULL;
+}
+
+/*
+ * Put the timer to the lowest level its delta fits, with the lock held. the
+ * slot is picked by the absolute expire tick, so the timer is moved down
+ * exactly when the lower wheel reaches that span.
+ */
+static void wheel_insert(struct timer_wheel *wheel, struct timer *timer)
+{
+	int level;
+	unsigned long delta;
+
+	if (timer->expire <= wheel->ticks)
+		timer->expire = wheel->ticks + 1;
+	delta = timer->expire - wheel->ticks;
+	if (delta > TW_MAX) {
+		delta = TW_MAX;
+		timer->expire = wheel->ticks + TW_MAX;
+	}
+
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (delta < 1UL << ((level + 1) * TW_BITS))
+			break;
+	}
+	list_add(&wheel->slots[level]
+			      [(timer->expire >> (level * TW_BITS)) & TW_MASK],
+		 timer);
+}
+
+/* run one tick, with the lock held. */
+static void wheel_tick(struct timer_wheel *wheel)
+{
+	int level;
+	unsigned long ms;
+	struct timer list, *timer, *head;
+
+	wheel->ticks++;
+	__atomic_store_n(&wheel->now, wheel->ticks * wheel->tick_ms,
+			 __ATOMIC_RELEASE);
+
+	/* the upper wheels move down the slot they just entered. */
+	for (level = TW_LEVELS - 1; level > 0; level--) {
+		if (wheel->ticks & ((1UL << (level * TW_BITS)) - 1))
+			continue;
+		head = &wheel->slots[level][(wheel->ticks >>
+					     (level * TW_BITS)) & TW_MASK];
+		while ((timer = head->next) != head) {
+			list_del(timer);
+			wheel_insert(wheel, timer);
+		}
+	}
+
+	/* detach the expired first, the callbacks may arm them again. */
+	head = &wheel->slots[0][wheel->ticks & TW_MASK];
+	if (head->next == head)
+		return;
+	list.next = head->next;
+	list.prev = head->prev;
+	list.next->prev = list.prev->next = &list;
+	list_init(head);
+
+	while ((timer = list.next) != &list) {
+		list_del(timer);
+		if ((ms = timer->fn(timer))) {
+			timer->expire = wheel->ticks +
+					(ms + wheel->tick_ms - 1) / wheel->tick_ms;
+			wheel_insert(wheel, timer);
+		}
+	}
+}
+
+static unsigned long elapsed_ms(const struct timespec *start)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - start->tv_sec) * 1000 +
+	       (ts.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * The thread drives the wheel. it wakes up at every tick boundary, and
+ * catches up if it was late, the timers never fire early.
+ */
+static void *wheel_run(void *arg)
+{
+	unsigned long target;
+	struct timespec start, next;
+	struct timer_wheel *wheel = arg;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	next = start;
+	while (!__atomic_load_n(&wheel->stop, __ATOMIC_ACQUIRE)) {
+		next.tv_nsec += wheel->tick_ms * 1000000;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+				       NULL) == EINTR)
+			;
+
+		target = elapsed_ms(&start) / wheel->tick_ms;
+		pthread_mutex_lock(&wheel->lock);
+		while (wheel->ticks < target)
+			wheel_tick(wheel);
+		pthread_mutex_unlock(&wheel->lock);
+	}
+	return NULL;
+}
+
+struct timer_wheel *timer_wheel_new(unsigned long tick_ms)
+{
+	int i, j, err;
+	struct timer_wheel *wheel;
+
+	if (!(wheel = calloc(1, sizeof(*wheel)))) {
+		perror("allocate memory for timer wheel");
+		return NULL;
+	}
+	wheel->tick_ms = tick_ms > 0 ? tick_ms : 1;
+	for (i = 0; i < TW_LEVELS; i++) {
+		for (j = 0; j < TW_SLOTS; j++)
+			list_init(&wheel->slots[i][j]);
+	}
+	pthread_mutex_init(&wheel->lock, NULL);
+
+	if ((err = pthread_create(&wheel->thread, NULL, wheel_run, wheel))) {
+		fprintf(stderr, "create the timer thread: %s\n", strerror(err));
+		pthread_mutex_destroy(&wheel->lock);
+		free(wheel);
+		return NULL;
+	}
+	return wheel;
+}
+
+/* ms since the wheel started, in ticks. */
+unsigned long timer_wheel_now(struct timer_wheel *wheel)
+{
+	return __atomic_load_n(&wheel->now, __ATOMIC_ACQUIRE);
+}
+
+void timer_init(struct timer *timer, timer_fn fn)
+{
+	timer->next = timer->prev = NULL;
+	timer->fn = fn;
+}
+
+/* fire the timer after 'ms', it's moved if it has been armed. */
+void timer_arm(struct timer_wheel *wheel, struct timer *timer,
+	       unsigned long ms)
+{
+	pthread_mutex_lock(&wheel->lock);
+	if (timer->next)
+		list_del(timer);
+	timer->expire = wheel->ticks + (ms + wheel->tick_ms - 1) /
+				       wheel->tick_ms;
+	wheel_insert(wheel, timer);
+	pthread_mutex_unlock(&wheel->lock);
+}
+
+/*
+ * Once it returned, the callback is neither running nor will be called, so
+ * the object holding the timer can be freed.
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer)
+{
+	pthread_mutex_lock(&wheel->lock);
+	if (timer->next)
+		list_del(timer);
+	pthread_mutex_unlock(&wheel->lock);
+}
+
+/* the timers still armed are simply forgotten. */
+void timer_wheel_delete(struct timer_wheel *wheel)
+{
+	if (!wheel)
+		return;
+	__atomic_store_n(&wheel->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(wheel->thread, NULL);
+	pthread_mutex_destroy(&wheel->lock);
+	free(wheel);
+}
@@ -0,0 +1,44 @@
+#include <pthread.h>
+
+/*
+ * The hierarchical timer wheel: TW_LEVELS wheels of TW_SLOTS slots, a slot of
+ * level n spans TW_SLOTS^n ticks. the timers of a upper slot are moved down
+ * when the lower wheel wraps, so arm and cancel are O(1), and a tick only
+ * looks at the slots it passes. one thread drives the wheel for all timers.
+ */
+#define TW_BITS		6
+#define TW_SLOTS	(1 << TW_BITS)
+#define TW_LEVELS	4
+
+struct timer;
+
+/*
+ * Called when the timer expired, with the lock of wheel held, so it must be
+ * short and never touch the wheel. return ms to fire again, 0 if it's done.
+ */
+typedef unsigned long (*timer_fn)(struct timer *timer);
+
+struct timer {
+	struct timer *next;	/* NULL if it's not armed */
+	struct timer *prev;
+	unsigned long expire;	/* tick */
+	timer_fn fn;
+};
+
+struct timer_wheel {
+	pthread_mutex_t lock;
+	unsigned long tick_ms;
+	unsigned long ticks;	/* ticks run */
+	unsigned long now;	/* ms since started, read without the lock */
+	struct timer slots[TW_LEVELS][TW_SLOTS];	/* list heads */
+	pthread_t thread;
+	int stop;
+};
+
+struct timer_wheel *timer_wheel_new(unsigned long tick_ms);
+unsigned long timer_wheel_now(struct timer_wheel *wheel);
+void timer_init(struct timer *timer, timer_fn fn);
+void timer_arm(struct timer_wheel *wheel, struct timer *timer,
+	       unsigned long ms);
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+void timer_wheel_delete(struct timer_wheel *wheel);
@@ -0,0 +1,362 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING	1
+#endif
+#endif
+
+/* the headers are newer than the libc, or the other way around. */
+#if defined(HAVE_IO_URING) && !defined(__NR_io_uring_setup)
+#undef HAVE_IO_URING
+#endif
+
+#if defined(HAVE_IO_URING)
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static void uring_unmap(struct uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+/*
+ * Create a ring of 'entries' submissions and 'cq_entries' completions. return
+ * NULL on error, errno is ENOSYS or EPERM if the kernel doesn't allow
+ * io_uring at all.
+ */
+struct uring *uring_new(unsigned int entries, unsigned int cq_entries)
+{
+	unsigned int i;
+	unsigned int *array;
+	struct uring *ring;
+	struct io_uring_params p;
+
+	if (!(ring = calloc(1, sizeof(*ring))))
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	p.cq_entries = cq_entries;
+	if ((ring->fd = io_uring_setup(entries, &p)) == -1)
+		goto free_ring;
+	ring->features = p.features;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes +
+			     p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		goto unmap;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			goto unmap;
+		}
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto unmap;
+	}
+
+	ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = *(unsigned *)((char *)ring->sq_ring +
+				      p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = *(unsigned *)((char *)ring->cq_ring +
+				      p.cq_off.ring_mask);
+	ring->cqes = (char *)ring->cq_ring + p.cq_off.cqes;
+
+	/* slot i of the array always points to sqe i, we fill them in order. */
+	array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+
+	ring->multishot = 1;
+	pthread_mutex_init(&ring->sq_lock, NULL);
+	return ring;
+
+unmap:
+	uring_unmap(ring);
+	close(ring->fd);
+free_ring:
+	free(ring);
+	return NULL;
+}
+
+/*
+ * Take the next free sqe, with 'sq_lock' held. if the queue is full, the
+ * kernel is asked to consume it first.
+ */
+static struct io_uring_sqe *sqe_get(struct uring *ring)
+{
+	unsigned int head, tail = *ring->sq_tail;
+	struct io_uring_sqe *sqe;
+
+	for (;;) {
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head < ring->sq_entries)
+			break;
+		if (io_uring_enter(ring->fd, ring->sq_entries, 0, 0) == -1 &&
+		    errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			return NULL;
+	}
+
+	sqe = (struct io_uring_sqe *)ring->sqes + (tail & ring->sq_mask);
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/* publish the sqe filled, the kernel takes it at the next io_uring_enter(). */
+static void sqe_commit(struct uring *ring)
+{
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Accept the connections of 'sk', multishot if the kernel supports it, so
+ * one submission keeps reporting them. the connections are nonblocking.
+ */
+int uring_accept(struct uring *ring, int sk, unsigned long long data)
+{
+	struct io_uring_sqe *sqe;
+
+	pthread_mutex_lock(&ring->sq_lock);
+	if (!(sqe = sqe_get(ring))) {
+		pthread_mutex_unlock(&ring->sq_lock);
+		return -1;
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = sk;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	if (ring->multishot)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = data;
+	sqe_commit(ring);
+	pthread_mutex_unlock(&ring->sq_lock);
+	return 0;
+}
+
+int uring_recv(struct uring *ring, int sk, void *buf, size_t len,
+	       unsigned long long data)
+{
+	struct io_uring_sqe *sqe;
+
+	pthread_mutex_lock(&ring->sq_lock);
+	if (!(sqe = sqe_get(ring))) {
+		pthread_mutex_unlock(&ring->sq_lock);
+		return -1;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sk;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->user_data = data;
+	sqe_commit(ring);
+	pthread_mutex_unlock(&ring->sq_lock);
+	return 0;
+}
+
+/*
+ * Complete with -ETIME after 'msec', it's how the waiter wakes up without
+ * any event. only one of them can be pending, they share 'tick'.
+ */
+int uring_timeout(struct uring *ring, int msec, unsigned long long data)
+{
+	struct io_uring_sqe *sqe;
+
+	pthread_mutex_lock(&ring->sq_lock);
+	if (!(sqe = sqe_get(ring))) {
+		pthread_mutex_unlock(&ring->sq_lock);
+		return -1;
+	}
+	ring->tick[0] = msec / 1000;
+	ring->tick[1] = msec % 1000 * 1000000LL;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long)ring->tick;
+	sqe->len = 1;
+	sqe->user_data = data;
+	sqe_commit(ring);
+	pthread_mutex_unlock(&ring->sq_lock);
+	return 0;
+}
+
+/* cancel the request submitted with 'target'. */
+int uring_cancel(struct uring *ring, unsigned long long target,
+		 unsigned long long data)
+{
+	struct io_uring_sqe *sqe;
+
+	pthread_mutex_lock(&ring->sq_lock);
+	if (!(sqe = sqe_get(ring))) {
+		pthread_mutex_unlock(&ring->sq_lock);
+		return -1;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = data;
+	sqe_commit(ring);
+	pthread_mutex_unlock(&ring->sq_lock);
+	return 0;
+}
+
+/*
+ * Hand the queued submissions to the kernel, without waiting. the kernel
+ * takes at most the ones which have been committed, it's fine that the
+ * other threads are filling the queue meanwhile.
+ */
+int uring_submit(struct uring *ring)
+{
+	while (io_uring_enter(ring->fd, ring->sq_entries, 0, 0) == -1) {
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EBUSY)
+			return 0;	/* retried at the next one */
+		perror("io_uring_enter");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Submit the queued requests and wait for at least one completion, by a
+ * single io_uring_enter(). return the number of events reaped, at most
+ * 'max', -1 on error.
+ */
+int uring_wait(struct uring *ring, struct uring_event *events, int max)
+{
+	int n = 0, wait;
+	unsigned int head, tail, queued;
+	struct io_uring_cqe *cqe;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	queued = __atomic_load_n(ring->sq_tail, __ATOMIC_ACQUIRE) -
+		 __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (head == tail || queued) {
+		wait = head == tail;
+		if (io_uring_enter(ring->fd, ring->sq_entries, wait,
+				   wait ? IORING_ENTER_GETEVENTS : 0) == -1 &&
+		    errno != EINTR && errno != EAGAIN && errno != EBUSY &&
+		    errno != ETIME) {
+			perror("io_uring_enter");
+			return -1;
+		}
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	}
+
+	for (; head != tail && n < max; head++, n++) {
+		cqe = (struct io_uring_cqe *)ring->cqes + (head & ring->cq_mask);
+		events[n].data = cqe->user_data;
+		events[n].res = cqe->res;
+		events[n].more = !!(cqe->flags & IORING_CQE_F_MORE);
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+/* the pending requests are canceled by the kernel. */
+void uring_delete(struct uring *ring)
+{
+	if (!ring)
+		return;
+	uring_unmap(ring);
+	close(ring->fd);
+	pthread_mutex_destroy(&ring->sq_lock);
+	free(ring);
+}
+
+#else	/* !HAVE_IO_URING */
+
+struct uring *uring_new(unsigned int entries, unsigned int cq_entries)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+int uring_accept(struct uring *ring, int sk, unsigned long long data)
+{
+	return -1;
+}
+
+int uring_recv(struct uring *ring, int sk, void *buf, size_t len,
+	       unsigned long long data)
+{
+	return -1;
+}
+
+int uring_timeout(struct uring *ring, int msec, unsigned long long data)
+{
+	return -1;
+}
+
+int uring_cancel(struct uring *ring, unsigned long long target,
+		 unsigned long long data)
+{
+	return -1;
+}
+
+int uring_submit(struct uring *ring)
+{
+	return -1;
+}
+
+int uring_wait(struct uring *ring, struct uring_event *events, int max)
+{
+	return -1;
+}
+
+void uring_delete(struct uring *ring)
+{
+}
+
+#endif
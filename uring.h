@@ -0,0 +1,47 @@
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * A io_uring instance driven by the raw syscalls, without liburing. the
+ * submission queue is shared, the threads fill it under 'sq_lock'. the
+ * completion queue is reaped by one thread only.
+ */
+struct uring {
+	int fd;
+	unsigned int features;		/* IORING_FEAT_* of the kernel */
+	int multishot;			/* 1 if the multishot accept works */
+	pthread_mutex_t sq_lock;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	void *sqes;			/* struct io_uring_sqe */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	void *cqes;			/* struct io_uring_cqe */
+	void *sq_ring;			/* the mappings, for munmap() */
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	long long tick[2];		/* struct __kernel_timespec of timeout */
+};
+
+/* a completion, 'data' is the one given when the request was submitted */
+struct uring_event {
+	unsigned long long data;
+	int res;			/* result, -errno on error */
+	int more;			/* 1 if the multishot request goes on */
+};
+
+struct uring *uring_new(unsigned int entries, unsigned int cq_entries);
+int uring_accept(struct uring *ring, int sk, unsigned long long data);
+int uring_recv(struct uring *ring, int sk, void *buf, size_t len,
+	       unsigned long long data);
+int uring_timeout(struct uring *ring, int msec, unsigned long long data);
+int uring_cancel(struct uring *ring, unsigned long long target,
+		 unsigned long long data);
+int uring_submit(struct uring *ring);
+int uring_wait(struct uring *ring, struct uring_event *events, int max);
+void uring_delete(struct uring *ring);